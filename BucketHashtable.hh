@@ -0,0 +1,511 @@
+#pragma once
+#include "config.h"
+#include "compiler.hh"
+#include <stddef.h>
+#include <string.h>
+#include <type_traits>
+#if __SSE2__
+#include <emmintrin.h>
+#endif
+#include "Interface.hh"
+#include "Transaction.hh"
+#include "print_value.hh"
+#include "TNuma.hh"
+
+#ifndef READ_MY_WRITES
+#define READ_MY_WRITES 1
+#endif
+
+// A transactional hashtable with the same interface as Hashtable, laid out
+// to cut cache misses per lookup. Each bucket starts with a cache line
+// holding the bucket version, an overflow pointer, and one 8-bit hash tag
+// per slot; the key/value/version slots follow inline. A lookup matches
+// the tags with SSE2 and compares full keys only on tag hits, so a get
+// usually touches the bucket header and a single slot line, with no
+// pointer chasing. Buckets that fill up chain to overflow buckets of the
+// same layout.
+//
+// Transactions key their items by slot, so a freed slot is retired rather
+// than reused at once: it isn't handed to another key until every
+// transaction that could hold an item for it has finished.
+//
+// Keys and values must be trivially copyable. The bucket count is fixed
+// at construction; size it for roughly half-full buckets.
+template <typename K, typename V, bool Opacity = true, unsigned Init_size = 129,
+          typename Hash = std::hash<K>, typename Pred = std::equal_to<K>>
+class BucketHashtable : public TObject {
+public:
+    typedef K key_type;
+    typedef V value_type;
+    typedef V write_value_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+    static constexpr unsigned initial_size = Init_size;
+    typedef typename std::conditional<Opacity, TVersion, TNonopaqueVersion>::type Version_type;
+
+    static constexpr unsigned nslots = 8;
+    static constexpr typename Version_type::type invalid_bit = TransactionTid::user_bit;
+
+    static_assert(mass::is_trivially_copyable<K>::value, "BucketHashtable keys must be trivially copyable");
+    static_assert(mass::is_trivially_copyable<V>::value, "BucketHashtable values must be trivially copyable");
+
+private:
+    struct slot {
+        Version_type version;
+        K key;
+        V value;
+    };
+
+    typedef Transaction::epoch_type epoch_type;
+
+    struct bucket {
+        Version_type version;  // only meaningful in a chain's first bucket
+        bucket* overflow;
+        uint8_t tags[nslots];  // free_tag, retired_tag, or a key's tag
+        epoch_type retired_epoch;  // when a slot here was last retired
+        char pad_[64 - sizeof(Version_type) - sizeof(bucket*) - nslots - sizeof(epoch_type)];
+        slot slots[nslots];
+
+        bucket() : version(0), overflow(nullptr), retired_epoch(0) {
+            memset(tags, 0, sizeof(tags));
+        }
+    };
+    static_assert(offsetof(bucket, slots) == 64, "bucket header is one cache line");
+
+    bucket* map_;
+    size_t nbuckets_;
+    Hash hasher_;
+    Pred pred_;
+    TNumaPolicy policy_;
+
+    static constexpr uint8_t free_tag = 0;
+    static constexpr uint8_t retired_tag = 1;
+    static constexpr uintptr_t bucket_bit = 1;
+    static constexpr TransItem::flags_type insert_bit = TransItem::user0_bit;
+    static constexpr TransItem::flags_type delete_bit = TransItem::user0_bit << 1;
+
+public:
+    // `size` is the number of buckets; `policy` controls their NUMA placement
+    BucketHashtable(unsigned size = Init_size, Hash h = Hash(), Pred p = Pred(), TNumaPolicy policy = TNumaPolicy::none)
+        : nbuckets_(size ? size : 1), hasher_(h), pred_(p), policy_(policy) {
+        map_ = static_cast<bucket*>(TNuma::allocate(sizeof(bucket) * nbuckets_, policy_));
+        for (size_t i = 0; i != nbuckets_; ++i)
+            new(&map_[i]) bucket;
+    }
+    BucketHashtable(const BucketHashtable&) = delete;
+    BucketHashtable& operator=(const BucketHashtable&) = delete;
+    ~BucketHashtable() {
+        for (size_t i = 0; i != nbuckets_; ++i)
+            for (bucket* b = map_[i].overflow; b; ) {
+                bucket* next = b->overflow;
+                TNuma::free(b);
+                b = next;
+            }
+        TNuma::free(map_);
+    }
+
+    size_t hash(const K& k) const {
+        return hasher_(k);
+    }
+    size_t nbuckets() const {
+        return nbuckets_;
+    }
+
+    // returns true if found false if not
+    template <typename KT, typename VT>
+    bool transGet(const KT& k, VT& retval) {
+        size_t h = hash(k);
+        bucket& buck = primary(h);
+        while (1) {
+            Version_type buck_version = buck.version;
+            fence();
+            slot* s = find(buck, h, k);
+            if (!s) {
+                Sto::item(this, pack_bucket(&buck)).observe(Version_type(buck_version.unlocked()));
+                return false;
+            }
+            auto item = t_read_only_item(s);
+#if READ_MY_WRITES
+            if (has_delete(item))
+                return false;
+            if (item.has_write()) {
+                // retirement keeps our slots from changing keys
+                assert(pred_(s->key, k));
+                retval = item.template write_value<write_value_type>();
+                return true;
+            }
+#endif
+            Version_type v;
+            V value;
+            if (!read_slot(s, k, v, value))
+                continue;  // slot reused for another key; look again
+            if (!has_insert(item) && (v.value() & invalid_bit)) {
+                Sto::abort();
+                return false;
+            }
+            item.observe(v);
+            retval = value;
+            return true;
+        }
+    }
+
+    // returns true if successful
+    bool transDelete(const K& k) {
+        size_t h = hash(k);
+        bucket& buck = primary(h);
+        while (1) {
+            Version_type buck_version = buck.version;
+            fence();
+            slot* s = find(buck, h, k);
+            if (!s) {
+                Sto::item(this, pack_bucket(&buck)).observe(Version_type(buck_version.unlocked()));
+                return false;
+            }
+            auto item = Sto::item(this, s);
+            Version_type v;
+            V value;
+            if (!read_slot(s, k, v, value))
+                continue;
+            bool valid = !(v.value() & invalid_bit);
+#if READ_MY_WRITES
+            if (!valid && has_insert(item)) {
+                // deleting our own insert: free the slot now, and only
+                // check that nobody else inserts the key
+                free_slot(s);
+                item.remove_read().remove_write().clear_flags(insert_bit | delete_bit);
+                Sto::item(this, pack_bucket(&buck)).observe(Version_type(buck_version.unlocked()));
+                return true;
+            }
+#endif
+            if (!valid) {
+                Sto::abort();
+                return false;
+            }
+#if READ_MY_WRITES
+            if (has_delete(item))
+                return false;
+#endif
+            item.observe(v);
+            item.add_write().add_flags(delete_bit);
+            return true;
+        }
+    }
+
+    template <typename KT, typename VT>
+    bool transPut(const KT& k, const VT& v) {
+        return trans_write</*insert*/true, /*set*/true>(k, v);
+    }
+    // returns true if successful
+    template <typename KT, typename VT>
+    bool transInsert(const KT& k, const VT& v) {
+        return !trans_write</*insert*/true, /*set*/false>(k, v);
+    }
+    template <typename KT, typename VT>
+    bool transUpdate(const KT& k, const VT& v) {
+        return trans_write</*insert*/false, /*set*/true>(k, v);
+    }
+
+    V transGet(K k) {
+        V v = V();
+        transGet(k, v);
+        return v;
+    }
+
+    bool check(TransItem& item, Transaction&) override {
+        if (is_bucket(item))
+            return bucket_key(item)->version.check_version(item.template read_value<Version_type>());
+        return item.key<slot*>()->version.check_version(item.template read_value<Version_type>());
+    }
+    bool lock(TransItem& item, Transaction& txn) override {
+        assert(!is_bucket(item));
+        return txn.try_lock(item, item.key<slot*>()->version);
+    }
+    void install(TransItem& item, Transaction& txn) override {
+        assert(!is_bucket(item));
+        slot* s = item.key<slot*>();
+        if (has_delete(item)) {
+            // the slot is freed in cleanup()
+            s->version.set_version_locked(s->version.value() | invalid_bit);
+            return;
+        }
+        if (!has_insert(item))
+            s->value = item.template write_value<write_value_type>();
+        s->version.set_version(txn.commit_tid());
+        if (Opacity && has_insert(item)) {
+            // convert the nonopaque bucket version to a commit tid
+            bucket& buck = primary(hash(s->key));
+            lock(buck.version);
+            if (buck.version.value() & TransactionTid::nonopaque_bit)
+                buck.version.set_version(txn.commit_tid());
+            unlock(buck.version);
+        }
+    }
+    void unlock(TransItem& item) override {
+        assert(!is_bucket(item));
+        unlock(item.key<slot*>()->version);
+    }
+    void cleanup(TransItem& item, bool committed) override {
+        if (committed ? has_delete(item) : has_insert(item))
+            free_slot(item.key<slot*>());
+    }
+    void print(std::ostream& w, const TransItem& item) const override {
+        w << "{BucketHashtable<" << typeid(K).name() << "," << typeid(V).name() << "> " << (void*) this;
+        if (is_bucket(item))
+            w << ".b[" << (void*) bucket_key(item) << "]";
+        else
+            w << "[" << mass::print_value(item.key<slot*>()->key) << "]";
+        if (item.has_read())
+            w << " R" << item.read_value<Version_type>();
+        if (item.has_write() && !has_delete(item))
+            w << " =" << mass::print_value(item.write_value<write_value_type>());
+        w << "}";
+    }
+
+    // non-transactional operations
+    bool nontrans_find(const K& k, V& v) {
+        size_t h = hash(k);
+        while (slot* s = find(primary(h), h, k)) {
+            Version_type vers;
+            if (read_slot(s, k, vers, v))
+                return !(vers.value() & invalid_bit);
+        }
+        return false;
+    }
+    V unsafe_get(const K& k) {
+        V v = V();
+        nontrans_find(k, v);
+        return v;
+    }
+    bool nontrans_insert(const K& k, const V& v) {
+        size_t h = hash(k);
+        bucket& buck = primary(h);
+        lock(buck.version);
+        bool inserted = !find(buck, h, k);
+        if (inserted) {
+            slot* s = insert_locked(buck, h, k, v);
+            s->version.lock();
+            s->version.set_version_unlock(Sto::initialized_tid());
+            buck.version.inc_nonopaque_version();
+        }
+        unlock(buck.version);
+        return inserted;
+    }
+    bool nontrans_remove(const K& k) {
+        size_t h = hash(k);
+        slot* s = find(primary(h), h, k);
+        if (s) {
+            s->version.lock();
+            s->version.set_version_unlock(s->version.value() | invalid_bit);
+            free_slot(s);
+        }
+        return s;
+    }
+
+    void print_stats() {
+        size_t count = 0, overflow = 0;
+        for (size_t i = 0; i != nbuckets_; ++i)
+            for (bucket* b = &map_[i]; b; b = b->overflow) {
+                overflow += b != &map_[i];
+                for (unsigned j = 0; j != nslots; ++j)
+                    count += b->tags[j] > retired_tag;
+            }
+        printf("Total count: %zu, Buckets: %zu, Overflow buckets: %zu, Load: %f\n",
+               count, nbuckets_, overflow, double(count) / (nbuckets_ * nslots));
+    }
+
+private:
+    template <bool INSERT, bool SET, typename KT, typename VT>
+    bool trans_write(const KT& k, const VT& v) {
+        size_t h = hash(k);
+        bucket& buck = primary(h);
+        lock(buck.version);
+        slot* s = find(buck, h, k);
+        if (s) {
+            // read the version while the slot can't be reused
+            Version_type elemvers = s->version;
+            fence();
+            unlock(buck.version);
+            auto item = Sto::item(this, s);
+            if (!has_insert(item) && (elemvers.value() & invalid_bit)) {
+                Sto::abort();
+                return false;
+            }
+#if READ_MY_WRITES
+            if (has_delete(item)) {
+                // delete-then-insert == update; delete-then-update == not found
+                if (INSERT)
+                    item.clear_flags(delete_bit).clear_write().template add_write<write_value_type>(v);
+                return false;
+            }
+#endif
+            // make sure the key isn't deleted before we commit
+            item.observe(elemvers);
+            if (SET) {
+                item.template add_write<write_value_type>(v);
+#if READ_MY_WRITES
+                // our own insert: install won't copy the value
+                if (has_insert(item))
+                    s->value = v;
+#endif
+            }
+            return true;
+        }
+
+        if (!INSERT) {
+            auto buck_vers = buck.version.unlocked();
+            unlock(buck.version);
+            Sto::item(this, pack_bucket(&buck)).observe(Version_type(buck_vers));
+            return false;
+        }
+
+        auto prev_version = buck.version.unlocked();
+        s = insert_locked(buck, h, k, v);  // marked invalid
+        buck.version.inc_nonopaque_version();
+        auto new_version = buck.version.unlocked();
+        fence();
+        unlock(buck.version);
+        if (auto bucket_item = Sto::check_item(this, pack_bucket(&buck)))
+            bucket_item->update_read(Version_type(prev_version), Version_type(new_version));
+        auto item = Sto::item(this, s);
+        item.template add_write<write_value_type>(v);
+        item.add_flags(insert_bit);
+        return false;
+    }
+
+    bucket& primary(size_t h) {
+        return map_[h % nbuckets_];
+    }
+    // std::hash is often the identity, so mix before taking the top bits
+    static uint8_t make_tag(size_t h) {
+        uint8_t tag = (uint64_t) h * 0x9E3779B97F4A7C15ULL >> 56;
+        return tag > retired_tag ? tag : tag + 2;
+    }
+    // bitmask of slots in `b` whose tag equals `tag`
+    static unsigned match_tags(const bucket* b, uint8_t tag) {
+#if __SSE2__
+        __m128i tags = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b->tags));
+        __m128i eq = _mm_cmpeq_epi8(tags, _mm_set1_epi8(tag));
+        return _mm_movemask_epi8(eq) & ((1U << nslots) - 1);
+#else
+        unsigned m = 0;
+        for (unsigned i = 0; i != nslots; ++i)
+            m |= unsigned(b->tags[i] == tag) << i;
+        return m;
+#endif
+    }
+
+    // Finds the slot holding `k`. Without the bucket lock the result can go
+    // stale at any time; read_slot() detects that.
+    template <typename KT>
+    slot* find(bucket& buck, size_t h, const KT& k) {
+        uint8_t tag = make_tag(h);
+        for (bucket* b = &buck; b; b = b->overflow) {
+            fence();
+            for (unsigned m = match_tags(b, tag); m; m &= m - 1) {
+                slot* s = &b->slots[ctz(m)];
+                if (pred_(s->key, k))
+                    return s;
+            }
+        }
+        return nullptr;
+    }
+
+    // Reads slot `s`'s version and value, returning false if the slot no
+    // longer holds `k`. Writers change a slot's version before touching its
+    // key or value, so an unchanged version means a consistent read.
+    template <typename KT>
+    bool read_slot(slot* s, const KT& k, Version_type& v, V& value) {
+        while (1) {
+            Version_type v0 = s->version;
+            fence();
+            if (!pred_(s->key, k))
+                return false;
+            value = s->value;
+            fence();
+            v = s->version;
+            if (v0 == v && !v.is_locked())
+                return true;
+            relax_fence();
+        }
+    }
+
+    // Claims a free slot for `k` in the chain starting at `buck`, which
+    // must be locked. The slot starts out invalid.
+    slot* insert_locked(bucket& buck, size_t h, const K& k, const V& v) {
+        assert(buck.version.is_locked());
+        bucket* b = &buck;
+        unsigned m;
+        while (!(m = free_slots(b))) {
+            if (!b->overflow) {
+                bucket* nb = new(TNuma::allocate(sizeof(bucket), policy_)) bucket;
+                release_fence();
+                b->overflow = nb;
+            }
+            b = b->overflow;
+        }
+        unsigned i = ctz(m);
+        slot* s = &b->slots[i];
+        // A reused slot's version moves forward, so stale observations fail.
+        auto vers = s->version.value();
+        s->version = Version_type(((vers & ~TransactionTid::lock_bit) + TransactionTid::increment_value) | invalid_bit);
+        fence();
+        s->key = k;
+        s->value = v;
+        release_fence();
+        b->tags[i] = make_tag(h);
+        return s;
+    }
+
+    // bitmask of slots in `b` that insert_locked() may claim
+    static unsigned free_slots(const bucket* b) {
+        if (unsigned m = match_tags(b, free_tag))
+            return m;
+        Transaction::signed_epoch_type age = b->retired_epoch - Transaction::global_epochs.active_epoch;
+        return age < 0 ? match_tags(b, retired_tag) : 0;
+    }
+
+    // Retires slot `s`: lookups stop finding it, and free_slots() offers it
+    // once no transaction from before now is running.
+    void free_slot(slot* s) {
+        size_t h = hash(s->key);
+        bucket& buck = primary(h);
+        lock(buck.version);
+        for (bucket* b = &buck; b; b = b->overflow)
+            if (s >= b->slots && s < b->slots + nslots) {
+                b->tags[s - b->slots] = retired_tag;
+                b->retired_epoch = Transaction::global_epochs.global_epoch;
+                break;
+            }
+        unlock(buck.version);
+    }
+
+    static bool has_insert(const TransItem& item) {
+        return item.flags() & insert_bit;
+    }
+    static bool has_delete(const TransItem& item) {
+        return item.flags() & delete_bit;
+    }
+    static bool is_bucket(const TransItem& item) {
+        return item.key<uintptr_t>() & bucket_bit;
+    }
+    static bucket* bucket_key(const TransItem& item) {
+        return reinterpret_cast<bucket*>(item.key<uintptr_t>() - bucket_bit);
+    }
+    static void* pack_bucket(bucket* b) {
+        return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(b) | bucket_bit);
+    }
+    static void lock(Version_type& v) {
+        v.lock();
+    }
+    static void unlock(Version_type& v) {
+        v.unlock();
+    }
+
+    TransProxy t_read_only_item(slot* s) {
+#if READ_MY_WRITES
+        return Sto::read_item(this, s);
+#else
+        return Sto::fresh_item(this, s);
+#endif
+    }
+};
@@ -3,11 +3,17 @@
 #include "compiler.hh"
 // XXX: honestly hashtable should probably use local_vector too
 #include <vector>
+#include <atomic>
+#include <thread>
+#include <functional>
 #include "Interface.hh"
 #include "Transaction.hh"
 #include "TWrapped.hh"
 #include "simple_str.hh"
+#include "InlineStr.hh"
 #include "print_value.hh"
+#include "TNuma.hh"
+#include "SecondaryIndex.hh"
 
 #define HASHTABLE_DELETE 1
 
@@ -15,11 +21,76 @@
 #define READ_MY_WRITES 1
 #endif 
 
-template <typename K, typename V, bool Opacity = true, unsigned Init_size = 129, typename W = V, typename Hash = std::hash<K>, typename Pred = std::equal_to<K>>
+// default maximum average chain length before the table grows
+#ifndef HASHTABLE_MAX_LOAD_FACTOR
+#define HASHTABLE_MAX_LOAD_FACTOR 2.0
+#endif
+
+// default for Hashtable::lazy_inserts()
+#ifndef HASHTABLE_LAZY_INSERTS
+#define HASHTABLE_LAZY_INSERTS 0
+#endif
+
+// How Hashtable nodes store keys and how lookups compare with them. By
+// default nodes store a Key, and every use rehashes it with Hash.
+template <typename K, typename Hash, typename Pred>
+struct hashtable_key_traits {
+    typedef K stored_type;
+    // what lookups take
+    typedef const K& arg_type;
+
+    static size_t hash(const Hash& hasher, arg_type k) {
+        return hasher(k);
+    }
+    static size_t stored_hash(const Hash& hasher, const stored_type& k) {
+        return hasher(k);
+    }
+    static bool match(const Pred& pred, const stored_type& stored, arg_type k, size_t) {
+        return pred(stored, k);
+    }
+    static arg_type arg(const stored_type& k) {
+        return k;
+    }
+    static const K& key(const stored_type& k) {
+        return k;
+    }
+};
+
+// std::string keys with the default hash and equality are stored as
+// InlineStrs, and looked up by StrRef, so a lookup by C string or
+// (pointer, length) allocates nothing. The cached hash rejects most
+// mismatches and makes rehashing a node (on resize, insert, or remove)
+// free.
+template <>
+struct hashtable_key_traits<std::string, std::hash<std::string>, std::equal_to<std::string>> {
+    typedef InlineStr stored_type;
+    typedef StrRef arg_type;
+
+    static size_t hash(const std::hash<std::string>&, arg_type k) {
+        return k.hash();
+    }
+    static size_t stored_hash(const std::hash<std::string>&, const stored_type& k) {
+        return k.hash();
+    }
+    static bool match(const std::equal_to<std::string>&, const stored_type& stored, arg_type k, size_t h) {
+        return stored.hash() == h && stored == k;
+    }
+    static arg_type arg(const stored_type& k) {
+        return k.ref();
+    }
+    static std::string key(const stored_type& k) {
+        return k.str();
+    }
+};
+
+// Phantom_stripes > 1 gives each bucket that many versions guarding
+// absent-key reads, so inserts of unrelated keys into a bucket don't
+// invalidate them (see phantom_stripes).
+template <typename K, typename V, bool Opacity = true, unsigned Init_size = 129, typename W = V, typename Hash = std::hash<K>, typename Pred = std::equal_to<K>, unsigned Phantom_stripes = 1>
 #ifdef STO_NO_STM
 class Hashtable {
 #else
-class Hashtable : public TObject {
+class Hashtable : public TObject, public index_source<K, V> {
 #endif
 public:
     typedef K Key;
@@ -31,6 +102,14 @@ public:
     typedef typename std::conditional<Opacity, TWrapped<Value>, TNonopaqueWrapped<Value>>::type wrapped_type;
 
     typedef V write_value_type;
+    // a transApply update
+    typedef std::function<void(Value&)> apply_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+    typedef hashtable_key_traits<K, Hash, Pred> key_traits;
+    // what lookups take: const Key&, or StrRef for std::string keys
+    typedef typename key_traits::arg_type key_arg;
+    static constexpr unsigned initial_size = Init_size;
 
     static constexpr typename Version_type::type invalid_bit = TransactionTid::user_bit;
 private:
@@ -39,23 +118,76 @@ private:
   struct internal_elem {
     // nate: I wonder if this would perform better if these had their own
     // cache line.
-    Key key;
+    typename key_traits::stored_type key;
     internal_elem *next;
     Version_type version;
     wrapped_type value;
 #ifndef STO_NO_STM
-    internal_elem(Key k, Value val, bool mark_valid)
+    template <typename KT>
+    internal_elem(const KT& k, Value val, bool mark_valid)
         : key(k), next(NULL), version(Sto::initialized_tid() | (mark_valid ? 0 : invalid_bit)), value(val) {}
     bool valid() const {
         return !(version.value() & invalid_bit);
     }
 #else
-    internal_elem(Key k, Value val, bool)
+    template <typename KT>
+    internal_elem(const KT& k, Value val, bool)
         : key(k), next(NULL), version(Sto::initialized_tid()), value(val) {}
 #endif
   };
 
-  struct bucket_entry {
+  // An absent-key read observes a phantom version, which every insert of
+  // a key it covers bumps. By default that is the bucket version itself.
+  // With N > 1 stripes, each bucket also carries N stripe versions chosen
+  // by hash bits the bucket index doesn't depend on, and an insert bumps
+  // only its own key's stripe. Stripe versions are written only under
+  // the bucket lock, and never locked themselves.
+  template <unsigned N, typename Dummy = void>
+  struct phantom_stripes {
+    static_assert(N > 0, "Phantom_stripes must be positive");
+    Version_type stripes[N];
+
+    phantom_stripes() {
+      for (auto& v : stripes)
+        v = Version_type(0);
+    }
+    static size_t stripe(size_t h) {
+      return ((uint64_t) h * 0x9E3779B97F4A7C15ULL >> 32) % N;
+    }
+    Version_type& phantom(Version_type&, size_t h) {
+      return stripes[stripe(h)];
+    }
+    static void bump(Version_type& v) {
+      release_fence();
+      v = Version_type((v.value() + TransactionTid::increment_value) | TransactionTid::nonopaque_bit);
+    }
+    void bump(size_t h) {
+      bump(stripes[stripe(h)]);
+    }
+    void bump_all() {
+      for (auto& v : stripes)
+        bump(v);
+    }
+    void set_commit_tid(size_t h, TransactionTid::type tid) {
+      Version_type& v = stripes[stripe(h)];
+      if (v.value() & TransactionTid::nonopaque_bit)
+        v = Version_type(tid);
+    }
+  };
+  template <typename Dummy>
+  struct phantom_stripes<1, Dummy> {
+    Version_type& phantom(Version_type& bucket_version, size_t) {
+      return bucket_version;
+    }
+    void bump(size_t) {
+    }
+    void bump_all() {
+    }
+    void set_commit_tid(size_t, TransactionTid::type) {
+    }
+  };
+
+  struct bucket_entry : public phantom_stripes<Phantom_stripes> {
     // nate: we could inline the first element of a bucket. Would probably
     // make resize harder though.
     internal_elem *head;
@@ -64,47 +196,224 @@ private:
     // unsuccessful at commit time (because this will always be true if no
     // new inserts have occurred in this bucket)
     Version_type version;
-    bucket_entry() : head(NULL), version(0) {}
+    // counts committed changes to the bucket's keys and values, in steps
+    // of increment_value (see transScan)
+    typename Version_type::type changes;
+    // the largest tid of a node removed from the bucket (see transScan)
+    typename Version_type::type newest;
+    bucket_entry() : head(NULL), version(0), changes(0), newest(0) {}
+
+    // the version guarding absent-key reads of hash `h`
+    Version_type& phantom_version(size_t h) {
+      return this->phantom(version, h);
+    }
   };
 
-  typedef std::vector<bucket_entry> MapType;
-  // this is the hashtable itself, an array of bucket_entry's
-  MapType map_;
+  // The table grows by incremental two-table rehash. While a resize is in
+  // progress, `old` points to the previous table, and each of its buckets
+  // is moved into this one under the old bucket's lock. A moved old bucket
+  // is empty and has moved_bit set for good. A key lives in its old bucket
+  // until that bucket moves, and in the new table afterwards, so writers
+  // move a key's old bucket before locking its new one, and readers search
+  // the old bucket first. Moving bumps the old bucket's version, so
+  // absent-key observations made against it fail at commit. Retired tables
+  // are freed through RCU.
+  struct bucket_table {
+    size_t nbuckets;
+    std::atomic<bucket_table*> old;
+    std::atomic<size_t> next_migrate;  // for an old table: next bucket to move
+    std::atomic<size_t> nmigrated;     // for an old table: buckets moved so far
+    bucket_entry buckets[1];
+
+    bucket_table(size_t n)
+      : nbuckets(n), old(nullptr), next_migrate(0), nmigrated(0) {
+    }
+    bucket_entry& bucket(size_t h) {
+      return buckets[h % nbuckets];
+    }
+  };
+
+  // per-thread element counts, summed to decide when to grow
+  struct elem_count {
+    ssize_t n;
+    char pad_[64 - sizeof(ssize_t)];
+    elem_count() : n(0) {}
+  };
+
+  std::atomic<bucket_table*> table_;
   Hash hasher_;
   Pred pred_;
+  TNumaPolicy policy_;
+  double max_load_factor_;
+  bool lazy_inserts_;
+  elem_count counts_[MAX_THREADS];
+  // node slabs allocated by bulk_load, as [begin, end) address ranges
+  std::vector<std::pair<internal_elem*, internal_elem*>> slabs_;
+  // secondary indexes maintained by lock(), install(), and unlock(), and
+  // by nontransactional writes
+  std::vector<index_maintainer<Key, Value>*> indexes_;
+
+  static constexpr typename Version_type::type moved_bit = TransactionTid::user_bit;
+  // buckets moved per write while a resize is in progress
+  static constexpr size_t migrate_batch = 8;
+  // check the load factor every this many inserts per thread
+  static constexpr ssize_t grow_check_interval = 64;
 
   // used to mark whether a key is a bucket (for bucket version checks)
   // or a pointer (which will always have the lower 3 bits as 0)
   static constexpr uintptr_t bucket_bit = 1U<<0;
+  // marks the per-hash index of a transaction's unlinked lazy inserts
+  static constexpr uintptr_t pending_bit = 1U<<1;
+  // marks a transScan read of a whole bucket
+  static constexpr uintptr_t scan_bit = 1U<<2;
+  // transScan tries to read a bucket this many times before aborting
+  static constexpr unsigned scan_retries = 64;
 
   static constexpr TransItem::flags_type insert_bit = TransItem::user0_bit;
   static constexpr TransItem::flags_type delete_bit = TransItem::user0_bit<<1;
+  // an insert_bit item whose element is linked only at commit
+  static constexpr TransItem::flags_type lazy_bit = TransItem::user0_bit<<2;
+  // the write value is a delta (transIncrement) or an apply_type
+  // (transApply) to fold into the element's value at install
+  static constexpr TransItem::flags_type delta_bit = TransItem::user0_bit<<3;
+  static constexpr TransItem::flags_type apply_bit = TransItem::user0_bit<<4;
 
 public:
-  Hashtable(unsigned size = Init_size, Hash h = Hash(), Pred p = Pred()) : map_(), hasher_(h), pred_(p) {
-    map_.resize(size);
+  // `policy` controls NUMA placement of the bucket array
+  Hashtable(unsigned size = Init_size, Hash h = Hash(), Pred p = Pred(), TNumaPolicy policy = TNumaPolicy::none)
+    : hasher_(h), pred_(p), policy_(policy),
+      max_load_factor_(HASHTABLE_MAX_LOAD_FACTOR),
+      lazy_inserts_(HASHTABLE_LAZY_INSERTS) {
+    table_ = make_table(size ? size : 1, policy_);
+  }
+  Hashtable(const Hashtable&) = delete;
+  Hashtable& operator=(const Hashtable&) = delete;
+  ~Hashtable() {
+    for_each_bucket([this] (bucket_entry& buck) {
+      while (internal_elem* e = buck.head) {
+        buck.head = e->next;
+        delete_elem(e);
+      }
+    });
+    bucket_table* t = table_.load();
+    if (bucket_table* o = t->old.load())
+      free_table(o);
+    free_table(t);
+    for (auto& slab : slabs_)
+      TNuma::free(slab.first);
   }
 
-  inline size_t hash(const Key& k) {
-    return hasher_(k);
+  inline size_t hash(key_arg k) {
+    return key_traits::hash(hasher_, k);
   }
 
   inline size_t nbuckets() {
-    return map_.size();
+    return table_.load(std::memory_order_acquire)->nbuckets;
   }
 
-  inline size_t bucket(const Key& k) {
+  inline size_t bucket(key_arg k) {
     return hash(k) % nbuckets();
   }
 
+private:
+  // a node's hash, cached for std::string keys
+  size_t elem_hash(const internal_elem* e) {
+    return key_traits::stored_hash(hasher_, e->key);
+  }
+public:
+
+  // Approximate number of elements, including uncommitted inserts.
+  size_t size() const {
+    ssize_t n = 0;
+    for (auto& c : counts_)
+      n += c.n;
+    return n > 0 ? n : 0;
+  }
+
+  // The table doubles once size() exceeds max_load_factor() * nbuckets().
+  // A factor of 0 disables growth.
+  double max_load_factor() const {
+    return max_load_factor_;
+  }
+  void max_load_factor(double f) {
+    max_load_factor_ = f;
+  }
+
+  // With lazy inserts, a transactional insert of a missing key buffers its
+  // element in the transaction and links it into the bucket at commit,
+  // instead of linking an invalid element (and bumping the bucket version)
+  // while the transaction executes. Concurrent readers of the bucket then
+  // neither see the element nor fail their absent-key checks unless the
+  // insert commits. Set this before the table is shared.
+  bool lazy_inserts() const {
+    return lazy_inserts_;
+  }
+  void lazy_inserts(bool lazy) {
+    lazy_inserts_ = lazy;
+  }
+
+  bool resizing() const {
+    return table_.load(std::memory_order_acquire)->old.load(std::memory_order_acquire) != nullptr;
+  }
+
 #ifndef STO_NO_STM
+  // Maintains `idx` (e.g. a SecondaryIndex) along with the table from now
+  // on: every committed insert, update, and delete changes the index
+  // atomically with the row. Nontransactional writes (nontrans_insert,
+  // put, remove, bulk_load, and so on) update it too, though not
+  // atomically; writes through putIfAbsentPtr's or readPtr's pointer
+  // don't. Existing rows are added first. Call this before the table is
+  // shared; the table doesn't own `idx`.
+  void add_index(index_maintainer<Key, Value>& idx) {
+    idx.attach(this);
+    for (auto it = begin(); it != end(); ++it) {
+      auto kv = *it;
+      idx.nontrans_update(kv.first, nullptr, &kv.second);
+    }
+    indexes_.push_back(&idx);
+  }
+
+  // index_source: reports this transaction's writes to index lookups
+  void for_each_own_write(const typename index_source<Key, Value>::write_function& f) const override {
+    Transaction& txn = *Sto::transaction();
+    txn.for_each_item(this, [&] (TransItem& item) {
+      if (is_bucket(item) || is_pending(item) || !item.has_write())
+        return;
+      auto el = item.key<internal_elem*>();
+      if (has_delete(item))
+        f(key_traits::key(el->key), nullptr);
+      else if (has_insert(item))
+        f(key_traits::key(el->key), &el->value.access());
+      else if (!has_blind_update(item))
+        f(key_traits::key(el->key), &item.template write_value<write_value_type>());
+      else {
+        Value v = current_value(TransProxy(txn, item), el);
+        f(key_traits::key(el->key), &v);
+      }
+    });
+  }
+
   // returns true if found false if not
   template <typename KT, typename VT>
   bool transGet(const KT& k, VT& retval) {
-    bucket_entry& buck = buck_entry(k);
-    Version_type buck_version = buck.version;
-    fence();
-    internal_elem *e = find(buck, k);
+    return transRead(k, [&retval] (const Value& v) { retval = v; });
+  }
+
+  // Like transGet, but passes the value to `f(const Value&)` instead of
+  // assigning it, so a caller can copy it straight into its own buffer.
+  // The reference is only good until f returns.
+  template <typename KT, typename F>
+  bool transRead(const KT& k, F f) {
+    return trans_read(k, hash(k), f);
+  }
+
+private:
+  // transRead given the key's hash `h`
+  template <typename KT, typename F>
+  bool trans_read(const KT& k, size_t h, F f) {
+    Version_type* phantom;
+    Version_type phantom_vers(0);
+    internal_elem *e = find_trans(k, h, phantom, phantom_vers);
     if (e) {
       auto item = t_read_only_item(e);
       if (!validity_check(item, e)) {
@@ -116,8 +425,13 @@ public:
       if (has_delete(item)) {
         return false;
       }
+      if (has_blind_update(item)) {
+        // reading a blind update makes it depend on the current value
+        f(current_value(item, e));
+        return true;
+      }
       if (item.has_write()) {
-        retval = item.template write_value<write_value_type>();
+        f(item.template write_value<write_value_type>());
         return true;
       }
 #endif
@@ -128,23 +442,23 @@ public:
       //item.add_read(elem_vers);
       //if (Opacity)
       //  check_opacity(e->version);
-      retval = e->value.read(item, e->version);
+      f(e->value.read(item, e->version));
       return true;
     } else {
-      Sto::item(this, pack_bucket(bucket(k))).observe(Version_type(buck_version.unlocked()));
+      Sto::item(this, pack_phantom(phantom)).observe(Version_type(phantom_vers.unlocked()));
       //if (Opacity)
       //  check_opacity(buck.version);
       return false;
     }
   }
 
+public:
 #if HASHTABLE_DELETE
   // returns true if successful
-  bool transDelete(const Key& k) {
-    bucket_entry& buck = buck_entry(k);
-    Version_type buck_version = buck.version;
-    fence();
-    internal_elem *e = find(buck, k);
+  bool transDelete(key_arg k) {
+    Version_type* phantom;
+    Version_type phantom_vers(0);
+    internal_elem *e = find_trans(k, hash(k), phantom, phantom_vers);
     if (e) {
       Version_type elemvers = e->version;
       fence();
@@ -153,12 +467,15 @@ public:
 #if READ_MY_WRITES
       if (!valid && has_insert(item)) {
         // we're deleting our own insert. special case this to just remove element and just check for no insert at commit
-        _remove(e);
+        if (has_lazy_insert(item))
+          unlink_pending(e);
+        else
+          _remove(e);
         // no way to remove an item (would be pretty inefficient)
         // so we just unmark all attributes so the item is ignored
-        item.remove_read().remove_write().clear_flags(insert_bit | delete_bit);
+        item.remove_read().remove_write().clear_flags(insert_bit | delete_bit | lazy_bit);
         // insert-then-delete still can only succeed if no one else inserts this node so we add a check for that
-        Sto::item(this, pack_bucket(bucket(k))).observe(Version_type(buck_version.unlocked()));
+        Sto::item(this, pack_phantom(phantom)).observe(Version_type(phantom_vers.unlocked()));
         return true;
       } else
 #endif
@@ -179,11 +496,11 @@ public:
       //  check_opacity(e->version);
       // we use delete_bit to detect deletes so we don't need any other data
       // for deletes, just to mark it as a write
-      item.add_write().add_flags(delete_bit);
+      item.clear_write().clear_flags(delta_bit | apply_bit).add_write().add_flags(delete_bit);
       return true;
     } else {
       // add a read that yes this element doesn't exist
-      Sto::item(this, pack_bucket(bucket(k))).observe(Version_type(buck_version.unlocked()));
+      Sto::item(this, pack_phantom(phantom)).observe(Version_type(phantom_vers.unlocked()));
       //if (Opacity)
       //  check_opacity(buck.version);
       return false;
@@ -194,16 +511,17 @@ public:
 private:
   // returns true if item already existed, false if it did not
   template <bool INSERT, bool SET, typename KT, typename VT>
-  bool trans_write(const KT& k, const VT& v) {
+  bool trans_write(const KT& k, size_t h, const VT& v) {
     // TODO: technically puts don't need to look into the table at all until lock time
-    bucket_entry& buck = buck_entry(k);
-    // TODO: update doesn't need to lock the table
-    // also we should lock the head pointer instead so we don't
-    // mess with tids
-    lock(buck.version);
-    internal_elem *e = find(buck, k);
+    // Search optimistically, like transGet; only an insert of a missing
+    // key needs the bucket lock, so updates of existing keys never
+    // serialize on a hot bucket.
+    Version_type* phantom;
+    Version_type phantom_vers(0);
+    internal_elem *e = find_trans(k, h, phantom, phantom_vers);
+    if (!e && INSERT)
+      return lazy_inserts_ ? trans_insert_lazy(k, v) : trans_insert_locked<SET>(k, h, v);
     if (e) {
-      unlock(buck.version);
       Version_type elemvers = e->version;
       fence();
       auto item = t_item(e);
@@ -233,6 +551,8 @@ private:
       //  check_opacity(e->version);
 #endif
       if (SET) {
+        if (has_blind_update(item))
+          item.clear_write().clear_flags(delta_bit | apply_bit);
         item.template add_write<write_value_type>(v);
 #if READ_MY_WRITES
         if (has_insert(item)) {
@@ -243,62 +563,304 @@ private:
       }
       return true;
     } else {
-      if (!INSERT) {
-        auto buck_vers = buck.version.unlocked();
-        fence();
-        unlock(buck.version);
-        Sto::item(this, pack_bucket(bucket(k))).observe(Version_type(buck_vers));
-        //if (Opacity)
-        //    check_opacity(buck.version);
-        return false;
-      }
+      Sto::item(this, pack_phantom(phantom)).observe(Version_type(phantom_vers.unlocked()));
+      //if (Opacity)
+      //    check_opacity(buck.version);
+      return false;
+    }
+  }
 
-      auto prev_version = buck.version.unlocked();
-      // not there so need to insert
-      insert_locked<false>(buck, k, v); // marked as invalid
-      auto new_head = buck.head;
-      auto new_version = buck.version.unlocked();
-      fence();
+  // The insert half of trans_write: the optimistic search missed, so lock
+  // the bucket and search again before inserting.
+  template <bool SET, typename KT, typename VT>
+  bool trans_insert_locked(const KT& k, size_t h, const VT& v) {
+    bucket_entry& buck = lock_bucket(h);
+    if (find(buck, k, h)) {
+      // inserted since the optimistic search; retry that path
       unlock(buck.version);
-      // see if this item was previously read
-      auto bucket_item = Sto::check_item(this, pack_bucket(bucket(k)));
-      if (bucket_item) {
-        bucket_item->update_read(Version_type(prev_version), Version_type(new_version));
-        //} else { could abort transaction now
-      }
-      // use new_item because we know there are no collisions
-      auto item = Sto::new_item(this, new_head);
-      // don't actually need to Store anything for the write, just mark as valid on install
-      // (for now insert and set will just do the same thing on install, set a value and then mark valid)
-      item.template add_write<write_value_type>(v);
-      // need to remove this item if we abort
-      item.add_flags(insert_bit);
+      return trans_write</*insert*/true, SET>(k, h, v);
+    }
+    Version_type& phantom = buck.phantom_version(h);
+    auto prev_version = phantom.unlocked();
+    // not there so need to insert
+    insert_locked<false>(buck, k, v); // marked as invalid
+    auto new_head = buck.head;
+    auto new_version = phantom.unlocked();
+    fence();
+    unlock(buck.version);
+    note_insert();
+    // see if this item was previously read
+    auto bucket_item = Sto::check_item(this, pack_phantom(&phantom));
+    if (bucket_item) {
+      bucket_item->update_read(Version_type(prev_version), Version_type(new_version));
+      //} else { could abort transaction now
+    }
+    // use new_item because we know there are no collisions
+    auto item = Sto::new_item(this, new_head);
+    // don't actually need to Store anything for the write, just mark as valid on install
+    // (for now insert and set will just do the same thing on install, set a value and then mark valid)
+    item.template add_write<write_value_type>(v);
+    // need to remove this item if we abort
+    item.add_flags(insert_bit);
+    return false;
+  }
+
+  // The lazy insert half of trans_write: buffer a new, unlinked element in
+  // this transaction's pending index for its hash. lock() links it.
+  template <typename KT, typename VT>
+  bool trans_insert_lazy(const KT& k, const VT& v) {
+    auto e = new internal_elem(k, v, false);
+    auto pending = Sto::item(this, pack_pending(elem_hash(e)));
+    e->next = pending.has_write() ? pending.template write_value<internal_elem*>() : nullptr;
+    pending.add_write(e);
+    auto item = Sto::new_item(this, e);
+    item.template add_write<write_value_type>(v);
+    item.add_flags(insert_bit | lazy_bit);
+    return false;
+  }
+
+  template <typename KT, typename U>
+  bool trans_blind_update(const KT& k, U&& u) {
+    Version_type* phantom;
+    Version_type phantom_vers(0);
+    internal_elem *e = find_trans(k, hash(k), phantom, phantom_vers);
+    if (!e) {
+      Sto::item(this, pack_phantom(phantom)).observe(Version_type(phantom_vers.unlocked()));
       return false;
     }
+    auto item = t_item(e);
+    if (!validity_check(item, e)) {
+      Sto::abort();
+      return false;
+    }
+#if READ_MY_WRITES
+    if (has_delete(item))
+      return false;
+#endif
+    if (has_blind_update(item) || !item.has_write()) {
+      // no observation here; lock() checks the element is still valid
+      add_blind_update(item, std::forward<U>(u));
+    } else {
+      // fold into our own put or insert
+      Value v = item.template write_value<write_value_type>();
+      apply_update(v, u);
+      item.template add_write<write_value_type>(v);
+#if READ_MY_WRITES
+      if (has_insert(item))
+        e->value.write(v);
+#endif
+    }
+    return true;
+  }
+
+  void add_blind_update(TransProxy& item, const Value& delta) {
+    if (item.has_flag(delta_bit))
+      add_delta(item.template write_value<write_value_type>(), delta, 0);
+    else if (item.has_flag(apply_bit))
+      add_blind_update(item, apply_type([delta] (Value& v) { add_delta(v, delta, 0); }));
+    else
+      item.template add_write<write_value_type>(delta).add_flags(delta_bit);
+  }
+
+  // mixed or repeated transApply updates compose into one function
+  void add_blind_update(TransProxy& item, apply_type op) {
+    if (item.has_flag(delta_bit)) {
+      Value delta = item.template write_value<write_value_type>();
+      op = [delta, op] (Value& v) { add_delta(v, delta, 0); op(v); };
+    } else if (item.has_flag(apply_bit)) {
+      apply_type prev = item.template write_value<apply_type>();
+      op = [prev, op] (Value& v) { prev(v); op(v); };
+    }
+    item.clear_write().clear_flags(delta_bit)
+      .template add_write<apply_type>(std::move(op)).add_flags(apply_bit);
+  }
+
+  static void apply_update(Value& v, const Value& delta) {
+    add_delta(v, delta, 0);
+  }
+  static void apply_update(Value& v, const apply_type& op) {
+    op(v);
+  }
+
+  // `v += d` where Value supports it; transIncrement needs it
+  template <typename T>
+  static auto add_delta(T& v, const T& d, int) -> decltype(v += d, void()) {
+    v += d;
+  }
+  template <typename T>
+  static void add_delta(T&, const T&, ...) {
+    always_assert(false && "transIncrement needs Value += Value");
+  }
+
+  // The element's value with this transaction's blind update applied.
+  Value current_value(TransProxy item, internal_elem* e) const {
+    Value v = e->value.read(item, e->version);
+    if (item.has_flag(delta_bit))
+      add_delta(v, item.template write_value<write_value_type>(), 0);
+    else
+      item.template write_value<apply_type>()(v);
+    return v;
   }
 
 public:
   template <typename KT, typename VT>
   bool transPut(const KT& k, const VT& v) {
-    return trans_write</*insert*/true, /*set*/true>(k, v);
+    return trans_write</*insert*/true, /*set*/true>(k, hash(k), v);
   }
 
   // returns true if successful
   template <typename KT, typename VT>
   bool transInsert(const KT& k, const VT& v) {
-    return !trans_write</*insert*/true, /*set*/false>(k, v);
+    return !trans_write</*insert*/true, /*set*/false>(k, hash(k), v);
   }
 
   template <typename KT, typename VT>
   bool transUpdate(const KT& k, const VT& v) {
-    return trans_write</*insert*/false, /*set*/true>(k, v);
+    return trans_write</*insert*/false, /*set*/true>(k, hash(k), v);
+  }
+
+  // Blind updates of an existing key: add `delta` to its value, or run
+  // `op` on it, at install time under the element lock. Unlike a
+  // transGet/transPut pair these don't read the value, so concurrent
+  // updates of a hot key don't conflict; a later transGet in the same
+  // transaction returns the updated value and adds the read. `op` must be
+  // safe to run at commit and should commute with other updates of the
+  // key. Like transUpdate, returns false if the key is not present.
+  template <typename KT>
+  bool transIncrement(const KT& k, const Value& delta) {
+    return trans_blind_update(k, delta);
+  }
+
+  template <typename KT>
+  bool transApply(const KT& k, apply_type op) {
+    return trans_blind_update(k, std::move(op));
+  }
+
+  // Batched versions of transGet and transPut for transactions that touch
+  // many keys. They behave exactly like the single-key calls made in
+  // order, but work through the keys in groups, first prefetching every
+  // bucket of a group and then every bucket's first node, so a group's
+  // cache misses overlap instead of serializing. transMultiGet sets
+  // found[i] (if `found` is non-null) and returns the number of keys found.
+  size_t transMultiGet(const Key* keys, size_t n, Value* values, bool* found = nullptr) {
+    size_t nfound = 0;
+    size_t hs[multi_group];
+    for (size_t g = 0; g < n; g += multi_group) {
+      size_t end = std::min(n, g + multi_group);
+      prefetch_group(keys + g, end - g, hs);
+      for (size_t i = g; i != end; ++i) {
+        Value& v = values[i];
+        bool f = trans_read(keys[i], hs[i - g], [&v] (const Value& x) { v = x; });
+        nfound += f;
+        if (found)
+          found[i] = f;
+      }
+    }
+    return nfound;
+  }
+
+  void transMultiPut(const Key* keys, const Value* values, size_t n) {
+    size_t hs[multi_group];
+    for (size_t g = 0; g < n; g += multi_group) {
+      size_t end = std::min(n, g + multi_group);
+      prefetch_group(keys + g, end - g, hs);
+      for (size_t i = g; i != end; ++i)
+        trans_write</*insert*/true, /*set*/true>(keys[i], hs[i - g], values[i]);
+    }
+  }
+
+  enum class scan_mode {
+    validate, snapshot
+  };
+
+  // Transactional scan: calls f(key, value) for every key in buckets
+  // [first_bucket, last_bucket) of the table (there are nbuckets(); a
+  // resize in progress is finished first). The scan records one read per
+  // bucket rather than per key, so the transaction fails if a scanned
+  // bucket gains, loses, or changes a key before commit. The scan sees
+  // this transaction's own writes, except lazy inserts.
+  //
+  // In scan_mode::validate, buckets are checked only at commit, so f may
+  // see a mix of old and new values in a transaction that will abort. In
+  // scan_mode::snapshot on an opaque table, each bucket is also checked
+  // against the transaction's start as it's read, so f sees a consistent
+  // snapshot and a read-only transaction commits without validation. A
+  // nonopaque table has no snapshot to offer and validates at commit.
+  //
+  // With `nthreads` > 1, that many threads split the buckets and call f
+  // concurrently and in no particular order; the transaction must not
+  // have written anything yet. (This transaction keeps unlinked nodes
+  // from being freed, so the helper threads need no RCU of their own.)
+  template <typename F>
+  void transScan(size_t first_bucket, size_t last_bucket, F f,
+                 scan_mode mode = scan_mode::validate, int nthreads = 1) {
+    Transaction& txn = *Sto::transaction();
+    always_assert(txn.in_progress());
+    always_assert(nthreads == 1 || !txn.any_writes());
+    bucket_table* t = finish_resize();
+    last_bucket = std::min(last_bucket, t->nbuckets);
+    if (first_bucket >= last_bucket)
+      return;
+    bool snapshot = Opacity && mode == scan_mode::snapshot;
+    typename Version_type::type snap = 0;
+    if (snapshot) {
+      Sto::check_opacity();
+      snap = txn.start_tid();
+    }
+    typedef std::pair<size_t, scan_state> scanned;
+    std::vector<std::vector<scanned>> done(nthreads);
+    std::vector<std::vector<size_t>> retry(nthreads);
+    if (nthreads > 1) {
+      // Helper threads can't touch the transaction, so they report the
+      // buckets they passed to f; the rest (busy, or too new for the
+      // snapshot) are left for this thread.
+      size_t n = last_bucket - first_bucket;
+      parallel_for(nthreads, [&] (int me) {
+        std::vector<std::pair<Key, Value>> kvs;
+        size_t end = first_bucket + n * (me + 1) / nthreads;
+        for (size_t i = first_bucket + n * me / nthreads; i != end; ++i) {
+          scan_state st;
+          if (scan_bucket(t->buckets[i], txn.threadid(), false, kvs, st)
+              && (!snapshot || TransactionTid::try_check_opacity(snap, st.newest))) {
+            for (auto& kv : kvs)
+              f(kv.first, kv.second);
+            done[me].push_back(scanned(i, st));
+          } else
+            retry[me].push_back(i);
+        }
+      });
+    } else
+      for (size_t i = first_bucket; i != last_bucket; ++i)
+        retry[0].push_back(i);
+    for (auto& d : done)
+      for (auto& x : d)
+        observe_scan(t->buckets[x.first], x.second, snapshot);
+    std::vector<std::pair<Key, Value>> kvs;
+    for (auto& r : retry)
+      for (size_t i : r) {
+        scan_state st;
+        for (unsigned n = 0; !scan_bucket(t->buckets[i], txn.threadid(), true, kvs, st); ++n)
+          if (n == scan_retries)
+            Sto::abort();
+        observe_scan(t->buckets[i], st, snapshot);
+        for (auto& kv : kvs)
+          f(kv.first, kv.second);
+      }
+  }
+
+  template <typename F>
+  void transScan(F f, scan_mode mode = scan_mode::validate, int nthreads = 1) {
+    transScan(0, SIZE_MAX, f, mode, nthreads);
   }
 
 
-  bool check(TransItem& item, Transaction&) override {
-    if (is_bucket(item)) {
-      bucket_entry& buck = map_[bucket_key(item)];
-      return buck.version.check_version(item.template read_value<Version_type>());
+  bool check(TransItem& item, Transaction& txn) override {
+    if (is_bucket(item))
+      return phantom_key(item)->check_version(item.template read_value<Version_type>());
+    if (is_scan(item)) {
+      scan_state st;
+      return scan_digest(*scan_key(item), txn.threadid(), st)
+        && st.changes == item.template read_value<Version_type>().value();
     }
     auto el = item.key<internal_elem*>();
     auto read_version = item.template read_value<Version_type>();
@@ -306,29 +868,71 @@ public:
     // otherwise we check that it is both valid and not locked
     // XXX bool validity_check = has_insert(item) || (el->valid() && (!is_locked(el->version) || item.has_lock(t)));
     // XXX Why isn't it enough to just do the versionCheck?
+    // Because a delete can commit between the validity check and the
+    // version read: the read then observes the deleted node's final
+    // version, which never changes again once the node is unlinked.
+    if ((read_version.value() & invalid_bit) && !has_insert(item))
+      return false;
     return el->version.check_version(read_version);
   }
 
   bool lock(TransItem& item, Transaction& txn) override {
     assert(!is_bucket(item));
+    if (is_pending(item))
+      return true;
     auto el = item.key<internal_elem*>();
-    return txn.try_lock(item, el->version);
+    if (has_lazy_insert(item)) {
+      // lock the indexes first, since a linked element can't be unlinked
+      if (!lock_indexes(item, el, nullptr, &el->value.access(), txn))
+        return false;
+      if (link_lazy(item, txn))
+        return true;
+      unlock_indexes(item, indexes_.size());
+      return false;
+    }
+    if (!txn.try_lock(item, el->version))
+      return false;
+    if (has_blind_update(item) && !el->valid()) {
+      // deleted since; blind updates don't observe the version
+      unlock(el->version);
+      return false;
+    }
+    if (!indexes_.empty() && !lock_indexes(item, el, txn)) {
+      unlock(el->version);
+      return false;
+    }
+    return true;
   }
 
   void install(TransItem& item, Transaction& t) override {
     assert(!is_bucket(item));
+    if (is_pending(item))
+      return;
     auto el = item.key<internal_elem*>();
     assert(is_locked(el));
+    for (auto idx : indexes_)
+      idx->install(item, t.commit_tid());
+    note_change(el);
     // delete
     if (item.flags() & delete_bit) {
       // XXX: think we need an extra bit in here for opacity, or we should remove this now 
       // rather than in cleanup
-      el->version.set_version_locked(el->version.value() | invalid_bit);
+      // (a delete gets a commit tid like any other change, which snapshot
+      // scans rely on)
+      el->version.set_version(t.commit_tid() | invalid_bit);
       // we wait to remove the node til cleanup() (unclear that this is actually necessary)
       return;
     }
     // else must be insert/update
-    if (!(item.flags() & insert_bit)) {
+    if (item.has_flag(delta_bit)) {
+      Value v = el->value.access();
+      add_delta(v, item.template write_value<write_value_type>(), 0);
+      el->value.write(std::move(v));
+    } else if (item.has_flag(apply_bit)) {
+      Value v = el->value.access();
+      item.template write_value<apply_type>()(v);
+      el->value.write(std::move(v));
+    } else if (!(item.flags() & insert_bit)) {
       // Update
       Value& new_v = item.template write_value<write_value_type>();
       el->value.write(new_v);
@@ -342,12 +946,12 @@ public:
 #if 1
     // convert nonopaque bucket version to a commit tid
     if (Opacity && has_insert(item)) {
-      bucket_entry& buck = buck_entry(el->key);
-      lock(buck.version);
+      bucket_entry& buck = lock_bucket(elem_hash(el));
       // only update if it's still nonopaque. Otherwise someone with a higher tid
       // could've already updated it.
       if (buck.version.value() & TransactionTid::nonopaque_bit)
 	buck.version.set_version(t.commit_tid());
+      buck.set_commit_tid(elem_hash(el), t.commit_tid());
       unlock(buck.version);
     }
 #endif
@@ -355,11 +959,21 @@ public:
 
   void unlock(TransItem& item) override {
     assert(!is_bucket(item));
+    if (is_pending(item))
+      return;
     auto el = item.key<internal_elem*>();
+    unlock_indexes(item, indexes_.size());
     unlock(el->version);
   }
 
   void cleanup(TransItem& item, bool committed) override {
+    if (is_pending(item))
+      return;
+    if (!committed && has_lazy_insert(item) && !item.needs_unlock()) {
+      // aborted before lock() linked it
+      Transaction::rcu_delete(item.key<internal_elem*>());
+      return;
+    }
     if (committed ? has_delete(item) : has_insert(item)) {
       auto el = item.key<internal_elem*>();
       assert(!el->valid());
@@ -369,13 +983,13 @@ public:
 
   // these are wrappers for concurrent.cc and other
   // frameworks we use the hashtable in
-  Value transGet(Key k) {
+  Value transGet(key_arg k) {
     Value v;
     transGet(k, v);
     return v;
   }
 
-  Value unsafe_get(Key k) {
+  Value unsafe_get(key_arg k) {
     if (Value* p = readPtr(k))
       return *p;
     else
@@ -393,11 +1007,12 @@ public:
     int max_chaining = 0;
     int num_empty = 0;
 
-    for (unsigned i = 0; i < map_.size(); ++i) {
-      bucket_entry& buck = map_[i];
+    size_t nbuck = 0;
+    for_each_bucket([&] (bucket_entry& buck) {
+      ++nbuck;
       if (!buck.head) {
         num_empty++;
-        continue;
+        return;
       }
       int ct = 0;
       internal_elem * list = buck.head;
@@ -408,23 +1023,33 @@ public:
       }
 
       if (ct > max_chaining) max_chaining = ct;
-    }
+    });
 
-    printf("Total count: %d, Empty buckets: %d, Avg chaining: %f, Max chaining: %d\n", tot_count, num_empty, ((double)(tot_count))/(map_.size() - num_empty), max_chaining);
+    printf("Total count: %d, Empty buckets: %d, Avg chaining: %f, Max chaining: %d\n", tot_count, num_empty, ((double)(tot_count))/(nbuck - num_empty), max_chaining);
   }
 
     void print(std::ostream& w, const TransItem& item) const override {
         w << "{Hashtable<" << typeid(K).name() << "," << typeid(V).name() << "> " << (void*) this;
         if (is_bucket(item)) {
-            w << ".b[" << bucket_key(item) << "]";
+            w << ".b[" << (void*) phantom_key(item) << "]";
+            if (item.has_read())
+                w << " R" << item.read_value<Version_type>();
+        } else if (is_pending(item)) {
+            w << ".pending[" << item.key<void*>() << "]";
+        } else if (is_scan(item)) {
+            w << ".scan[" << (void*) scan_key(item) << "]";
             if (item.has_read())
                 w << " R" << item.read_value<Version_type>();
         } else {
             auto el = item.key<internal_elem*>();
-            w << "[" << mass::print_value(el->key) << "]";
+            w << "[" << mass::print_value(key_traits::key(el->key)) << "]";
             if (item.has_read())
                 w << " R" << item.read_value<Version_type>();
-            if (item.has_write())
+            if (item.has_write() && item.has_flag(delta_bit))
+                w << " Δ" << mass::print_value(item.write_value<write_value_type>());
+            else if (item.has_write() && item.has_flag(apply_bit))
+                w << " =f(...)";
+            else if (item.has_write())
                 w << " =" << mass::print_value(item.write_value<write_value_type>());
         }
         w << "}";
@@ -432,67 +1057,81 @@ public:
 
   void print() {
     printf("Hashtable:\n");
-    for (unsigned i = 0; i < map_.size(); ++i) {
-      bucket_entry& buck = map_[i];
+    unsigned i = 0;
+    for_each_bucket([&] (bucket_entry& buck) {
+      ++i;
       if (!buck.head)
-        continue;
-      printf("bucket %d (version %d): ", i, buck.version);
+        return;
+      printf("bucket %d (version %d): ", i - 1, buck.version);
       internal_elem *list = buck.head;
       while (list) {
         printf("key: %d, val: %d, version: %d, valid: %d ; ", list->key, list->value, list->version, list->valid());
         list = list->next;
       }
       printf("\n");
-    }
+    });
   }
 
   // non-transactional const iteration
   // (we don't have current support for transactional iteration)
+  // During a resize this visits the old table's unmoved buckets, then the
+  // new table.
   class const_iterator {
   public:
     std::pair<Key, Value> operator*() const {
-      return std::make_pair(node->key, node->value);
+      return std::make_pair(key_traits::key(node->key), node->value.access());
     }
 
     const_iterator& operator++() {
       if (node) {
         node = node->next;
       }
-      while (!node && bucket != table->map_.size()) {
-        node = table->map_[bucket].head;
+      while (!node && tbl) {
+        if (bucket == tbl->nbuckets) {
+          tbl = tbl == last ? nullptr : last;
+          bucket = 0;
+          continue;
+        }
+        bucket_entry& buck = tbl->buckets[bucket];
+        if (!(buck.version.value() & moved_bit))
+          node = buck.head;
         bucket++;
       }
       return *this;
     }
     
     bool operator!=(const const_iterator& it) const {
-      return node != it.node || bucket != it.bucket;
+      return node != it.node || tbl != it.tbl || bucket != it.bucket;
     }
   private:
-    const Hashtable *table;
-    int bucket;
+    bucket_table *tbl;
+    bucket_table *last;
+    size_t bucket;
     internal_elem *node;
     friend class Hashtable;
   };
 
   const_iterator begin() const {
     const_iterator begin;
-    begin.table = this;
-    begin.bucket = -1;
+    begin.last = table_.load(std::memory_order_acquire);
+    begin.tbl = begin.last->old.load(std::memory_order_acquire);
+    if (!begin.tbl)
+      begin.tbl = begin.last;
+    begin.bucket = 0;
     begin.node = NULL;
     return ++begin; //eh
   }
   const_iterator end() const {
     const_iterator end;
-    end.bucket = map_.size();
+    end.tbl = end.last = nullptr;
+    end.bucket = 0;
     end.node = NULL;
     return end;
   }
 
   // remove given the internal element node. used by transaction system
   void _remove(internal_elem *el) {
-    bucket_entry& buck = buck_entry(el->key);
-    lock(buck.version);
+    bucket_entry& buck = lock_bucket(elem_hash(el));
     internal_elem *prev = NULL;
     internal_elem *cur = buck.head;
     while (cur != NULL && cur != el) {
@@ -505,17 +1144,22 @@ public:
     } else {
       buck.head = cur->next;
     }
+    note_removed(buck, cur);
     unlock(buck.version);
-    Transaction::rcu_delete(cur);
+    note_remove();
+    if (in_slab(cur))
+      Transaction::rcu_call(destroy_elem, cur);
+    else
+      Transaction::rcu_delete(cur);
   }
 
   // non-txnal remove given a key
-  bool remove(const Key& k) {
-    bucket_entry& buck = buck_entry(k);
-    lock(buck.version);
+  bool remove(key_arg k) {
+    size_t h = hash(k);
+    bucket_entry& buck = lock_bucket(h);
     internal_elem *prev = NULL;
     internal_elem *cur = buck.head;
-    while (cur != NULL && !pred_(cur->key, k)) {
+    while (cur != NULL && !key_traits::match(pred_, cur->key, k, h)) {
       prev = cur;
       cur = cur->next;
     }
@@ -523,19 +1167,23 @@ public:
       unlock(buck.version);
       return false;
     }
+    nontrans_index(cur, &cur->value.access(), nullptr);
     if (prev) {
       prev->next = cur->next;
     } else {
       buck.head = cur->next;
     }
+    note_removed(buck, cur);
+    fetch_and_add(&buck.changes, TransactionTid::increment_value);
     unlock(buck.version);    
+    note_remove();
     // TODO(nate): this would probably work fine as-is
     // Transaction::rcu_free(cur);
     return true;
   }
 
-  bool read(const Key& k, Value& retval) {
-    auto e = find(buck_entry(k), k);
+  bool read(key_arg k, Value& retval) {
+    auto e = elem(k);
     if (e) {
       // TODO(nate): this isn't safe for non-trivial types (need an atomic read)
       assign_val(retval, e->value.access());
@@ -551,8 +1199,8 @@ public:
     val.assign(val_to_assign.data(), val_to_assign.length());
   }
 
-  Value* readPtr(const Key& k) {
-    auto e = find(buck_entry(k), k);
+  Value* readPtr(key_arg k) {
+    auto e = elem(k);
     if (e) {
       return &e->value.access();
     }
@@ -561,25 +1209,28 @@ public:
 
   // returns pointer to the value in the hashtable 
   // (no current way to distinguish if insert or set)
-  Value* putIfAbsentPtr(const Key& k, const Value& val) {
-    bucket_entry& buck = buck_entry(k);
-    lock(buck.version);
-    internal_elem *e = find(buck, k);
+  Value* putIfAbsentPtr(key_arg k, const Value& val) {
+    size_t h = hash(k);
+    bucket_entry& buck = lock_bucket(h);
+    internal_elem *e = find(buck, k, h);
+    bool inserted = !e;
     if (!e) {
       insert_locked<true>(buck, k, val);
       e = buck.head;
     }
     Value *ret = &e->value.access();
     unlock(buck.version);
+    if (inserted)
+      note_insert();
     return ret;
   }
 
   // returns true if inserted. otherwise return false and val is set to current value.
-  bool putIfAbsent(const Key& k, Value& val) {
+  bool putIfAbsent(key_arg k, Value& val) {
     bool exists = false;
-    bucket_entry& buck = buck_entry(k);
-    lock(buck.version);
-    internal_elem *e = find(buck, k);
+    size_t h = hash(k);
+    bucket_entry& buck = lock_bucket(h);
+    internal_elem *e = find(buck, k, h);
     if (e) {
       assign_val(val, e->value.access());
       exists = true;
@@ -588,16 +1239,18 @@ public:
       exists = false;
     }
     unlock(buck.version);
+    if (!exists)
+      note_insert();
     return exists;
   }
 
   // returns true if item already existed
   template <bool Insert = true, bool Set = true>
-  bool put(const Key& k, const Value& val) {
+  bool put(key_arg k, const Value& val) {
     bool exists = false;
-    bucket_entry& buck = buck_entry(k);
-    lock(buck.version);
-    internal_elem *e = find(buck, k);
+    size_t h = hash(k);
+    bucket_entry& buck = lock_bucket(h);
+    internal_elem *e = find(buck, k, h);
     if (e) {
       // XXX: kind of a stupid Set-only (still locks bucket)
       if (Set)
@@ -609,17 +1262,19 @@ public:
       exists = false;
     }
     unlock(buck.version);
+    if (Insert && !exists)
+      note_insert();
     return exists;
   }
 
   // returns true if item already existed
   // if item did exist, oldval is its old value
   template <bool Insert = true, bool Set = true>
-  bool put_getold(const Key& k, const Value& val, Value& oldval) {
+  bool put_getold(key_arg k, const Value& val, Value& oldval) {
     bool exists = false;
-    bucket_entry& buck = buck_entry(k);
-    lock(buck.version);
-    internal_elem *e = find(buck, k);
+    size_t h = hash(k);
+    bucket_entry& buck = lock_bucket(h);
+    internal_elem *e = find(buck, k, h);
     if (e) {
       assign_val(oldval, e->value.access());
       // XXX: kind of a stupid Set-only (still locks bucket)
@@ -632,11 +1287,13 @@ public:
       exists = false;
     }
     unlock(buck.version);
+    if (Insert && !exists)
+      note_insert();
     return exists;
   }
 
   // returns true if successfully inserted
-  bool insert(const Key& k, const Value& val) {
+  bool insert(key_arg k, const Value& val) {
     return !put<true, false>(k, val);
   }
 
@@ -645,49 +1302,532 @@ public:
     // XXX: we probably don't need this lock since we have the bucket lock still
     // (or we could do an optimistic set without the bucket lock)
     lock(e->version);
+    nontrans_index(e, &e->value.access(), &val);
     e->value.access() = val;
 #ifndef STO_NO_STM
     e->version.inc_nonopaque_version();
+    note_change(e);
 #endif
     unlock(e->version);
   }
 
-  bool nontrans_insert(const Key& k, const Value& v) { return insert(k, v); }
+  bool nontrans_insert(key_arg k, const Value& v) { return insert(k, v); }
+
+  // Loads the key/value pairs (anything with `first` and `second`) in
+  // [first, last) using `nthreads` threads, much faster than repeated
+  // nontrans_insert. Nothing else may use the table during the load. The
+  // table first grows to at least one bucket per key. Then the keys are
+  // partitioned by bucket range, and each thread links the keys of its own
+  // range of buckets without locking, carving nodes out of one slab. As
+  // with nontrans_insert, a key already present keeps its value, and so
+  // does the first of duplicate input keys.
+  template <typename RandomIt>
+  void bulk_load(RandomIt first, RandomIt last, int nthreads = 1) {
+    size_t n = last - first;
+    if (n == 0)
+      return;
+    nthreads = std::max(nthreads, 1);
+    bucket_table* t = presize(size() + n);
+    size_t nb = t->nbuckets;
+
+    // Partition the input by bucket range with a counting scatter: each
+    // thread hashes its slice of the input and counts the keys bound for
+    // each part, then copies their indexes into `order`, so part p lands
+    // in order[start[p], start[p + 1]) with input order kept.
+    std::vector<size_t> hs(n);
+    std::vector<size_t> counts(nthreads * nthreads, 0);
+    auto part = [&] (size_t h) { return h % nb * nthreads / nb; };
+    parallel_for(nthreads, [&] (int me) {
+      for (size_t i = n * me / nthreads; i != n * (me + 1) / nthreads; ++i) {
+        hs[i] = hash(first[i].first);
+        ++counts[me * nthreads + part(hs[i])];
+      }
+    });
+    std::vector<size_t> start(nthreads + 1);
+    size_t pos = 0;
+    for (int p = 0; p != nthreads; ++p) {
+      start[p] = pos;
+      for (int me = 0; me != nthreads; ++me) {
+        size_t c = counts[me * nthreads + p];
+        counts[me * nthreads + p] = pos;
+        pos += c;
+      }
+    }
+    start[nthreads] = pos;
+    std::vector<size_t> order(n);
+    parallel_for(nthreads, [&] (int me) {
+      size_t* at = &counts[me * nthreads];
+      for (size_t i = n * me / nthreads; i != n * (me + 1) / nthreads; ++i)
+        order[at[part(hs[i])]++] = i;
+    });
+
+    std::vector<std::pair<internal_elem*, internal_elem*>> slabs(nthreads);
+    std::vector<ssize_t> added(nthreads, 0);
+    parallel_for(nthreads, [&] (int me) {
+      size_t count = start[me + 1] - start[me];
+      if (count == 0)
+        return;
+      auto slab = static_cast<internal_elem*>(TNuma::allocate(count * sizeof(internal_elem), policy_));
+      internal_elem* next = slab;
+      for (size_t j = start[me]; j != start[me + 1]; ++j) {
+        size_t i = order[j];
+        bucket_entry& buck = t->buckets[hs[i] % nb];
+        if (find(buck, first[i].first, hs[i]))
+          continue;
+        internal_elem* e = new(next++) internal_elem(first[i].first, first[i].second, true);
+        e->next = buck.head;
+        buck.head = e;
+        nontrans_index(e, nullptr, &e->value.access());
+      }
+      slabs[me] = std::make_pair(slab, next);
+      added[me] = next - slab;
+    });
+
+    for (int i = 0; i != nthreads; ++i) {
+      if (slabs[i].first)
+        slabs_.push_back(slabs[i]);
+      counts_[TThread::id()].n += added[i];
+    }
+  }
 
-  bool nontrans_find(const Key& k, Value& v) { return read(k, v); }
+  bool nontrans_find(key_arg k, Value& v) { return read(k, v); }
 
-  bool nontrans_remove(const Key& k) { return remove(k); }
+  bool nontrans_remove(key_arg k) { return remove(k); }
 
   // XXX: there's a race between the read and the remove (oldval might be stale) but mehh
-  bool nontrans_remove(const Key& k, Value& oldval) { if (read(k,oldval)) return remove(k); else return false; }
+  bool nontrans_remove(key_arg k, Value& oldval) { if (read(k,oldval)) return remove(k); else return false; }
 
 private:
-  bucket_entry& buck_entry(const Key& k) {
-    return map_[bucket(k)];
+  // Grows the table to at least `want` buckets for bulk_load, finishing
+  // any resize in progress first. Not safe against concurrent use.
+  bucket_table* presize(size_t want) {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    if (bucket_table* o = t->old.load(std::memory_order_acquire))
+      for (size_t i = 0; i != o->nbuckets; ++i)
+        migrate_bucket(t, o, o->buckets[i]);
+    if (t->nbuckets >= want)
+      return t;
+    bucket_table* nt = make_table(want | 1, policy_);
+    for (size_t i = 0; i != t->nbuckets; ++i)
+      while (internal_elem* e = t->buckets[i].head) {
+        t->buckets[i].head = e->next;
+        bucket_entry& buck = nt->bucket(elem_hash(e));
+        e->next = buck.head;
+        buck.head = e;
+      }
+    table_.store(nt, std::memory_order_release);
+    Transaction::rcu_call(free_table, t);
+    return nt;
+  }
+
+  template <typename F>
+  static void parallel_for(int nthreads, F f) {
+    std::vector<std::thread> threads;
+    for (int i = 1; i < nthreads; ++i)
+      threads.emplace_back(f, i);
+    f(0);
+    for (auto& th : threads)
+      th.join();
+  }
+
+  bool in_slab(internal_elem* e) const {
+    for (auto& slab : slabs_)
+      if (e >= slab.first && e < slab.second)
+        return true;
+    return false;
+  }
+  static void destroy_elem(void* p) {
+    static_cast<internal_elem*>(p)->~internal_elem();
+  }
+  void delete_elem(internal_elem* e) {
+    if (in_slab(e))
+      destroy_elem(e);
+    else
+      delete e;
+  }
+
+  static bucket_table* make_table(size_t n, TNumaPolicy policy) {
+    size_t sz = sizeof(bucket_table) + sizeof(bucket_entry) * (n - 1);
+    bucket_table* t = new(TNuma::allocate(sz, policy)) bucket_table(n);
+    for (size_t i = 1; i < n; ++i)
+      new(&t->buckets[i]) bucket_entry;
+    return t;
+  }
+  static void free_table(void* t) {
+    static_assert(std::is_trivially_destructible<bucket_entry>::value, "bucket_entry must be trivially destructible");
+    TNuma::free(t);
+  }
+
+  // The bucket readers should search for hash `h`.
+  bucket_entry& read_bucket(size_t h) {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    if (bucket_table* o = t->old.load(std::memory_order_acquire)) {
+      bucket_entry& obuck = o->bucket(h);
+      if (!(obuck.version.value() & moved_bit))
+        return obuck;
+      // wait for the move to finish so its keys are in the new table
+      while (obuck.version.is_locked())
+        relax_fence();
+    }
+    return t->bucket(h);
+  }
+
+  // Locks and returns the bucket writers should use for hash `h`.
+  bucket_entry& lock_bucket(size_t h) {
+    while (1) {
+      bucket_table* t = table_.load(std::memory_order_acquire);
+      if (bucket_table* o = t->old.load(std::memory_order_acquire)) {
+        migrate_bucket(t, o, o->bucket(h));
+        migrate_some(t, o);
+      }
+      bucket_entry& buck = t->bucket(h);
+      lock(buck.version);
+      // if a newer resize has already moved this bucket, try again
+      if (!(buck.version.value() & moved_bit))
+        return buck;
+      unlock(buck.version);
+    }
   }
 
   // looks up a key's internal_elem, given its bucket
-  internal_elem* find(bucket_entry& buck, const Key& k) {
+  internal_elem* find(bucket_entry& buck, key_arg k, size_t h) {
     internal_elem *list = buck.head;
-    while (list && ! pred_(list->key, k)) {
+    while (list && !key_traits::match(pred_, list->key, k, h)) {
       list = list->next;
     }
     return list;
   }
 
+  // keys per transMultiGet/transMultiPut prefetch group
+  static constexpr size_t multi_group = 16;
+
+  // prefetches the buckets of `keys`, leaving their hashes in `hs`
+  void prefetch_group(const Key* keys, size_t n, size_t* hs) {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    bucket_table* o = t->old.load(std::memory_order_acquire);
+    for (size_t i = 0; i != n; ++i) {
+      hs[i] = hash(keys[i]);
+      ::prefetch(&t->bucket(hs[i]));
+      if (o)
+        ::prefetch(&o->bucket(hs[i]));
+    }
+    for (size_t i = 0; i != n; ++i)
+      if (internal_elem* e = read_bucket(hs[i]).head)
+        ::prefetch(e);
+  }
+
+  // Looks up `k`, setting `phantom` to the phantom version of the bucket
+  // searched and `phantom_vers` to its value before the search. A miss in
+  // a bucket that moved during the search is retried, since the move can
+  // hide keys.
+  internal_elem* find_observed(key_arg k, size_t h, Version_type*& phantom, Version_type& phantom_vers) {
+    while (1) {
+      bucket_entry* buck = &read_bucket(h);
+      phantom = &buck->phantom_version(h);
+      phantom_vers = *phantom;
+      fence();
+      internal_elem* e = find(*buck, k, h);
+      if (e || !(buck->version.value() & moved_bit))
+        return e;
+    }
+  }
+
+  // find_observed, then this transaction's unlinked lazy inserts
+  internal_elem* find_trans(key_arg k, size_t h, Version_type*& phantom, Version_type& phantom_vers) {
+    internal_elem* e = find_observed(k, h, phantom, phantom_vers);
+    if (!e && lazy_inserts_)
+      e = find_pending(k, h);
+    return e;
+  }
+
+  internal_elem* find_pending(key_arg k, size_t h) {
+    auto pending = Sto::check_item(this, pack_pending(h));
+    if (pending && pending->has_write())
+      for (auto e = pending->template write_value<internal_elem*>(); e; e = e->next)
+        if (key_traits::match(pred_, e->key, k, h))
+          return e;
+    return nullptr;
+  }
+
+  // Drops a lazy insert that its own transaction deleted.
+  void unlink_pending(internal_elem* el) {
+    auto pending = Sto::item(this, pack_pending(elem_hash(el)));
+    internal_elem** pprev = &pending.template write_value<internal_elem*>();
+    while (*pprev != el)
+      pprev = &(*pprev)->next;
+    *pprev = el->next;
+    // the item keyed by `el` stays in the transaction, so RCU keeps its
+    // address from being reused
+    Transaction::rcu_delete(el);
+  }
+
+  // Links a lazy insert at commit. Fails if the key was inserted since;
+  // the element is locked exactly when it is linked.
+  // Locks the indexes for a locked element's write, which changes its
+  // value from the committed one (if any) to the one install() will write.
+  bool lock_indexes(const TransItem& item, internal_elem* el, Transaction& txn) {
+    const Value* old_value = el->valid() && !has_insert(item) ? &el->value.access() : nullptr;
+    if (has_delete(item))
+      return lock_indexes(item, el, old_value, nullptr, txn);
+    if (has_insert(item))
+      return lock_indexes(item, el, old_value, &el->value.access(), txn);
+    if (!has_blind_update(item))
+      return lock_indexes(item, el, old_value, &item.template write_value<write_value_type>(), txn);
+    Value v = el->value.access();
+    if (item.has_flag(delta_bit))
+      add_delta(v, item.template write_value<write_value_type>(), 0);
+    else
+      item.template write_value<apply_type>()(v);
+    return lock_indexes(item, el, old_value, &v, txn);
+  }
+  bool lock_indexes(const TransItem& item, internal_elem* el, const Value* old_value,
+                    const Value* new_value, Transaction& txn) {
+    for (size_t i = 0; i != indexes_.size(); ++i)
+      if (!indexes_[i]->lock(item, key_traits::key(el->key), old_value, new_value, txn)) {
+        unlock_indexes(item, i);
+        return false;
+      }
+    return true;
+  }
+  // unlocks the first `n` indexes
+  void unlock_indexes(const TransItem& item, size_t n) {
+    for (size_t i = 0; i != n; ++i)
+      indexes_[i]->unlock(item);
+  }
+
+  bool link_lazy(TransItem& item, Transaction& txn) {
+    auto el = item.key<internal_elem*>();
+    size_t h = elem_hash(el);
+    bucket_entry& buck = lock_bucket(h);
+    if (find(buck, key_traits::arg(el->key), h) || !txn.try_lock(item, el->version)) {
+      unlock(buck.version);
+      return false;
+    }
+    Version_type& phantom = buck.phantom_version(h);
+    auto prev_version = phantom.unlocked();
+    link_locked(buck, el);
+    auto new_version = phantom.unlocked();
+    fence();
+    unlock(buck.version);
+    note_insert();
+    // our own absent-key read of this bucket remains valid
+    auto bucket_item = Sto::check_item(this, pack_phantom(&phantom));
+    if (bucket_item)
+      bucket_item->update_read(Version_type(prev_version), Version_type(new_version));
+    return true;
+  }
+
   // looks up a key's internal_elem
-  internal_elem* elem(const Key& k) {
-    return find(buck_entry(k), k);
+  internal_elem* elem(key_arg k) {
+    Version_type* phantom;
+    Version_type phantom_vers(0);
+    return find_observed(k, hash(k), phantom, phantom_vers);
+  }
+
+  // Moves old bucket `obuck` of table `o` into `t` (whose old table is `o`).
+  void migrate_bucket(bucket_table* t, bucket_table* o, bucket_entry& obuck) {
+    if (obuck.version.value() & moved_bit)
+      return;
+    lock(obuck.version);
+    if (obuck.version.value() & moved_bit) {
+      unlock(obuck.version);
+      return;
+    }
+    obuck.version.set_version_locked(obuck.version.value() | moved_bit);
+    // Relinking can send a concurrent reader from the old chain into a new
+    // one; readers that miss in a moved bucket retry.
+    internal_elem* e = obuck.head;
+    while (e) {
+      internal_elem* next = e->next;
+      bucket_entry& buck = t->bucket(elem_hash(e));
+      lock(buck.version);
+      e->next = buck.head;
+      buck.head = e;
+      buck.newest = std::max(buck.newest, obuck.newest);
+      unlock(buck.version);
+      e = next;
+    }
+    obuck.head = NULL;
+    obuck.version.inc_nonopaque_version();
+    obuck.bump_all();
+    unlock(obuck.version);
+    if (o->nmigrated.fetch_add(1) + 1 == o->nbuckets) {
+      t->old.store(nullptr, std::memory_order_release);
+      Transaction::rcu_call(free_table, o);
+    }
+  }
+
+  // Moves the next few old buckets, so a resize finishes even if writes
+  // avoid some buckets.
+  void migrate_some(bucket_table* t, bucket_table* o) {
+    if (o->next_migrate.load(std::memory_order_relaxed) >= o->nbuckets)
+      return;
+    size_t i = o->next_migrate.fetch_add(migrate_batch);
+    size_t end = std::min(i + migrate_batch, o->nbuckets);
+    for (; i < end; ++i)
+      migrate_bucket(t, o, o->buckets[i]);
+  }
+
+  // Called (with no bucket locked) after each insert.
+  void note_insert() {
+    ssize_t n = ++counts_[TThread::id()].n;
+    if (n % grow_check_interval == 0)
+      maybe_grow();
+  }
+  void note_remove() {
+    --counts_[TThread::id()].n;
+  }
+
+  void maybe_grow() {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    if (max_load_factor_ <= 0 || t->old.load(std::memory_order_acquire)
+        || size() <= max_load_factor_ * t->nbuckets)
+      return;
+    bucket_table* nt = make_table(2 * t->nbuckets + 1, policy_);
+    nt->old.store(t, std::memory_order_relaxed);
+    if (!table_.compare_exchange_strong(t, nt))
+      free_table(nt);
+  }
+
+  // Finishes any resize in progress, returning the table.
+  bucket_table* finish_resize() {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    if (bucket_table* o = t->old.load(std::memory_order_acquire)) {
+      for (size_t i = 0; i != o->nbuckets; ++i)
+        migrate_bucket(t, o, o->buckets[i]);
+      while (t->old.load(std::memory_order_acquire))
+        relax_fence();
+    }
+    return t;
+  }
+
+  // Counts a change to locked element `el`'s key or value in its bucket.
+  // If the bucket moves meanwhile, scans of it fail on moved_bit instead.
+  void note_change(internal_elem* el) {
+    fetch_and_add(&read_bucket(elem_hash(el)).changes, TransactionTid::increment_value);
+  }
+  // Keeps the tid of `el`, which is leaving locked bucket `buck`, so
+  // snapshot scans still see the removal. The bucket's version is left
+  // alone: it guards absent-key reads, which a removal can't affect.
+  static void note_removed(bucket_entry& buck, internal_elem* el) {
+    buck.newest = std::max(buck.newest, tid_bits(el->version.value()));
+  }
+
+  // What a scan learns about a bucket. `changes` is the bucket's change
+  // count, which every committed insert, update, and delete raises, and
+  // which validates the scan. `newest` is the largest tid among the
+  // bucket's version, its nodes' versions, and the nodes removed from it
+  // (bucket_entry::newest), an upper bound on the tid of every change the
+  // scan saw (nonopaque bumps can push it higher, which only costs extra
+  // opacity checks); snapshot scans check it against the transaction's
+  // start.
+  struct scan_state {
+    typename Version_type::type changes;
+    typename Version_type::type newest;
+  };
+  static typename Version_type::type tid_bits(typename Version_type::type v) {
+    return v & ~(TransactionTid::increment_value - 1);
+  }
+
+  // Reads `buck`'s scan_state. Fails if the bucket has moved or is busy.
+  bool scan_digest(bucket_entry& buck, int threadid, scan_state& st) {
+    st.changes = buck.changes;
+    auto bv = buck.version.value();
+    if (TransactionTid::is_locked(bv) || (bv & moved_bit))
+      return false;
+    fence();
+    st.newest = std::max(tid_bits(bv), buck.newest);
+    for (internal_elem* e = buck.head; e; e = e->next) {
+      auto v = e->version.value();
+      if (TransactionTid::is_locked_elsewhere(v, threadid))
+        return false;
+      st.newest = std::max(st.newest, tid_bits(v));
+    }
+    fence();
+    return buck.version.value() == bv && buck.changes == st.changes;
+  }
+
+  // Copies `buck`'s visible keys and values into `kvs` and reads its
+  // scan_state, like scan_digest. With `mine`, applies this transaction's
+  // own writes (only the transaction's own thread may ask for that).
+  bool scan_bucket(bucket_entry& buck, int threadid, bool mine,
+                   std::vector<std::pair<Key, Value>>& kvs, scan_state& st) {
+    kvs.clear();
+    st.changes = buck.changes;
+    auto bv = buck.version.value();
+    if (TransactionTid::is_locked(bv) || (bv & moved_bit))
+      return false;
+    fence();
+    st.newest = std::max(tid_bits(bv), buck.newest);
+    for (internal_elem* e = buck.head; e; e = e->next) {
+      auto v = e->version.value();
+      if (TransactionTid::is_locked_elsewhere(v, threadid))
+        return false;
+      st.newest = std::max(st.newest, tid_bits(v));
+      fence();
+      const TransItem* item = nullptr;
+      if (mine)
+        if (auto it = Sto::check_item(this, e))
+          item = &it->item();
+      if (item && has_delete(*item))
+        continue;
+      else if (item && item->has_write() && !has_blind_update(*item))
+        kvs.push_back(std::make_pair(key_traits::key(e->key), item->template write_value<write_value_type>()));
+      else if (!(v & invalid_bit)) {
+        kvs.push_back(std::make_pair(key_traits::key(e->key), e->value.access()));
+        if (item && item->has_flag(delta_bit))
+          apply_update(kvs.back().second, item->template write_value<write_value_type>());
+        else if (item && item->has_flag(apply_bit))
+          apply_update(kvs.back().second, item->template write_value<apply_type>());
+      }
+      fence();
+      if (e->version.value() != v)
+        return false;
+    }
+    fence();
+    return buck.version.value() == bv && buck.changes == st.changes;
   }
 
-  bool has_delete(const TransItem& item) {
+  void observe_scan(bucket_entry& buck, const scan_state& st, bool snapshot) {
+    // buckets are read at most once per scan, so skip the duplicate search
+    auto item = Sto::fresh_item(this, pack_scan(&buck));
+    if (snapshot) {
+      Sto::check_opacity(st.newest);
+      // change counts are multiples of increment_value, so never look
+      // locked, and pass the opacity check unless they outrun the tid
+      item.observe(Version_type(st.changes));
+    } else
+      item.add_read(Version_type(st.changes));
+  }
+
+  // calls f on every bucket that can hold keys
+  template <typename F>
+  void for_each_bucket(F f) {
+    bucket_table* t = table_.load(std::memory_order_acquire);
+    if (bucket_table* o = t->old.load(std::memory_order_acquire))
+      for (size_t i = 0; i != o->nbuckets; ++i)
+        if (!(o->buckets[i].version.value() & moved_bit))
+          f(o->buckets[i]);
+    for (size_t i = 0; i != t->nbuckets; ++i)
+      f(t->buckets[i]);
+  }
+
+  static bool has_delete(const TransItem& item) {
       return item.flags() & delete_bit;
   }
 
-  bool has_insert(const TransItem& item) {
+  static bool has_insert(const TransItem& item) {
       return item.flags() & insert_bit;
   }
 
+  static bool has_lazy_insert(const TransItem& item) {
+      return item.flags() & lazy_bit;
+  }
+
+  static bool has_blind_update(const TransItem& item) {
+      return item.flags() & (delta_bit | apply_bit);
+  }
+
   bool validity_check(const TransItem& item, internal_elem *e) {
     return has_insert(item) || e->valid();
   }
@@ -707,12 +1847,32 @@ private:
   static bool is_bucket(void* key) {
       return (uintptr_t)key & bucket_bit;
   }
-  static unsigned bucket_key(const TransItem& item) {
+  static Version_type* phantom_key(const TransItem& item) {
       assert(is_bucket(item));
-      return (uintptr_t) item.key<void*>() >> 1;
+      return (Version_type*) ((uintptr_t) item.key<void*>() - bucket_bit);
+  }
+  // Bucket items are keyed by the address of the phantom version read,
+  // which stays valid (through RCU) and distinct across resizes.
+  static void* pack_phantom(Version_type* phantom) {
+      return (void*) ((uintptr_t) phantom | bucket_bit);
   }
-  void* pack_bucket(unsigned bucket) {
-      return (void*) ((bucket << 1) | bucket_bit);
+  // Pending items are keyed by hash, so they too are independent of
+  // resizes. Hashes that agree in all but the top two bits share an item.
+  static bool is_pending(const TransItem& item) {
+      return (uintptr_t) item.key<void*>() & pending_bit;
+  }
+  static void* pack_pending(size_t h) {
+      return (void*) ((h << 2) | pending_bit);
+  }
+  // Scan items are keyed by bucket address.
+  static bool is_scan(const TransItem& item) {
+      return ((uintptr_t) item.key<void*>() & (bucket_bit | pending_bit | scan_bit)) == scan_bit;
+  }
+  static bucket_entry* scan_key(const TransItem& item) {
+      return (bucket_entry*) ((uintptr_t) item.key<void*>() - scan_bit);
+  }
+  static void* pack_scan(bucket_entry* buck) {
+      return (void*) ((uintptr_t) buck | scan_bit);
   }
 
   static bool is_locked(Version_type &v) {
@@ -726,15 +1886,32 @@ private:
   }
 
   template <bool markValid>
-  void insert_locked(bucket_entry& buck, const Key& k, const Value& val) {
+  void insert_locked(bucket_entry& buck, key_arg k, const Value& val) {
+    internal_elem* e = new internal_elem(k, val, markValid);
+    link_locked(buck, e);
+    // an invalid node changes nothing until its insert installs
+    if (markValid) {
+      nontrans_index(e, nullptr, &val);
+      fetch_and_add(&buck.changes, TransactionTid::increment_value);
+    }
+  }
+
+  // Applies a nontransactional write to `e`, from *old_value to
+  // *new_value (null for an insert or a remove), to the indexes.
+  void nontrans_index(internal_elem* e, const Value* old_value, const Value* new_value) {
+    for (auto idx : indexes_)
+      idx->nontrans_update(key_traits::key(e->key), old_value, new_value);
+  }
+
+  void link_locked(bucket_entry& buck, internal_elem* new_head) {
     assert(is_locked(buck.version));
-    auto new_head = new internal_elem(k, val, markValid);
     internal_elem *cur_head = buck.head;
     new_head->next = cur_head;
     buck.head = new_head;
     // TODO(nate): this means we'll always have to do a hard opacity check on 
     // the bucket version (but I don't think we can get a commit tid yet).
     buck.version.inc_nonopaque_version();
+    buck.bump(elem_hash(new_head));
   }
 
 #if 0
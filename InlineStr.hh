@@ -0,0 +1,120 @@
+#pragma once
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// A non-owning reference to a byte string, so lookups by std::string,
+// C string, or (pointer, length) don't have to build a std::string.
+class StrRef {
+public:
+    StrRef(const char* s, size_t len)
+        : s_(s), len_(len) {
+    }
+    StrRef(const char* s)
+        : s_(s), len_(strlen(s)) {
+    }
+    StrRef(const std::string& s)
+        : s_(s.data()), len_(s.length()) {
+    }
+
+    const char* data() const {
+        return s_;
+    }
+    size_t length() const {
+        return len_;
+    }
+    std::string str() const {
+        return std::string(s_, len_);
+    }
+
+    bool operator==(StrRef x) const {
+        return len_ == x.len_ && memcmp(s_, x.s_, len_) == 0;
+    }
+    bool operator!=(StrRef x) const {
+        return !(*this == x);
+    }
+
+    // 8 bytes at a time; the low bits are good enough for `h % nbuckets`
+    size_t hash() const {
+        const uint64_t m = 0x9E3779B97F4A7C15ULL;
+        uint64_t h = len_ * m;
+        const char* s = s_;
+        size_t n = len_;
+        for (; n >= 8; s += 8, n -= 8) {
+            uint64_t x;
+            memcpy(&x, s, 8);
+            h = (h ^ x) * m;
+            h ^= h >> 29;
+        }
+        if (n) {
+            uint64_t x = 0;
+            memcpy(&x, s, n);
+            h = (h ^ x) * m;
+            h ^= h >> 29;
+        }
+        h *= 0xFF51AFD7ED558CCDULL;
+        return h ^ (h >> 32);
+    }
+
+private:
+    const char* s_;
+    size_t len_;
+};
+
+// An immutable string that keeps up to `inline_capacity` bytes inside
+// the object and caches its hash. Hashtable<std::string, ...> nodes store
+// their keys this way, so short keys take no extra allocation and most
+// mismatches are rejected by comparing hashes.
+class InlineStr {
+public:
+    static constexpr size_t inline_capacity = 24;
+
+    InlineStr(StrRef s)
+        : hash_(s.hash()), len_(s.length()) {
+        char* p = buf_;
+        if (!is_inline())
+            p = heap_ = (char*) malloc(len_);
+        memcpy(p, s.data(), len_);
+    }
+    InlineStr(const InlineStr& x)
+        : InlineStr(x.ref()) {
+    }
+    InlineStr& operator=(const InlineStr&) = delete;
+    ~InlineStr() {
+        if (!is_inline())
+            free(heap_);
+    }
+
+    const char* data() const {
+        return is_inline() ? buf_ : heap_;
+    }
+    size_t length() const {
+        return len_;
+    }
+    size_t hash() const {
+        return hash_;
+    }
+    StrRef ref() const {
+        return StrRef(data(), len_);
+    }
+    std::string str() const {
+        return std::string(data(), len_);
+    }
+
+    bool operator==(StrRef x) const {
+        return ref() == x;
+    }
+
+private:
+    size_t hash_;
+    uint32_t len_;
+    union {
+        char buf_[inline_capacity];
+        char* heap_;
+    };
+
+    bool is_inline() const {
+        return len_ <= inline_capacity;
+    }
+};
@@ -10,6 +10,9 @@
 #include "masstree_remove.hh"
 #include "masstree_scan.hh"
 #include "string.hh"
+#include <thread>
+#include <vector>
+#include <atomic>
 #include "Transaction.hh"
 
 #include "StringWrapper.hh"
@@ -24,13 +27,51 @@
 #endif
 
 #include "Debug_rcu.hh"
+#include "Sto_rcu.hh"
 
 typedef stuffed_str<uint64_t> versioned_str;
 
-struct versioned_str_struct : public versioned_str {
+// Where versioned_str buffers come from. `malloc` allocations are retired
+// through RCU with free(); `slab` takes buffers of up to value_slab::max_size
+// bytes from the thread's value_slab, which reuses them after the epoch.
+struct versioned_str_malloc {
+  void* operator()(size_t sz) {
+    TXP_INCREMENT(txp_value_alloc);
+    TXP_INCREMENT(txp_value_malloc);
+    return malloc(sz);
+  }
+  static void deallocate_rcu(void* p, size_t) {
+    Transaction::rcu_free(p);
+  }
+};
+
+struct versioned_str_slab {
+  void* operator()(size_t sz) {
+    if (value_slab::fits(sz))
+      return value_slab::allocate(sz);
+    TXP_INCREMENT(txp_value_alloc);
+    TXP_INCREMENT(txp_value_malloc);
+    return malloc(sz);
+  }
+  static void deallocate_rcu(void* p, size_t sz) {
+    if (value_slab::fits(sz))
+      value_slab::deallocate_rcu(p, sz);
+    else
+      Transaction::rcu_free(p);
+  }
+};
+
+template <typename Alloc>
+struct basic_versioned_str_struct : public versioned_str {
   typedef Masstree::Str value_type;
   typedef versioned_str::stuff_type version_type;
 
+  template <typename StringType>
+  static basic_versioned_str_struct* make(const StringType& s, version_type version) {
+    // TODO: this cast is only safe because we have no ivars or virtual methods
+    return (basic_versioned_str_struct*)versioned_str::make(s, version, Alloc());
+  }
+
   bool needsResize(const value_type& v) {
     return needs_resize(v.length());
   }
@@ -38,18 +79,16 @@ struct versioned_str_struct : public versioned_str {
     return needs_resize(v.length());
   }
 
-  versioned_str_struct* resizeIfNeeded(const value_type& potential_new_value) {
-    // TODO: this cast is only safe because we have no ivars or virtual methods
-    return (versioned_str_struct*)this->reserve(versioned_str::size_for(potential_new_value.length()));
+  basic_versioned_str_struct* resizeIfNeeded(const value_type& potential_new_value) {
+    return (basic_versioned_str_struct*)this->reserve(versioned_str::size_for(potential_new_value.length()), Alloc());
   }
-  versioned_str_struct* resizeIfNeeded(const std::string& potential_new_value) {
-    // TODO: this cast is only safe because we have no ivars or virtual methods
-    return (versioned_str_struct*)this->reserve(versioned_str::size_for(potential_new_value.length()));
+  basic_versioned_str_struct* resizeIfNeeded(const std::string& potential_new_value) {
+    return (basic_versioned_str_struct*)this->reserve(versioned_str::size_for(potential_new_value.length()), Alloc());
   }
 
   template <typename StringType>
   inline void set_value(const StringType& v) {
-    auto *ret = this->replace(v.data(), v.length());
+    auto *ret = this->replace(v.data(), v.length(), Alloc());
     // we should already be the proper size at this point
     (void)ret;
     assert(ret == this);
@@ -64,8 +103,8 @@ struct versioned_str_struct : public versioned_str {
     return stuff();
   }
 
-  inline void deallocate_rcu(threadinfo& ti) {
-    ti.deallocate_rcu(this, this->capacity() + sizeof(versioned_str_struct), memtag_value);
+  inline void deallocate_rcu() {
+    Alloc::deallocate_rcu(this, this->capacity() + sizeof(versioned_str));
   }
 
   // Masstree debug printer
@@ -76,10 +115,15 @@ struct versioned_str_struct : public versioned_str {
   }
 };
 
+typedef basic_versioned_str_struct<versioned_str_malloc> versioned_str_struct;
+typedef basic_versioned_str_struct<versioned_str_slab> slab_str_struct;
+
 template <typename V, typename Box = versioned_value_struct<V>, bool Opacity = true>
 class MassTrans : public TObject {
 public:
-#if !RCU
+#if RCU
+  typedef sto_threadinfo threadinfo;
+#else
   typedef debug_threadinfo threadinfo;
 #endif
 
@@ -105,43 +149,20 @@ public:
     typedef std::string key_write_value_type;
 
   MassTrans() {
-#if RCU
-    if (!mythreadinfo.ti) {
-      auto* ti = threadinfo::make(threadinfo::TI_MAIN, -1);
-      mythreadinfo.ti = ti;
-    }
-#else
-    mythreadinfo.ti = new threadinfo;
-#endif
+    thread_init();
     table_.initialize(*mythreadinfo.ti);
     // TODO: technically we could probably free this threadinfo at this point since we won't use it again,
     // but doesn't seem to be possible
   }
 
+  // Nothing to do: tree nodes and values are retired through STO's RCU
+  // (see sto_threadinfo), so Masstree's globalepoch is unused.
   static void static_init() {
-    Transaction::epoch_advance_callback = [] (unsigned) {
-      // just advance blindly because of the way Masstree uses epochs
-      globalepoch++;
-    };
   }
 
   static void thread_init() {
-#if !RCU
-    mythreadinfo.ti = new threadinfo;
-    return;
-#else
-
-    if (!mythreadinfo.ti) {
-      auto* ti = threadinfo::make(threadinfo::TI_PROCESS, TThread::id());
-      mythreadinfo.ti = ti;
-    }
-    Transaction::tinfo[TThread::id()].trans_start_callback = [] () {
-      mythreadinfo.ti->rcu_start();
-    };
-    Transaction::tinfo[TThread::id()].trans_end_callback = [] () {
-      mythreadinfo.ti->rcu_stop();
-    };
-#endif
+    if (!mythreadinfo.ti)
+      mythreadinfo.ti = new threadinfo;
   }
 
   // print the content of the underlying Masstree
@@ -175,6 +196,59 @@ public:
     return found;
   }
 
+  // Parallel loader: puts key/value pairs (anything with `first`
+  // convertible to Str and a `second`) from [first, last), which must be
+  // sorted by key, using the calling thread and `nthreads - 1` helpers.
+  // Nothing else may use the tree during the load; afterwards it is ready
+  // for transactions. This is not a bottom-up bulk build: every key still
+  // goes through nontransPut, descending from the root and splitting
+  // leaves one insert at a time.
+  //
+  // The input is cut into `runs_per_thread` times as many runs as there
+  // are threads, and threads take runs from a shared counter, so one slow
+  // thread doesn't hold up the load. Each run's first key is put up front,
+  // in order, by the calling thread: the splits that separate the runs
+  // then happen once, uncontended, and every run afterwards appends into
+  // its own leaves. (A single thread appends at the right edge of the tree,
+  // where Masstree splits leaves full; appends in the middle of the tree
+  // split them in half, so parallel loads trade leaf fill for speed.)
+  //
+  // Helpers run as TThread ids [helper_id, helper_id + nthreads - 1), so
+  // each has its own Transaction::tinfo. The caller chooses ids that no
+  // other thread, including itself, uses during the load.
+  template <typename RandomIt>
+  void bulk_load(RandomIt first, RandomIt last, int nthreads = 1, int helper_id = -1) {
+    static constexpr size_t runs_per_thread = 8;
+    size_t n = last - first;
+    nthreads = std::max(nthreads, 1);
+    always_assert(nthreads == 1
+                  || (helper_id >= 0 && helper_id + nthreads - 1 <= MAX_THREADS
+                      && (TThread::id() < helper_id
+                          || TThread::id() >= helper_id + nthreads - 1)));
+    size_t nruns = nthreads == 1 ? 1 : std::min(n, nthreads * runs_per_thread);
+    for (size_t r = 1; r < nruns; ++r)
+      nontransPut(Str(first[n * r / nruns].first), first[n * r / nruns].second);
+    std::atomic<size_t> next_run(0);
+    auto load = [&] () {
+      threadinfo_type ti;
+      ti.ti = new threadinfo;
+      size_t r;
+      while ((r = next_run++) < nruns)
+        for (size_t i = n * r / nruns + (r != 0); i < n * (r + 1) / nruns; ++i)
+          nontransPut(Str(first[i].first), first[i].second, ti);
+      delete ti.ti;
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads - 1; ++i)
+      threads.emplace_back([&load] (int id) {
+          TThread::set_id(id);
+          load();
+        }, helper_id + i);
+    load();
+    for (auto& th : threads)
+      th.join();
+  }
+
   template <typename ValType>
   bool transGet(Str key, ValType& retval, threadinfo_type& ti = mythreadinfo) {
     unlocked_cursor_type lp(table_, key);
@@ -348,8 +422,8 @@ public:
     return c(key, val->read_value());
   }
 
-  template <typename Callback>
-  static bool query_callback_overload(Str key, versioned_str_struct *val, Callback c) {
+  template <typename Callback, typename A>
+  static bool query_callback_overload(Str key, basic_versioned_str_struct<A> *val, Callback c) {
     return c(key, val);
   }
 
@@ -453,6 +527,215 @@ public:
 #endif
 
 protected:
+  // a value a cursor scanned; `mine` if this transaction wrote it
+  struct pending_read {
+    versioned_value* e;
+    Version v;
+    bool mine;
+  };
+
+public:
+  // A pull-style range query. Each next(n) runs one scan from the
+  // cursor's position, copies up to n key/value pairs into batch(), and
+  // stops; the following call resumes just past the last key returned.
+  // Reads are registered as transQuery registers them, and own writes are
+  // visible the same way. A forward cursor returns keys in [begin, end),
+  // a reverse one keys from begin down to, but not including, end. An
+  // empty end means no bound.
+  //
+  // With summarize_leaves(true), a leaf whose values one next() call
+  // returned in full is registered as one read (the sum of its values'
+  // versions) rather than one read per value, which keeps the read set of
+  // a long scan small. Leaves holding own writes or layers, and the
+  // partly read leaves at either end of a batch, fall back to per-value
+  // reads.
+  class cursor {
+  public:
+    typedef std::pair<std::string, value_type> entry_type;
+
+    cursor(MassTrans& mt, Str begin, Str end = Str(), bool reverse = false, threadinfo_type& ti = mythreadinfo)
+      : mt_(mt), ti_(ti), pos_(begin.data(), begin.length()), emit_pos_(true),
+        end_(end.data(), end.length()), reverse_(reverse), summarize_(false),
+        done_(false), limit_(SIZE_MAX) {
+    }
+
+    // Restart at `key` (inclusive), keeping the end bound and limit.
+    void seek(Str key) {
+      pos_.assign(key.data(), key.length());
+      emit_pos_ = true;
+      done_ = false;
+      batch_.clear();
+    }
+    // At most `n` more pairs will be returned.
+    void set_limit(size_t n) {
+      limit_ = n;
+    }
+    void summarize_leaves(bool on) {
+      summarize_ = on;
+    }
+    // Ends the scan early; next() returns 0 until the next seek().
+    void stop() {
+      done_ = true;
+      batch_.clear();
+    }
+    bool done() const {
+      return done_;
+    }
+
+    // Fetches up to `n` more pairs into batch(), returning how many.
+    size_t next(size_t n) {
+      batch_.clear();
+      n = std::min(n, limit_);
+      if (done_ || n == 0) {
+        done_ = true;
+        return 0;
+      }
+
+      leaf_type* leaf = nullptr;
+      typename unlocked_cursor_type::nodeversion_value_type leaf_version = 0;
+      auto node_callback = [&] (leaf_type* node, typename unlocked_cursor_type::nodeversion_value_type version) {
+        mt_.finish_leaf(leaf, leaf_version, pending_, summarize_, reverse_);
+        leaf = node;
+        leaf_version = version;
+        mt_.ensureNotFound(node, version);
+      };
+      auto value_callback = [&] (Str key, versioned_value* e) {
+        auto item = mt_.t_read_only_item(e);
+#if READ_MY_WRITES
+        if (has_delete(item)) {
+          pending_.push_back(pending_read{e, 0, true});
+          return true;
+        }
+        if (item.has_write()) {
+          pending_.push_back(pending_read{e, 0, true});
+          value_type val;
+          if (has_insert(item))
+            assign_val(val, e->read_value());
+          else
+            val = item.template write_value<write_value_type>();
+          batch_.emplace_back(std::string(key.data(), key.length()), std::move(val));
+          return batch_.size() < n;
+        }
+#endif
+        value_type val;
+        Version v;
+        atomicRead(e, v, val);
+        pending_.push_back(pending_read{e, v, false});
+        if (v & invalid_bit)
+          return true;
+        batch_.emplace_back(std::string(key.data(), key.length()), std::move(val));
+        return batch_.size() < n;
+      };
+
+      if (reverse_) {
+        range_scanner<decltype(node_callback), decltype(value_callback), true> scanner(Str(end_), node_callback, value_callback);
+        mt_.table_.rscan(Str(pos_), emit_pos_, scanner, *ti_.ti);
+      } else {
+        range_scanner<decltype(node_callback), decltype(value_callback)> scanner(Str(end_), node_callback, value_callback);
+        mt_.table_.scan(Str(pos_), emit_pos_, scanner, *ti_.ti);
+      }
+      mt_.finish_leaf(leaf, leaf_version, pending_, summarize_, reverse_);
+
+      limit_ -= batch_.size();
+      if (batch_.size() < n || limit_ == 0)
+        done_ = true;
+      else {
+        pos_ = batch_.back().first;
+        emit_pos_ = false;
+      }
+      return batch_.size();
+    }
+
+    // The pairs the last next() returned.
+    const std::vector<entry_type>& batch() const {
+      return batch_;
+    }
+
+  private:
+    MassTrans& mt_;
+    threadinfo_type& ti_;
+    std::string pos_;
+    bool emit_pos_;
+    std::string end_;
+    bool reverse_;
+    bool summarize_;
+    bool done_;
+    size_t limit_;
+    std::vector<entry_type> batch_;
+    // the current leaf's values, registered when the scan leaves it
+    std::vector<pending_read> pending_;
+  };
+
+protected:
+  // Registers the reads of a leaf's scanned values, as one leaf digest
+  // read if `summarize` and they are exactly the leaf's values.
+  template <typename NODE, typename VERSION>
+  void finish_leaf(NODE* n, VERSION nv, std::vector<pending_read>& pending, bool summarize, bool reverse) {
+    if (pending.empty())
+      return;
+    if (summarize && whole_leaf(n, nv, pending, reverse)) {
+      Version digest = 0;
+      for (auto& p : pending) {
+        if (Opacity)
+          Sto::check_opacity(TransactionTid::unlocked(p.v));
+        digest += TransactionTid::unlocked(p.v);
+      }
+      auto item = Sto::fresh_item(this, tag_digest(n));
+      if (Opacity)
+        item.add_read_opaque(digest);
+      else
+        item.add_read(digest);
+    } else {
+      for (auto& p : pending)
+        if (!p.mine)
+          t_read_only_item(p.e).observe(tversion_type(p.v));
+    }
+    pending.clear();
+  }
+
+  // Whether `pending` holds, in scan order, every value of leaf `n`, none
+  // of them written by this transaction.
+  template <typename NODE, typename VERSION>
+  static bool whole_leaf(NODE* n, VERSION nv, const std::vector<pending_read>& pending, bool reverse) {
+    auto perm = n->permutation();
+    int size = perm.size();
+    if (size != (int) pending.size())
+      return false;
+    for (int i = 0; i != size; ++i) {
+      auto& p = pending[reverse ? size - 1 - i : i];
+      if (p.mine || n->lv_[perm[i]].value() != p.e)
+        return false;
+    }
+    fence();
+    return n->full_version_value() == nv;
+  }
+
+  // Recomputes a summarized leaf's digest. Values this transaction has
+  // since inserted into the leaf are left out, so scanning and then
+  // inserting into the scanned range still validates.
+  template <typename NODE, typename VERSION>
+  bool leaf_digest(NODE* n, VERSION nv, int threadid, Version& digest) {
+    if (n->full_version_value() != nv)
+      return false;
+    fence();
+    auto perm = n->permutation();
+    digest = 0;
+    for (int i = 0; i != perm.size(); ++i) {
+      versioned_value* e = n->lv_[perm[i]].value();
+      Version v = e->version();
+      if (TransactionTid::is_locked_elsewhere(v, threadid))
+        return false;
+      if (v & invalid_bit) {
+        auto it = Sto::check_item(this, e);
+        if (it && has_insert(it->item()))
+          continue;
+      }
+      digest += TransactionTid::unlocked(v);
+    }
+    fence();
+    return n->full_version_value() == nv;
+  }
+
   // range query class thang
   template <typename Nodecallback, typename Valuecallback, bool Reverse = false>
   class range_scanner {
@@ -532,7 +815,15 @@ public:
         versioned_value* vv = item.key<versioned_value*>();
         return txn.try_lock(item, vv->version());
     }
-  bool check(TransItem& item, Transaction&) override {
+  bool check(TransItem& item, Transaction& txn) override {
+    if (is_digest(item)) {
+      auto n = untag_digest(item.key<leaf_type*>());
+      auto leaf_item = Sto::check_item(this, tag_inter(n));
+      Version digest;
+      return leaf_item
+        && leaf_digest(n, leaf_item->template read_value<typename unlocked_cursor_type::nodeversion_value_type>(), txn.threadid(), digest)
+        && digest == item.template read_value<Version>();
+    }
     if (is_inter(item)) {
       auto n = untag_inter(item.key<leaf_type*>());
       auto cur_version = n->full_version_value();
@@ -600,7 +891,8 @@ public:
   bool remove(const Str& key, threadinfo_type& ti = mythreadinfo) {
     cursor_type lp(table_, key);
     bool found = lp.find_locked(*ti.ti);
-    lp.value()->deallocate_rcu(*ti.ti);
+    if (found)
+      lp.value()->deallocate_rcu();
     lp.finish(found ? -1 : 0, *ti.ti);
     return found;
   }
@@ -644,7 +936,7 @@ protected:
       lp.value() = new_location;
       lp.finish(0, *mythreadinfo.ti);
       // now rcu free "e"
-      e->deallocate_rcu(*mythreadinfo.ti);
+      e->deallocate_rcu();
     }
 #if READ_MY_WRITES
     if (has_insert(item)) {
@@ -750,6 +1042,8 @@ protected:
   static constexpr Version invalid_bit = TransactionTid::user_bit;
 
   static constexpr uintptr_t internode_bit = 1<<0;
+  // marks a cursor's summary read of a whole leaf
+  static constexpr uintptr_t digest_bit = 1<<1;
 
   static constexpr TransItem::flags_type insert_bit = TransItem::user0_bit;
   static constexpr TransItem::flags_type delete_bit = TransItem::user0_bit<<1;
@@ -769,6 +1063,17 @@ protected:
   static bool is_inter(const TransItem& t) {
       return is_inter(t.key<versioned_value*>());
   }
+  template <typename T>
+  static T* tag_digest(T* p) {
+    return (T*)((uintptr_t)p | digest_bit);
+  }
+  template <typename T>
+  static T* untag_digest(T* p) {
+    return (T*)((uintptr_t)p & ~digest_bit);
+  }
+  static bool is_digest(const TransItem& t) {
+    return (uintptr_t)t.key<versioned_value*>() & digest_bit;
+  }
 
   static void check_opacity(Version& v) {
     Version v2 = v;
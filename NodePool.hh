@@ -0,0 +1,111 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+#include <new>
+#include <utility>
+#include "Transaction.hh"
+
+// Per-thread pool of fixed-size nodes for trees that allocate and free one
+// node at a time. Nodes are carved from cache-line-aligned chunks, so a
+// node costs sizeof(T) (malloc adds a header and rounds up) and nodes
+// allocated together share cache lines. A freed node, including one
+// retired through Transaction::rcu_call, goes on the freeing thread's
+// list and is reused from there. Memory is never returned to malloc.
+//
+// Bytes [HotBegin, HotEnd) of a node never straddle a cache line, so a
+// lookup that reads only those touches one line per node.
+template <typename T, size_t HotBegin = 0, size_t HotEnd = HotBegin>
+class node_pool {
+public:
+    static constexpr size_t line_size = 64;
+    static constexpr size_t chunk_size = 1 << 20;
+
+    template <typename... Args>
+    static T* make(Args&&... args) {
+        return new (allocate()) T(std::forward<Args>(args)...);
+    }
+    // makes sure this thread's next make() won't call malloc, so a caller
+    // can keep allocation out of a critical section
+    static void reserve() {
+        pool& p = mine();
+        if (!p.free && !has_room(p))
+            refill(p);
+    }
+    // free a node no other thread can reach
+    static void destroy(T* x) {
+        x->~T();
+        push(mine(), x);
+    }
+    // free once no transaction can still be reading `x`
+    static void destroy_rcu(T* x) {
+        Transaction::rcu_call(release, x);
+    }
+    // bytes taken from malloc by all threads' pools
+    static size_t footprint() {
+        return footprint_;
+    }
+
+private:
+    static constexpr size_t node_align = alignof(T) > alignof(void*) ? alignof(T) : alignof(void*);
+    static constexpr size_t node_size = (sizeof(T) + node_align - 1) & ~(node_align - 1);
+    // a hot range longer than a line can't be kept in one
+    static constexpr size_t hot_size = HotEnd - HotBegin <= line_size ? HotEnd - HotBegin : 0;
+
+    struct cell {
+        cell* next;
+    };
+    struct pool {
+        cell* free;
+        char* next;
+        char* end;
+    };
+    static size_t footprint_;
+
+    static pool& mine() {
+        static __thread pool p;
+        return p;
+    }
+    static void* allocate() {
+        pool& p = mine();
+        if (cell* x = p.free) {
+            p.free = x->next;
+            return x;
+        }
+        if (!has_room(p))
+            refill(p);
+        uintptr_t x = place(uintptr_t(p.next));
+        p.next = reinterpret_cast<char*>(x + node_size);
+        return reinterpret_cast<void*>(x);
+    }
+    // whether the current chunk can fit another node
+    static bool has_room(const pool& p) {
+        return p.next && place(uintptr_t(p.next)) + node_size <= uintptr_t(p.end);
+    }
+    // the first address at or after `x` where a node's hot bytes fit in
+    // one line
+    static uintptr_t place(uintptr_t x) {
+        uintptr_t off = (x + HotBegin) & (line_size - 1);
+        if (hot_size && off + hot_size > line_size)
+            x += line_size - off;
+        return x;
+    }
+    static void push(pool& p, void* ptr) {
+        cell* x = static_cast<cell*>(ptr);
+        x->next = p.free;
+        p.free = x;
+    }
+    static void release(void* ptr) {
+        destroy(static_cast<T*>(ptr));
+    }
+    static void refill(pool& p) {
+        void* x;
+        if (posix_memalign(&x, line_size, chunk_size) != 0)
+            throw std::bad_alloc();
+        fetch_and_add(&footprint_, chunk_size);
+        p.next = static_cast<char*>(x);
+        p.end = p.next + chunk_size;
+    }
+};
+
+template <typename T, size_t HotBegin, size_t HotEnd>
+size_t node_pool<T, HotBegin, HotEnd>::footprint_;
@@ -2,28 +2,53 @@
 
 #include <cassert>
 #include <utility>
+#include <algorithm>
 #include "TaggedLow.hh"
+#include "local_vector.hh"
 #include "Interface.hh"
 #include "TWrapped.hh"
 #include "RBTreeInternal.hh"
+#include "NodePool.hh"
 
 #ifndef STO_NO_STM
 #include "Transaction.hh"
 #endif
 
-#define DEBUG 0
-#if DEBUG
+#ifndef RBTREE_DEBUG
+#define RBTREE_DEBUG 0
+#endif
+#if RBTREE_DEBUG
 extern TransactionTid::type lock;
 #endif
 
 template <typename K, typename T, bool GlobalSize> class RBTreeIterator;
 template <typename K, typename T, bool GlobalSize> class RBTree;
 
+#if STO_RBTREE_COMPACT
+// puts the links ahead of the pair
+template <typename P> class rbwrapper;
+template <typename P>
+struct rbwrapper_links {
+    rblinks<rbwrapper<P> > rblinks_;
+};
+
+template <typename P>
+class rbwrapper : public rbwrapper_links<P>, public P {
+#else
 template <typename P>
 class rbwrapper : public P {
+#endif
   public:
     typedef typename P::key_type key_type;
     typedef typename P::value_type value_type;
+#if STO_RBTREE_COMPACT
+    // the child pointers through the pair's lookup fields
+    static constexpr size_t hot_begin = sizeof(rblinks<rbwrapper<P> >) - 2 * sizeof(rbnodeptr<rbwrapper<P> >);
+    static constexpr size_t hot_end = sizeof(rblinks<rbwrapper<P> >) + P::hot_size;
+#else
+    static constexpr size_t hot_begin = 0, hot_end = 0;
+#endif
+    typedef node_pool<rbwrapper<P>, hot_begin, hot_end> pool_type;
 
     explicit inline rbwrapper(const P& x)
     : P(x) {
@@ -34,7 +59,9 @@ class rbwrapper : public P {
     inline P& mutable_rbpair() {
         return *this;
     }
+#if !STO_RBTREE_COMPACT
     rblinks<rbwrapper<P> > rblinks_;
+#endif
 };
 
 // Define a custom key-value pair type that contains versions and also
@@ -59,11 +86,11 @@ public:
     explicit rbpair(const K& key, const T& value)
     : key_(key), val_(value),
       vers_(Sto::initialized_tid() + insert_bit),
-      nodevers_(Sto::initialized_tid()), hohvers_() {}
+      nodevers_(Sto::initialized_tid()) {}
     explicit rbpair(std::pair<const K, T>& kvp)
     : key_(kvp.first), val_(kvp.second),
       vers_(Sto::initialized_tid() + insert_bit),
-      nodevers_(Sto::initialized_tid()), hohvers_() {}
+      nodevers_(Sto::initialized_tid()) {}
 
     // version getters
     version_type& version() {
@@ -78,6 +105,9 @@ public:
     const version_type& nodeversion() const {
         return nodevers_;
     }
+    version_type& hohversion() {
+        return hohvers_;
+    }
 
     // transactional access to key-value pair
     void lock() {
@@ -151,6 +181,53 @@ public:
         return (hohvers_ == old_v);
     }
 
+    // subtree counts include only committed nodes
+    bool counted() const {
+        return !(vers_.value() & insert_bit);
+    }
+    TNonopaqueVersion& countversion() {
+        return countvers_;
+    }
+    void lock_countversion() {
+        countvers_.lock();
+    }
+    void unlock_countversion() {
+        countvers_.set_version_unlock(next_countversion());
+    }
+    // the version unlock_countversion() installs
+    TNonopaqueVersion next_countversion() const {
+        return TNonopaqueVersion(TransactionTid::next_nonopaque_version(countvers_.unlocked()));
+    }
+    TNonopaqueVersion stable_countversion() const {
+        TNonopaqueVersion v = countvers_;
+        while (v.is_locked()) {
+            relax_fence();
+            v = countvers_;
+        }
+        acquire_fence();
+        return v;
+    }
+
+#if STO_RBTREE_COMPACT
+private:
+    // what a lookup reads, in the order it reads it
+    struct hot_fields {
+        version_type hohvers_;
+        K key_;
+        TWrapped<T> val_;
+        version_type vers_;
+    };
+public:
+    static constexpr size_t hot_size = sizeof(hot_fields);
+
+private:
+    version_type hohvers_;
+    const K key_;
+    TWrapped<T> val_;
+    version_type vers_;
+    version_type nodevers_;
+    TNonopaqueVersion countvers_;
+#else
 private:
     // key-value pair associated with a version for the data
     const K key_;
@@ -158,6 +235,8 @@ private:
     version_type vers_;
     version_type nodevers_;
     version_type hohvers_;
+    TNonopaqueVersion countvers_;
+#endif
 };
 
 template <typename K, typename T, bool GlobalSize> class RBProxy;
@@ -171,13 +250,14 @@ class RBTree
     friend class RBTreeIterator<K, T, GlobalSize>;
     friend class RBProxy<K, T, GlobalSize>;
 
-    typedef TransactionTid::type RWVersion;
     typedef TWrapped<std::pair<const K, T>> wrapped_pair;
     typedef typename wrapped_pair::version_type Version;
     typedef Version version_type;
 
     static constexpr TransItem::flags_type insert_tag = TransItem::user0_bit;
     static constexpr TransItem::flags_type delete_tag = TransItem::user0_bit<<1;
+    // set on the item whose install took structlock_ for the commit
+    static constexpr TransItem::flags_type structlock_tag = TransItem::user0_bit<<2;
     static constexpr TransactionTid::type insert_bit = TransactionTid::user_bit;
 
     typedef RBTreeIterator<K, T, GlobalSize> iterator;
@@ -187,8 +267,8 @@ public:
     RBTree() {
         sizeversion_ = 0;
         size_ = 0;
-        treelock_ = 0;
-#if DEBUG
+        structlock_ = 0;
+#if RBTREE_DEBUG
         stats_ = {0,0,0,0,0,0};
 #endif
     }
@@ -220,6 +300,17 @@ public:
     bool stamp_insert(const K& key, const T& val);
     T stamp_find(const K& key);
 
+#ifndef STO_NO_STM
+    // Order statistics over the transaction's view of the tree: the
+    // number of keys in [lo, hi), and the key with `rank` keys before it.
+    // Both read O(log n) versions, not one per key. A subtree counted
+    // whole is covered by its count version, and each node on the search
+    // paths by its node version. Adjusting for the transaction's own
+    // inserts and erases scans its item set.
+    size_t transCountRange(const K& lo, const K& hi);
+    bool transSelect(size_t rank, K& key, T& value);
+#endif
+
 /*
     void lock(wrapped_pair *e) {
         e->lock();
@@ -229,21 +320,11 @@ public:
     }
 */
 
+  // Lookups don't lock; wrapper_tree_.find_any retries if it races with
+  // a structural change.
   __attribute__((always_inline)) std::tuple<wrapper_type*, Version, bool, boundaries_type> verified_lookup(rbwrapper<rbpair<K, T>>& rbkvp) const {
-        do {
-            auto initial = treelock_;
-	    fence();
-	    if (TransactionTid::is_locked(initial)) {
-                relax_fence();
-                continue;
-            }
-	    auto results = wrapper_tree_.find_any(rbkvp,
-                             rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
-	    fence();
-	    if (initial == treelock_)
-                return results;
-	    relax_fence();
-	} while(1);
+        return wrapper_tree_.find_any(rbkvp,
+                   rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
     }
 
 #ifndef STO_NO_STM
@@ -285,7 +366,7 @@ public:
     bool check(TransItem& item, Transaction& trans) override;
     void install(TransItem& item, Transaction& t) override;
     void cleanup(TransItem& item, bool committed) override;
-#if DEBUG
+#if RBTREE_DEBUG
     void print_absent_reads();
 #endif
     void print(std::ostream& w, const TransItem& item) const override;
@@ -360,6 +441,28 @@ private:
         return (is_inserted(val_ver) && !has_insert(item) && !has_delete(item));
     }
 
+    // A new node under another transaction's uncommitted insert changes no
+    // nodeversion that a reader of the gap could have seen, so it would go
+    // unnoticed if that insert aborted. It also bumps the nodeversion of
+    // the nearest ancestor that isn't such a phantom, which bounds the gap.
+    void cover_phantom_parent(wrapper_type* p) {
+        if (!p || !is_foreign_phantom(p))
+            return;
+        lock_structure();
+        while (p && is_foreign_phantom(p))
+            p = p->rblinks_.p_;
+        unlock_structure();
+        if (p)
+            Sto::item(this, reinterpret_cast<uintptr_t>(p) | 0x1).add_write(0);
+        else
+            Sto::item(this, tree_key_).add_write(0);
+    }
+    bool is_foreign_phantom(wrapper_type* n) const {
+        auto item = Sto::check_item(this, n);
+        return is_inserted(n->version())
+            && !(item && (has_insert(*item) || has_delete(*item)));
+    }
+
     // A soft phantom node is a node that's marked inserted by the current
     // transaction. Its value information is visible (and only visible) to
     // the current transaction
@@ -377,7 +480,7 @@ private:
         ssize_t prev_offset = size_item.has_write() ? size_item.template write_value<ssize_t>() : 0;
         size_item.add_write(prev_offset + delta);
         assert(size_ + size_item.template write_value<ssize_t>() >= 0);
-#if DEBUG
+#if RBTREE_DEBUG
         TransactionTid::lock(::lock);
         printf("\tbase size: %lu\n", size_); 
         printf("\toffset: %ld\n", size_item.template write_value<ssize_t>());
@@ -411,7 +514,7 @@ private:
                     return results;
                 } else {
                     // some other transaction inserted this node and hasn't committed
-#if DEBUG
+#if RBTREE_DEBUG
                     TransactionTid::lock(::lock);
                     printf("Aborted in find_or_abort\n");
                     TransactionTid::unlock(::lock);
@@ -437,7 +540,7 @@ private:
                 wrapper_type* n = std::get<0>(binfo);
                 Version v = std::get<1>(binfo);
                 if (n) {
-#if DEBUG
+#if RBTREE_DEBUG
                     TransactionTid::lock(::lock);
                     printf("\t#Tracking boundary 0x%lx (k %d), nv 0x%lx\n", (unsigned long)n, n->key(), v);
                     TransactionTid::unlock(::lock);
@@ -461,10 +564,23 @@ private:
     // @parent: parent of the returned node, prior to any insertions
     inline std::tuple<wrapper_type*, Version, bool, boundaries_type, node_info_type>
     find_or_insert(wrapper_type& rbkvp) {
-        lock_write(&treelock_);
+        // most calls find the key, which needs no lock
+        auto found_results = verified_lookup(rbkvp);
+        if (std::get<2>(found_results)) {
+            wrapper_type* x = std::get<0>(found_results);
+            Version ver = std::get<1>(found_results);
+            if (is_phantom_node(x, ver))
+                Sto::abort();
+            return std::make_tuple(x, ver, true, std::get<3>(found_results),
+                                   node_info_type(nullptr, Version()));
+        }
+        // find_insert may make a node; get its memory before locking
+        wrapper_type::pool_type::reserve();
+        lock_structure();
         auto results = wrapper_tree_.find_insert(rbkvp,
                            rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
-        unlock_write(&treelock_);
+        forward_count_reads();
+        unlock_structure();
 
         bool found = std::get<2>(results);
         wrapper_type* ans = std::get<0>(results);
@@ -479,13 +595,10 @@ private:
     // Insert nonexistent key with empty value
     // return value is a pointer to the inserted node 
     inline wrapper_type* insert_absent(rbnodeptr<wrapper_type> found_p, const K& key) {
-#if DEBUG
+#if RBTREE_DEBUG
             stats_.absent_insert++;
 #endif
-            // use in-place constructor so that we don't mix up c++'s new and c's free()
-            // XXX(nate): we'd need to an rcu delete if T is a nontrivial type.
-            wrapper_type* n = (wrapper_type*)malloc(sizeof(wrapper_type));
-            new (n) wrapper_type(rbpair<K, T>(key, T()));
+            wrapper_type* n = wrapper_type::pool_type::make(rbpair<K, T>(key, T()));
             // insert new node under parent
             bool side = (found_p.node() == nullptr)? false :
                     wrapper_tree_.r_.node_compare(*n, *found_p.node()) > 0;
@@ -534,7 +647,7 @@ private:
         // INSERT: kvp did not exist
         // @ver is *nodeversion*
         if (!found) {
-#if DEBUG
+#if RBTREE_DEBUG
             stats_.absent_insert++;
 #endif
             wrapper_type* lhs = std::get<0>(boundaries.first);
@@ -556,13 +669,14 @@ private:
                 }
             }
             Sto::item(this, x).add_write(T()).add_flags(insert_tag);
+            cover_phantom_parent(p);
             change_size_offset(1);
             return x;
         }
         // UPDATE: kvp is already inserted into the tree
         // @ver is *value version*
         else {
-#if DEBUG
+#if RBTREE_DEBUG
             stats_.present_insert++;
 #endif
             auto item = Sto::item(this, x);
@@ -593,17 +707,173 @@ private:
         }
     }
 
+    // a read recorded during a lock-free descent, added to the
+    // transaction only once the whole descent validates
+    struct pending_read {
+        uintptr_t key;
+        TransactionTid::type version;
+    };
+    // What a lock-free descent saw: the reads to add once it validates,
+    // and the hohversion of each node whose links it followed. Each step
+    // checks only its own link, so the reads form one snapshot only if
+    // none of those nodes changed by the end.
+    struct descent {
+        local_vector<pending_read, 96> reads;
+        local_vector<std::pair<wrapper_type*, Version>, 64> path;
+        void clear() {
+            reads.clear();
+            path.clear();
+        }
+        bool path_unchanged() const {
+            for (auto& x : path)
+                if (!x.first->validate_hohversion(x.second))
+                    return false;
+            return true;
+        }
+    };
+    // net insert (+1) or erase (-1) by this transaction
+    struct own_change {
+        const K* key;
+        int delta;
+        bool operator<(const own_change& x) const {
+            return *key < *x.key;
+        }
+    };
+
+    static bool is_count_key(uintptr_t x) {
+        return (x & count_bit) && x != size_key_;
+    }
+
+    std::vector<own_change> own_changes() const {
+        std::vector<own_change> changes;
+        if (Sto::transaction()->any_writes())
+            Sto::transaction()->for_each_item(this, [&] (TransItem& item) {
+                    uintptr_t x = item.key<uintptr_t>();
+                    if (x & (tree_bit | size_bit))
+                        return;
+                    wrapper_type* n = reinterpret_cast<wrapper_type*>(x);
+                    if (has_insert(item))
+                        changes.push_back(own_change{&n->key(), 1});
+                    else if (has_delete(item) && !is_inserted(n->version()))
+                        changes.push_back(own_change{&n->key(), -1});
+                });
+        std::sort(changes.begin(), changes.end());
+        return changes;
+    }
+    // sum of own changes with keys strictly between lb and ub (null is
+    // unbounded)
+    static ssize_t own_delta(const std::vector<own_change>& changes,
+                             const K* lb, const K* ub) {
+        ssize_t delta = 0;
+        for (auto& c : changes)
+            if ((!lb || *lb < *c.key) && (!ub || *c.key < *ub))
+                delta += c.delta;
+        return delta;
+    }
+    // this transaction's view of whether n holds a key
+    bool view_counted(wrapper_type* n, Version v) const {
+        auto item = Sto::check_item(this, n);
+        if (item && has_insert(*item))
+            return true;
+        else if (item && has_delete(*item))
+            return false;
+        else
+            return !is_inserted(v);
+    }
+
+    void record_value(wrapper_type* n, Version v, descent& d) const {
+        d.reads.push_back(pending_read{reinterpret_cast<uintptr_t>(n), v.value()});
+    }
+    void record_node(wrapper_type* n, Version hohv, descent& d) const {
+        d.path.push_back(std::make_pair(n, hohv));
+        d.reads.push_back(pending_read{reinterpret_cast<uintptr_t>(n) | 1,
+                                     n->nodeversion().value()});
+    }
+    void record_count(wrapper_type* c, TNonopaqueVersion v, descent& d) const {
+        if (c)
+            d.reads.push_back(pending_read{reinterpret_cast<uintptr_t>(c) | count_bit, v.value()});
+    }
+    // reads the count of subtree `c`; false if it changed while we looked
+    bool read_count(wrapper_type* c, size_t& count, TNonopaqueVersion& v) const {
+        if (!c) {
+            count = 0;
+            return true;
+        }
+        v = c->stable_countversion();
+        count = c->rblinks_.count_;
+        acquire_fence();
+        return c->countversion() == v;
+    }
+    void apply_reads(const descent& d) {
+        for (auto& r : d.reads)
+            if (is_count_key(r.key))
+                Sto::item(this, r.key).observe(TNonopaqueVersion(r.version));
+            else if (r.key & 1)
+                Sto::item(this, r.key).observe(Version(r.version));
+            else {
+                auto item = Sto::item(this, r.key);
+                Version v(r.version);
+                if (!is_inserted(v) || !(has_insert(item) || has_delete(item)))
+                    item.observe(v);
+            }
+    }
+
+    // Our own insert's rotations mustn't invalidate our own count reads.
+    // The raised node's subtree covers everything the lowered node's and
+    // its own did, so it takes over those reads; the lowered node's now
+    // covers less, so its read can stay. Runs before the versions unlock.
+    void forward_count_reads() {
+        for (auto& r : wrapper_tree_.rotations_) {
+            wrapper_type* down = r.first;
+            wrapper_type* up = r.second;
+            TNonopaqueVersion downv = down->next_countversion();
+            TNonopaqueVersion upv = up->next_countversion();
+            auto downitem = Sto::check_item(this, reinterpret_cast<uintptr_t>(down) | count_bit);
+            auto upitem = Sto::check_item(this, reinterpret_cast<uintptr_t>(up) | count_bit);
+            if (!downitem && !upitem)
+                continue;
+            if (downitem)
+                downitem->update_read(TNonopaqueVersion(down->countversion().unlocked()), downv);
+            if (upitem)
+                upitem->update_read(TNonopaqueVersion(up->countversion().unlocked()), upv);
+            else
+                Sto::item(this, reinterpret_cast<uintptr_t>(up) | count_bit).observe(upv);
+        }
+    }
+
+    bool count_range(const K& lo, const K& hi, size_t& count, descent& d) const;
+    bool count_side(wrapper_type* n, Version nv, const K& bound, bool inward,
+                    size_t& count, descent& d) const;
+    bool select(size_t rank, const std::vector<own_change>& changes,
+                wrapper_type*& found, Version& found_v, descent& d) const;
+
 #endif /* !STO_NO_STM */
 #ifdef STO_NO_STM
     static void change_size_offset(int){}
 #endif
 
-    static void lock_read(RWVersion *v) {TransactionTid::lock_read(*v);}
-    static void lock_write(RWVersion *v) {TransactionTid::lock_write(*v);}
-    static void unlock_read(RWVersion *v) {TransactionTid::unlock_read(*v);}
-    static void unlock_write(RWVersion *v) {
-        TransactionTid::inc_write_version(*v);
-        TransactionTid::unlock_write(*v);
+    // serializes structural changes (inserts of new keys and erases)
+    // tree-wide; only lookups and updates of existing keys avoid it
+    void lock_structure() {
+        TransactionTid::lock(structlock_);
+    }
+    void unlock_structure() {
+        wrapper_tree_.release_touched();
+        TransactionTid::unlock(structlock_);
+    }
+    // A committing transaction's inserts of new keys and erases install
+    // under one hold of structlock_, taken when its first such item
+    // installs and released when that item unlocks, and the count versions
+    // they change stay locked until then. So a count reader sees all of a
+    // transaction's structural changes or none. Taking structlock_ at
+    // install rather than lock keeps it out of the lock and check phases.
+    // Waiting is safe: a holder never waits for a lock a transaction
+    // takes in lock().
+    void lock_structure_for_commit(TransItem& item) {
+        if (!TransactionTid::is_locked_here(structlock_)) {
+            lock_structure();
+            item.add_flags(structlock_tag);
+        }
     }
 
     static bool has_insert(const TransItem& item) {
@@ -623,9 +893,7 @@ private:
     // only add a write to size if we erase or do an absent insert
     size_t size_;
     Version sizeversion_;
-    // XXX: this isn't actually a rwlock anymore so we could just make it a
-    // normal tid or something
-    mutable RWVersion treelock_;
+    TransactionTid::type structlock_;
     // used to mark whether a key is for the tree structure (for tree version checks)
     // or a pointer (which will always have the lower 3 bits as 0)
     static constexpr uintptr_t tree_bit = 1U<<0;
@@ -634,7 +902,9 @@ private:
     static constexpr uintptr_t size_key_ = size_bit;
     static constexpr uintptr_t start_bit = 1U<<2;
     static constexpr uintptr_t start_key_ = start_bit;
-#if DEBUG
+    // node|count_bit keys read a node's count version
+    static constexpr uintptr_t count_bit = size_bit;
+#if RBTREE_DEBUG
     mutable struct stats {
         int absent_insert, absent_delete, absent_count;
         int present_insert, present_delete, present_count;
@@ -803,7 +1073,7 @@ inline size_t RBTree<K, T, GlobalSize>::count(const K& key) const {
 
     wrapper_type* node = std::get<0>(results);
     bool found = std::get<2>(results);
-#if DEBUG
+#if RBTREE_DEBUG
     (!found) ? stats_.absent_count++ : stats_.present_count++;
 #endif
     if (found) {
@@ -834,7 +1104,7 @@ inline size_t RBTree<K, T, GlobalSize>::erase(const K& key) {
    
     // PRESENT ERASE
     if (found) {
-#if DEBUG
+#if RBTREE_DEBUG
         stats_.present_delete++;
 #endif
         auto item = Sto::item(this, x);
@@ -851,7 +1121,7 @@ inline size_t RBTree<K, T, GlobalSize>::erase(const K& key) {
                 // insert-delete-delete
                 return 0;
             } else {
-#if DEBUG
+#if RBTREE_DEBUG
                 TransactionTid::lock(::lock);
                 printf("Aborted in erase (insert bit set)\n");
                 TransactionTid::unlock(::lock);
@@ -874,13 +1144,205 @@ inline size_t RBTree<K, T, GlobalSize>::erase(const K& key) {
 
     // ABSENT ERASE
     } else {
-#if DEBUG
+#if RBTREE_DEBUG
         stats_.absent_delete++;
 #endif
         return 0;
     }
 }
 
+template <typename K, typename T, bool GlobalSize>
+size_t RBTree<K, T, GlobalSize>::transCountRange(const K& lo, const K& hi) {
+    if (!(lo < hi))
+        return 0;
+    size_t count;
+    descent d;
+    while (!count_range(lo, hi, count, d) || !d.path_unchanged())
+        relax_fence();
+    apply_reads(d);
+    ssize_t delta = 0;
+    for (auto& c : own_changes())
+        if (!(*c.key < lo) && *c.key < hi)
+            delta += c.delta;
+    return count + delta;
+}
+
+// Counts committed keys in [lo, hi). Descends to the first node in the
+// range, where the paths to lo and hi split, then down each path, adding
+// each node in the range and the whole subtree on its inner side. Returns
+// false if the descent raced with a structural change.
+template <typename K, typename T, bool GlobalSize>
+bool RBTree<K, T, GlobalSize>::count_range(const K& lo, const K& hi, size_t& count,
+                                           descent& d) const {
+    const internal_tree_type& tree = wrapper_tree_;
+    count = 0;
+    d.clear();
+    Version rootv = internal_tree_type::stable_version(tree.rootversion_);
+    wrapper_type* n = tree.r_.root_;
+    if (!n) {
+        Version tv = tree.treeversion_;
+        acquire_fence();
+        d.reads.push_back(pending_read{tree_key_, tv.value()});
+        return tree.rootversion_ == rootv;
+    }
+    Version nv = n->unlocked_hohversion();
+    acquire_fence();
+    if (tree.rootversion_ != rootv)
+        return false;
+
+    while (1) {
+        record_node(n, nv, d);
+        bool side;
+        if (n->key() < lo)
+            side = true;
+        else if (!(n->key() < hi))
+            side = false;
+        else
+            break;
+        wrapper_type* child = n->rblinks_.c_[side].node();
+        Version childv = child ? child->unlocked_hohversion() : Version();
+        if (!n->validate_hohversion(nv))
+            return false;
+        if (!child)
+            return true;
+        n = child;
+        nv = childv;
+    }
+
+    Version v = n->version();
+    acquire_fence();
+    count = !is_inserted(v);
+    record_value(n, v, d);
+    wrapper_type* left = lo < n->key() ? n->rblinks_.c_[0].node() : nullptr;
+    wrapper_type* right = n->rblinks_.c_[1].node();
+    Version leftv = left ? left->unlocked_hohversion() : Version();
+    Version rightv = right ? right->unlocked_hohversion() : Version();
+    if (!n->validate_hohversion(nv))
+        return false;
+    return (!left || count_side(left, leftv, lo, true, count, d))
+        && (!right || count_side(right, rightv, hi, false, count, d));
+}
+
+// One side of count_range below the split: keys on the `inward` side of
+// `bound` are in the range (lo is inclusive and hi exclusive).
+template <typename K, typename T, bool GlobalSize>
+bool RBTree<K, T, GlobalSize>::count_side(wrapper_type* n, Version nv, const K& bound,
+                                          bool inward, size_t& count,
+                                          descent& d) const {
+    while (1) {
+        record_node(n, nv, d);
+        bool exact = !(n->key() < bound) && !(bound < n->key());
+        bool in_range = inward ? !(n->key() < bound) : n->key() < bound;
+        if (in_range) {
+            Version v = n->version();
+            acquire_fence();
+            count += !is_inserted(v);
+            record_value(n, v, d);
+        }
+        wrapper_type* child = n->rblinks_.c_[in_range ? !inward : inward].node();
+        if (in_range || exact) {
+            wrapper_type* sub = n->rblinks_.c_[inward].node();
+            size_t subcount;
+            TNonopaqueVersion subv;
+            if (!read_count(sub, subcount, subv))
+                return false;
+            record_count(sub, subv, d);
+            count += subcount;
+        }
+        if (exact)
+            child = nullptr;
+        Version childv = child ? child->unlocked_hohversion() : Version();
+        if (!n->validate_hohversion(nv))
+            return false;
+        if (!child)
+            return true;
+        n = child;
+        nv = childv;
+    }
+}
+
+template <typename K, typename T, bool GlobalSize>
+bool RBTree<K, T, GlobalSize>::transSelect(size_t rank, K& key, T& value) {
+    std::vector<own_change> changes = own_changes();
+    wrapper_type* n;
+    Version v;
+    descent d;
+    while (!select(rank, changes, n, v, d) || !d.path_unchanged())
+        relax_fence();
+    apply_reads(d);
+    if (!n)
+        return false;
+    key = n->key();
+    auto item = Sto::item(this, n);
+    if (item.has_write())
+        value = item.template write_value<T>();
+    else
+        value = n->read_value(item, v);
+    return true;
+}
+
+// Finds the node at `rank` in the transaction's view, or null. Reads the
+// left subtree count of every node on the path.
+template <typename K, typename T, bool GlobalSize>
+bool RBTree<K, T, GlobalSize>::select(size_t rank, const std::vector<own_change>& changes,
+                                      wrapper_type*& found, Version& found_v,
+                                      descent& d) const {
+    const internal_tree_type& tree = wrapper_tree_;
+    found = nullptr;
+    d.clear();
+    Version rootv = internal_tree_type::stable_version(tree.rootversion_);
+    wrapper_type* n = tree.r_.root_;
+    if (!n) {
+        Version tv = tree.treeversion_;
+        acquire_fence();
+        d.reads.push_back(pending_read{tree_key_, tv.value()});
+        return tree.rootversion_ == rootv;
+    }
+    Version nv = n->unlocked_hohversion();
+    acquire_fence();
+    if (tree.rootversion_ != rootv)
+        return false;
+
+    // keys in n's left subtree lie strictly between lb and n
+    const K* lb = nullptr;
+    while (1) {
+        record_node(n, nv, d);
+        wrapper_type* left = n->rblinks_.c_[0].node();
+        size_t nleft;
+        TNonopaqueVersion leftv;
+        if (!read_count(left, nleft, leftv))
+            return false;
+        nleft += own_delta(changes, lb, &n->key());
+        Version v = n->version();
+        acquire_fence();
+        size_t here = view_counted(n, v);
+        record_count(left, leftv, d);
+        wrapper_type* child;
+        if (rank < nleft)
+            child = left;
+        else {
+            record_value(n, v, d);
+            if (rank < nleft + here) {
+                if (!n->validate_hohversion(nv))
+                    return false;
+                found = n;
+                found_v = v;
+                return true;
+            }
+            rank -= nleft + here;
+            lb = &n->key();
+            child = n->rblinks_.c_[1].node();
+        }
+        Version childv = child ? child->unlocked_hohversion() : Version();
+        if (!n->validate_hohversion(nv))
+            return false;
+        if (!child)
+            return true;
+        n = child;
+        nv = childv;
+    }
+}
+
 template <typename K, typename T, bool GlobalSize>
 bool RBTree<K, T, GlobalSize>::lock(TransItem& item, Transaction& txn) {
     if (item.key<uintptr_t>() == size_key_)
@@ -895,10 +1357,8 @@ bool RBTree<K, T, GlobalSize>::lock(TransItem& item, Transaction& txn) {
              || txn.try_lock(item, n->nodeversion()))
             && ((x & 1) || txn.try_lock(item, n->version())))
             return true;
-        else {
-            n->unlock_nv();
-            return false;
-        }
+        n->unlock_nv();
+        return false;
     }
 }
 
@@ -909,6 +1369,8 @@ void RBTree<K, T, GlobalSize>::unlock(TransItem& item) {
     } else if (item.key<uintptr_t>() == tree_key_) {
         wrapper_tree_.treeversion_.unlock();
     } else {
+        if (item.has_flag(structlock_tag))
+            unlock_structure();
         uintptr_t x = item.key<uintptr_t>();
         wrapper_type* n = reinterpret_cast<wrapper_type*>(x & ~uintptr_t(1));
         if (!(x & 1)) {
@@ -933,10 +1395,13 @@ bool RBTree<K, T, GlobalSize>::check(TransItem& item, Transaction&) {
         curr_version = sizeversion_;
     } else if (is_treekey) {
         curr_version = wrapper_tree_.treeversion_;
+    } else if (is_count_key(e)) {
+        wrapper_type* n = reinterpret_cast<wrapper_type*>(e & ~count_bit);
+        return n->countversion().check_version(item.read_value<TNonopaqueVersion>());
     } else if (is_structured) {
         wrapper_type* n = reinterpret_cast<wrapper_type*>(e & ~uintptr_t(1));
         return n->check_nv(item);
-#if DEBUG
+#if RBTREE_DEBUG
         TransactionTid::lock(::lock);
         printf("\t#read %p nv 0x%lx, exp %lx\n", n, curr_version, read_version);
         TransactionTid::unlock(::lock);
@@ -951,7 +1416,7 @@ bool RBTree<K, T, GlobalSize>::check(TransItem& item, Transaction&) {
     // the TVersion interface
     if (curr_version.check_version(read_version))
         return true;
-#if DEBUG
+#if RBTREE_DEBUG
     if (!is_sizekey && !is_treekey) {
         wrapper_type* node = reinterpret_cast<wrapper_type*>(e & ~uintptr_t(1));
         int k_ = node? node->key() : 0;
@@ -999,16 +1464,18 @@ void RBTree<K, T, GlobalSize>::install(TransItem& item, Transaction& t) {
         assert(!(deleted && inserted));
         // actually erase the element when installing the delete
         if (deleted) {
-            // actually erase
-            lock_write(&treelock_);
+            lock_structure_for_commit(item);
             wrapper_tree_.erase(*e);
-            unlock_write(&treelock_);
 
             e->version().set_version(t.commit_tid());
             e->install_nv(t);
-            Transaction::rcu_free(e);
+            wrapper_type::pool_type::destroy_rcu(e);
+        } else if (inserted) {
+            // the node now counts toward its ancestors' subtree counts
+            e->install(item, t);
+            lock_structure_for_commit(item);
+            wrapper_tree_.update_counts(e);
         } else {
-            // inserts/updates should be handled the same way
             e->install(item, t);
         }
     }
@@ -1024,12 +1491,12 @@ void RBTree<K, T, GlobalSize>::cleanup(TransItem& item, bool committed) {
             assert(((uintptr_t)e & 0x1) == 0);
             if (!is_inserted(e->version()))
                 return;
-            lock_write(&treelock_);
+            lock_structure();
             wrapper_tree_.erase(*e);
-            unlock_write(&treelock_);
+            unlock_structure();
             // invalidate the nodeversion after we erase
             e->nodeversion().set_nonopaque();
-            Transaction::rcu_free(e);
+            wrapper_type::pool_type::destroy_rcu(e);
         }
     }
 }
@@ -1045,6 +1512,8 @@ void RBTree<K, T, GlobalSize>::print(std::ostream& w, const TransItem& item) con
         uintptr_t x = item.key<uintptr_t>();
         if (x & 1)
             w << "." << (void*) (x & ~uintptr_t(1)) << "V";
+        else if (is_count_key(x))
+            w << "." << (void*) (x & ~count_bit) << "#";
         else
             w << "." << (void*) x;
     }
@@ -1100,6 +1569,7 @@ bool RBTree<K, T, GlobalSize>::stamp_insert(const K& key, const T& value) {
             }
         }
         Sto::item(this, x).add_write(value).add_flags(insert_tag);
+        cover_phantom_parent(p);
         change_size_offset(1);
         return true;
     }
@@ -1162,7 +1632,8 @@ T RBTree<K, T, GlobalSize>::stamp_find(const K& key) {
 
 template <typename K, typename T, bool GlobalSize>
 bool RBTree<K, T, GlobalSize>::nontrans_insert(const K& key, const T& value) {
-    lock_write(&treelock_);
+    wrapper_type::pool_type::reserve();
+    lock_structure();
     wrapper_type idx_pair(rbpair<K, T>(key, value));
     auto results = wrapper_tree_.find_or_parent(idx_pair,
             rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
@@ -1170,13 +1641,12 @@ bool RBTree<K, T, GlobalSize>::nontrans_insert(const K& key, const T& value) {
     if (!found) {
         size_++;
         rbnodeptr<wrapper_type> p = std::get<0>(results);
-        wrapper_type* n = (wrapper_type*)malloc(sizeof(wrapper_type));
-        new (n) wrapper_type(rbpair<K, T>(key, value));
+        wrapper_type* n = wrapper_type::pool_type::make(rbpair<K, T>(key, value));
         erase_inserted(n->version());
         bool side = (p.node() == nullptr) ? false : (wrapper_tree_.r_.node_compare(*n, *p.node()) > 0);
         wrapper_tree_.insert_commit(n, p, side);
     }
-    unlock_write(&treelock_);
+    unlock_structure();
     return !found;
 }
 
@@ -1210,7 +1680,7 @@ bool RBTree<K, T, GlobalSize>::nontrans_find(const K& key, T& val) {
 
 template <typename K, typename T, bool GlobalSize>
 bool RBTree<K, T, GlobalSize>::nontrans_remove(const K& key) {
-    lock_write(&treelock_);
+    lock_structure();
     wrapper_type idx_pair(rbpair<K, T>(key, T()));
     auto results = wrapper_tree_.find_any(idx_pair,
             rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
@@ -1219,9 +1689,9 @@ bool RBTree<K, T, GlobalSize>::nontrans_remove(const K& key) {
         size_--;
         wrapper_type* n = std::get<0>(results);
         wrapper_tree_.erase(*n);
-        free(n);
+        wrapper_type::pool_type::destroy(n);
     }
-    unlock_write(&treelock_);
+    unlock_structure();
     return found;
 }
 
@@ -1229,7 +1699,7 @@ bool RBTree<K, T, GlobalSize>::nontrans_remove(const K& key) {
 // is set to the value of the key before removal
 template <typename K, typename T, bool GlobalSize>
 bool RBTree<K, T, GlobalSize>::nontrans_remove(const K& key, T& oldval) {
-    lock_write(&treelock_);
+    lock_structure();
     wrapper_type idx_pair(rbpair<K, T>(key, T()));
     auto results = wrapper_tree_.find_any(idx_pair,
             rbpriv::make_compare<wrapper_type, wrapper_type>(wrapper_tree_.r_.get_compare()));
@@ -1240,14 +1710,14 @@ bool RBTree<K, T, GlobalSize>::nontrans_remove(const K& key, T& oldval) {
 	// set the old value for the caller
 	oldval = n->writeable_value();
         wrapper_tree_.erase(*n);
-        free(n);
+        wrapper_type::pool_type::destroy(n);
     }
-    unlock_write(&treelock_);
+    unlock_structure();
     return found;
 }
 
 
-#if DEBUG 
+#if RBTREE_DEBUG 
 template <typename K, typename T, bool GlobalSize>
 inline void RBTree<K, T, GlobalSize>::print_absent_reads() {
     std::cout << "absent inserts: " << stats_.absent_insert << std::endl;
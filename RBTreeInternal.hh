@@ -11,6 +11,13 @@
 # define rbaccount(x)
 #endif
 
+// Lay out tree nodes so that what a lookup reads (child pointers, the
+// hand-over-hand version, the key, and the value version) is contiguous,
+// and allocate them so those bytes share a cache line
+#ifndef STO_RBTREE_COMPACT
+#define STO_RBTREE_COMPACT 0
+#endif
+
 template <typename T>
 class rbnodeptr {
   public:
@@ -55,7 +62,16 @@ template <typename T>
 class rblinks {
   public:
     T* p_;
+#if STO_RBTREE_COMPACT
+    // nodes in this subtree for which T::counted() is true
+    size_t count_;
+    // last, next to the pair's lookup fields
     rbnodeptr<T> c_[2];
+#else
+    rbnodeptr<T> c_[2];
+    // nodes in this subtree for which T::counted() is true
+    size_t count_;
+#endif
 }; 
 
 namespace rbpriv {
@@ -188,6 +204,30 @@ class rbtree {
     rbpriv::rbrep<T, Compare> r_;
     // moved from RBTree.hh
     Version treeversion_;
+    // Lookups take no locks. A structural change (insert_commit, erase),
+    // which callers must serialize, locks the hand-over-hand version of
+    // each node whose subtree changes, and rootversion_ if the root
+    // changes; release_touched() then bumps and unlocks them. A lookup
+    // restarts if a version it passed through changes.
+    Version rootversion_;
+    std::vector<T*> touched_;
+    // Subtree counts change under the same serialization. A node whose
+    // count changes, or whose subtree gains or loses anything but a new
+    // leaf, has its count version locked, and bumped by release_touched(),
+    // so a reader can validate a count it used. rotations_ lists each
+    // (lowered, raised) pair since the last release.
+    std::vector<T*> recounted_;
+    std::vector<std::pair<T*, T*>> rotations_;
+
+    void touch(T* n);
+    void touch_count(T* n);
+    void reshape(T* n);
+    void release_touched();
+    inline rbnodeptr<T> rotate(rbnodeptr<T> n, bool side);
+    static Version stable_version(const Version& v);
+    static inline size_t subtree_count(rbnodeptr<T> n);
+    void recount(T* n);
+    void update_counts(T* n);
 
     template <typename K, typename Comp>
     inline std::tuple<T*, Version, bool, boundaries_type> find_any(const K& key, Comp comp) const;
@@ -352,26 +392,119 @@ inline Compare& rbcompare<Compare>::get_compare() const {
 // RBTREE FUNCTION DEFINITIONS
 template <typename T, typename C>
 inline rbtree<T, C>::rbtree(const value_compare &compare)
-    : r_(compare), treeversion_(Sto::initialized_tid()) {
+    : r_(compare), treeversion_(Sto::initialized_tid()), rootversion_() {
 }
 
 template <typename T, typename C>
 rbtree<T, C>::~rbtree() {
 }
 
+// `n` is null for the root pointer itself
+template <typename T, typename C>
+void rbtree<T, C>::touch(T* n) {
+    if (!n) {
+        if (!rootversion_.is_locked_here())
+            rootversion_.lock();
+    } else if (!n->hohversion().is_locked_here()) {
+        n->lock_hohversion();
+        touched_.push_back(n);
+    }
+}
+
+template <typename T, typename C>
+void rbtree<T, C>::reshape(T* n) {
+    touch(n);
+    touch_count(n);
+}
+
+template <typename T, typename C>
+void rbtree<T, C>::touch_count(T* n) {
+    if (!n->countversion().is_locked_here()) {
+        n->lock_countversion();
+        recounted_.push_back(n);
+    }
+}
+
+template <typename T, typename C>
+void rbtree<T, C>::release_touched() {
+    for (T* n : touched_)
+        n->unlock_hohversion();
+    touched_.clear();
+    for (T* n : recounted_)
+        n->unlock_countversion();
+    recounted_.clear();
+    rotations_.clear();
+    if (rootversion_.is_locked_here())
+        rootversion_.set_version_unlock(Version(rootversion_.value() + TransactionTid::increment_value));
+}
+
+// A rotation changes the subtrees of `n` and the child that replaces it,
+// and the caller then repoints n's parent.
+template <typename T, typename C>
+inline rbnodeptr<T> rbtree<T, C>::rotate(rbnodeptr<T> n, bool side) {
+    touch(n.parent());
+    reshape(n.node());
+    reshape(n.child(!side).node());
+    rbnodeptr<T> x = n.rotate(side);
+    recount(n.node());
+    recount(x.node());
+    rotations_.push_back(std::make_pair(n.node(), x.node()));
+    return x;
+}
+
+template <typename T, typename C>
+inline size_t rbtree<T, C>::subtree_count(rbnodeptr<T> n) {
+    return n ? n.node()->rblinks_.count_ : 0;
+}
+
+// recomputes n's count from its children's
+template <typename T, typename C>
+void rbtree<T, C>::recount(T* n) {
+    size_t count = n->counted() + subtree_count(n->rblinks_.c_[0])
+        + subtree_count(n->rblinks_.c_[1]);
+    if (n->rblinks_.count_ != count) {
+        touch_count(n);
+        n->rblinks_.count_ = count;
+    }
+}
+
+// recomputes counts from n up to the root, after n's subtree or n's own
+// counted() changed
+template <typename T, typename C>
+void rbtree<T, C>::update_counts(T* n) {
+    for (; n; n = n->rblinks_.p_)
+        recount(n);
+}
+
+template <typename T, typename C>
+inline typename rbtree<T, C>::Version rbtree<T, C>::stable_version(const Version& v) {
+    Version x = v;
+    while (x.is_locked()) {
+        relax_fence();
+        x = v;
+    }
+    acquire_fence();
+    return x;
+}
+
 template <typename T, typename C>
 void rbtree<T, C>::insert_commit(T* x, rbnodeptr<T> p, bool side) {
     // link in new node; it's red
     x->rblinks_.p_ = p.node();
     x->rblinks_.c_[0] = x->rblinks_.c_[1] = rbnodeptr<T>(0, false);
+    x->rblinks_.count_ = x->counted();
 
     // maybe set limits
+    touch(p.node());
     if (p) {
         p.child(side) = rbnodeptr<T>(x, true);
         if (p.node() == r_.limit_[side])
             r_.limit_[side] = x;
     } else
         r_.root_ = r_.limit_[0] = r_.limit_[1] = x;
+    // rotations below keep subtree counts
+    if (x->counted())
+        update_counts(p.node());
 
     // flip up the tree
     // invariant: we are looking at the `side` of `p`
@@ -383,9 +516,9 @@ void rbtree<T, C>::insert_commit(T* x, rbnodeptr<T> p, bool side) {
         } else {
             bool gpside = gp.find_child(p.node());
             if (gpside != side) {
-                gp.child(gpside) = p.rotate(gpside);
+                gp.child(gpside) = rotate(p, gpside);
             } 
-            z = gp.rotate(!gpside); 
+            z = rotate(gp, !gpside); 
             p = z.black_parent();
         }
         side = p.find_child(gp.node());
@@ -415,14 +548,21 @@ T* rbtree<T, C>::delete_node(T* victim_node, T* succ) {
     rbnodeptr<T> victim(victim_node, false);
     rbnodeptr<T> p = victim.black_parent();
     bool side = p.find_child(victim_node);
+    touch(p.node());
+    reshape(victim_node);
 
     // swap with successor if necessary
     if (victim.child(0) && victim.child(1)) {
+        // the successor leaves the subtree of every node on the way down
         if (!succ)
             for (succ = victim.child(true).node();
                  succ->rblinks_.c_[0];
                  succ = succ->rblinks_.c_[0].node())
-                /* nada */;
+                reshape(succ);
+        else
+            for (T* n = victim.child(true).node(); n != succ; n = n->rblinks_.c_[0].node())
+                reshape(n);
+        reshape(succ);
         rbnodeptr<T> succ_p = rbnodeptr<T>(succ->rblinks_.p_, false);
         bool sside = succ == succ_p.child(true).node();
         if (p)
@@ -445,6 +585,7 @@ T* rbtree<T, C>::delete_node(T* victim_node, T* succ) {
     p.set_child(side, x, r_.root_);
     if (x)
         x.parent() = p.node();
+    update_counts(p.node());
 
     // maybe set limits
     for (int i = 0; i != 2; ++i)
@@ -479,7 +620,7 @@ void rbtree<T, C>::delete_node_fixup(rbnodeptr<T> p, bool side) {
 
         if (p.child(!side).red()) {
             // invariant: p is black (b/c one of its children is red)
-            gp.set_child(gpside, p.rotate(side), r_.root_);
+            gp.set_child(gpside, rotate(p, side), r_.root_);
             gp = p.black_parent(); // p is now further down the tree
             gpside = side;         // (since we rotated in that direction)
         }
@@ -490,12 +631,12 @@ void rbtree<T, C>::delete_node_fixup(rbnodeptr<T> p, bool side) {
             p = p.change_color(false);
         } else {
             if (!w.child(!side).red()) {
-                p.child(!side) = w.rotate(!side);
+                p.child(!side) = rotate(w, !side);
             }
             bool gpside = gp.find_child(p.node());
             if (gp)
                 p = gp.child(gpside); // fetch correct color for `p`
-            p = p.rotate(side);
+            p = rotate(p, side);
             p.child(0) = p.child(0).change_color(false);
             p.child(1) = p.child(1).change_color(false);
         }
@@ -512,42 +653,64 @@ inline T* rbtree<T, C>::root() {
 // Return a pair of node, bool: if bool is true, then the node is the found node, 
 // else if bool is false the node is the parent of the absent read. If (null, false), we have
 // an empty tree
+// Safe to run concurrently with a structural change: each step down
+// validates the parent's hand-over-hand version after reading the child's,
+// so the child's subtree still held the key when we got there.
 template <typename T, typename C> template <typename K, typename Comp>
 inline std::tuple<T*, typename rbtree<T, C>::Version, bool,
        typename rbtree<T, C>::boundaries_type>
 rbtree<T, C>::find_any(const K& key, Comp comp) const {
-
-    rbnodeptr<T> n(r_.root_, false);
-    rbnodeptr<T> p(nullptr, false);
+  retry:
+    Version rootv = stable_version(rootversion_);
+    T* n = r_.root_;
 
     T* lhs = r_.limit_[0];
     T* rhs = r_.limit_[1];
     boundaries_type boundary = std::make_pair(std::make_tuple(lhs, lhs ? lhs->nodeversion() : 0),
                     std::make_tuple(rhs, rhs ? rhs->nodeversion() : 0));
 
-    while (n.node()) {
-        int cmp = comp.compare(key, *n.node());
-        if (cmp == 0)
-            break;
+    if (!n) {
+        Version retver = treeversion_;
+        acquire_fence();
+        if (rootversion_ != rootv)
+            goto retry;
+        return std::make_tuple(n, retver, false, boundary);
+    }
+    Version nv = n->unlocked_hohversion();
+    acquire_fence();
+    if (rootversion_ != rootv)
+        goto retry;
+
+    while (1) {
+        int cmp = comp.compare(key, *n);
+        if (cmp == 0) {
+            // an erase unlinks n before bumping its version, so make sure
+            // n was still linked when we read it
+            Version retver = n->version();
+            if (!n->validate_hohversion(nv))
+                goto retry;
+            return std::make_tuple(n, retver, true, boundary);
+        }
 
         // narrow down to find the boundary nodes
         // update the LEFT boundary when going RIGHT, and vice versa
-        if (cmp > 0) {
-            T* nb = n.node();
-            boundary.first = std::make_tuple(nb, nb->nodeversion());
-        } else {
-            T* nb = n.node();
-            boundary.second = std::make_tuple(nb, nb->nodeversion());
+        if (cmp > 0)
+            boundary.first = std::make_tuple(n, n->nodeversion());
+        else
+            boundary.second = std::make_tuple(n, n->nodeversion());
+        T* child = n->rblinks_.c_[cmp > 0].node();
+        if (!child) {
+            Version retver = n->version();
+            if (!n->validate_hohversion(nv))
+                goto retry;
+            return std::make_tuple(n, retver, false, boundary);
         }
-        p = n;
-        n = n.node()->rblinks_.c_[cmp > 0];
+        Version childv = child->unlocked_hohversion();
+        if (!n->validate_hohversion(nv))
+            goto retry;
+        n = child;
+        nv = childv;
     }
-
-    bool found = (n.node() != nullptr);
-    T* retnode = found ? n.node() : p.node();
-    Version retver = retnode ? retnode->version() : treeversion_;
-
-    return std::make_tuple(retnode, retver, found, boundary);
 }
 
 template <typename T, typename C> template <typename K, typename Comp>
@@ -608,8 +771,7 @@ rbtree<T, C>::find_insert(K& key, Comp comp) {
 
     // perform the insertion if not found
     if (!found) {
-        retnode = (T*)malloc(sizeof(T));
-        new (retnode) T((rbpair<typename K::key_type, typename K::value_type>)key);
+        retnode = T::pool_type::make((rbpair<typename K::key_type, typename K::value_type>)key);
         retver = retnode->nodeversion();
         insert_commit(retnode, p, (cmp > 0));
 
@@ -679,6 +841,9 @@ void rbnodeptr<T>::check(T* parent, int this_black_height, int& black_height,
         else
             rbcheck_assert(cmp > 0 || (cmp == 0 && node() > parent));
     }
+    rbcheck_assert(node()->rblinks_.count_ == node()->counted()
+                   + (child(false) ? child(false).node()->rblinks_.count_ : 0)
+                   + (child(true) ? child(true).node()->rblinks_.count_ : 0));
     if (red())
         rbcheck_assert(!child(false).red() && !child(true).red());
     else {
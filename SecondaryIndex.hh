@@ -0,0 +1,338 @@
+#pragma once
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include "Transaction.hh"
+#include "local_vector.hh"
+
+// What an index needs from its primary table to show a transaction its
+// own writes: for_each_own_write(f) calls f(key, value) for each row the
+// current transaction has written, where `value` is the row as the
+// transaction would commit it (null for a delete).
+template <typename K, typename V>
+class index_source {
+public:
+    typedef std::function<void(const K&, const V*)> write_function;
+    virtual ~index_source() {}
+    virtual void for_each_own_write(const write_function& f) const = 0;
+};
+
+// The hook a primary table calls from its own commit protocol for each
+// write, so that an index changes atomically with the primary without
+// adding items to the transaction. lock() runs with the written row
+// locked and sees its committed value (null for an insert) and its value
+// after the write (null for a delete); it returns false, holding nothing,
+// if the index can't be locked. install() and unlock() follow for every
+// item whose lock() succeeded. nontrans_update() applies a
+// nontransactional write the same way, all at once. The primary calls
+// attach() once, with itself, before any of these.
+template <typename K, typename V>
+class index_maintainer {
+public:
+    virtual ~index_maintainer() {}
+    virtual bool lock(const TransItem& item, const K& key, const V* old_value,
+                      const V* new_value, Transaction& txn) = 0;
+    virtual void install(const TransItem& item, TransactionTid::type tid) = 0;
+    virtual void unlock(const TransItem& item) = 0;
+    virtual void nontrans_update(const K& key, const V* old_value, const V* new_value) = 0;
+    virtual void attach(const index_source<K, V>* source) = 0;
+};
+
+// for a SecondaryIndex that stores nothing but primary keys
+struct index_no_covering {
+    bool operator==(index_no_covering) const {
+        return true;
+    }
+};
+
+// A transactional secondary index over a primary table with keys PK and
+// values V. Each row is filed under the secondary key `key_of(value)`
+// along with a covering value `cover_of(value)`, so a lookup by
+// secondary key can be answered without going back to the primary.
+// Register it with the primary's add_index(); the primary then maintains
+// it from its commit protocol. Lookups record one read per secondary key,
+// which fails if any row gains, loses, or changes its entry under that
+// key before commit. A lookup sees its own transaction's primary writes:
+// a row the transaction wrote is reported under its written value's key,
+// and not under its committed one. (Finding them scans the transaction's
+// items, so a lookup costs more in a transaction with many items.)
+//
+// Entries for one secondary key form a group with its own version. Groups
+// are created on first use, by lookups too, and never removed, so a
+// missing key is just an empty group. The bucket array has a fixed size.
+template <typename PK, typename V, typename SK, typename C = index_no_covering,
+          typename Hash = std::hash<SK>, typename Pred = std::equal_to<SK>>
+class SecondaryIndex : public TObject, public index_maintainer<PK, V> {
+public:
+    typedef TVersion version_type;
+    typedef std::function<SK(const V&)> key_function;
+    typedef std::function<C(const V&)> cover_function;
+
+    SecondaryIndex(key_function key_of, cover_function cover_of = default_cover,
+                   size_t nbuckets = 1024)
+        : key_of_(key_of), cover_of_(cover_of), nbuckets_(nbuckets ? nbuckets : 1),
+          source_(nullptr) {
+        buckets_ = new bucket[nbuckets_];
+    }
+    ~SecondaryIndex() {
+        for (size_t b = 0; b != nbuckets_; ++b)
+            while (group* g = buckets_[b].head) {
+                buckets_[b].head = g->next;
+                while (entry* e = g->head) {
+                    g->head = e->next;
+                    delete e;
+                }
+                delete g;
+            }
+        delete[] buckets_;
+    }
+
+    // Calls f(const PK&, const C&) for each row filed under `sk`, in no
+    // particular order, and returns how many there were.
+    template <typename F>
+    size_t transLookup(const SK& sk, F f) {
+        group* g = find_group(sk);
+        local_vector<std::pair<PK, C>, 8> found;
+        version_type v = snapshot(g, found);
+        Sto::item(this, g).observe(v);
+        if (source_)
+            source_->for_each_own_write([&] (const PK& pk, const V* value) {
+                for (size_t i = 0; i != found.size(); ++i)
+                    if (found[i].first == pk) {
+                        found[i] = found.back();
+                        found.pop_back();
+                        break;
+                    }
+                if (value && pred_(key_of_(*value), sk))
+                    found.push_back(std::make_pair(pk, cover_of_(*value)));
+            });
+        for (auto& x : found)
+            f(x.first, x.second);
+        return found.size();
+    }
+    size_t transCount(const SK& sk) {
+        return transLookup(sk, [] (const PK&, const C&) {});
+    }
+
+    bool check(TransItem& item, Transaction&) override {
+        return item.key<group*>()->version.check_version(item.template read_value<version_type>());
+    }
+    // lookups only read
+    bool lock(TransItem&, Transaction&) override {
+        always_assert(false);
+        return false;
+    }
+    void install(TransItem&, Transaction&) override {
+        always_assert(false);
+    }
+    void unlock(TransItem&) override {
+        always_assert(false);
+    }
+
+    bool lock(const TransItem& item, const PK& pk, const V* old_value,
+              const V* new_value, Transaction& txn) override {
+        change c;
+        c.item = &item;
+        c.old_group = old_value ? find_group(key_of_(*old_value)) : nullptr;
+        c.new_group = new_value ? find_group(key_of_(*new_value)) : nullptr;
+        if (new_value)
+            c.cover = cover_of_(*new_value);
+        if (c.old_group == c.new_group
+            && (!c.new_group || cover_of_(*old_value) == c.cover))
+            return true;
+        c.pk = pk;
+        int old_state = c.old_group ? lock_group(c.old_group, txn) : lock_held;
+        if (old_state == lock_failed)
+            return false;
+        c.owns_old = old_state == lock_acquired;
+        int new_state = c.new_group && c.new_group != c.old_group
+            ? lock_group(c.new_group, txn) : lock_held;
+        if (new_state == lock_failed) {
+            if (c.owns_old)
+                c.old_group->version.unlock();
+            return false;
+        }
+        c.owns_new = new_state == lock_acquired;
+        changes_[txn.threadid()].v.push_back(c);
+        return true;
+    }
+
+    void install(const TransItem& item, TransactionTid::type tid) override {
+        for (auto& c : changes_[TThread::id()].v)
+            if (c.item == &item) {
+                if (c.old_group) {
+                    remove_entry(c.old_group, c.pk);
+                    c.old_group->version.set_version(tid);
+                }
+                if (c.new_group) {
+                    add_entry(c.new_group, c.pk, c.cover);
+                    c.new_group->version.set_version(tid);
+                }
+            }
+    }
+
+    void unlock(const TransItem& item) override {
+        auto& v = changes_[TThread::id()].v;
+        for (size_t i = 0; i != v.size(); )
+            if (v[i].item == &item) {
+                if (v[i].owns_old)
+                    v[i].old_group->version.unlock();
+                if (v[i].owns_new)
+                    v[i].new_group->version.unlock();
+                v[i] = v.back();
+                v.pop_back();
+            } else
+                ++i;
+    }
+
+    void attach(const index_source<PK, V>* source) override {
+        source_ = source;
+    }
+
+    void nontrans_update(const PK& pk, const V* old_value, const V* new_value) override {
+        group* og = old_value ? find_group(key_of_(*old_value)) : nullptr;
+        group* ng = new_value ? find_group(key_of_(*new_value)) : nullptr;
+        C cover = new_value ? cover_of_(*new_value) : C();
+        if (og == ng && (!ng || cover_of_(*old_value) == cover))
+            return;
+        // Lock in address order. Transactional writers give up rather than
+        // wait, so they can't deadlock with us.
+        group* first = og && ng ? std::min(og, ng) : (og ? og : ng);
+        group* second = og && ng && og != ng ? std::max(og, ng) : nullptr;
+        first->version.lock();
+        if (second)
+            second->version.lock();
+        if (og)
+            remove_entry(og, pk);
+        if (ng)
+            add_entry(ng, pk, cover);
+        first->version.inc_nonopaque_version();
+        first->version.unlock();
+        if (second) {
+            second->version.inc_nonopaque_version();
+            second->version.unlock();
+        }
+    }
+
+private:
+    struct entry {
+        PK pk;
+        C cover;
+        entry* next;
+        entry(const PK& k, const C& c, entry* n)
+            : pk(k), cover(c), next(n) {
+        }
+    };
+    struct group {
+        SK key;
+        version_type version;
+        entry* head;
+        group* next;
+        group(const SK& k, group* n)
+            : key(k), version(Sto::initialized_tid()), head(nullptr), next(n) {
+        }
+    };
+    struct bucket {
+        TransactionTid::type lock;
+        group* head;
+        bucket()
+            : lock(0), head(nullptr) {
+        }
+    };
+    // a write's pending change, kept from lock() to unlock()
+    struct change {
+        const TransItem* item;
+        group* old_group;
+        group* new_group;
+        PK pk;
+        C cover;
+        bool owns_old;
+        bool owns_new;
+    };
+    // padded rather than aligned, since `new` needn't honor the alignment
+    struct thread_changes {
+        std::vector<change> v;
+        char pad_[128 - sizeof(std::vector<change>)];
+    };
+    // index locks spin this many times before the transaction aborts
+    static constexpr unsigned lock_spin_limit = 1 << 10;
+
+    key_function key_of_;
+    cover_function cover_of_;
+    size_t nbuckets_;
+    bucket* buckets_;
+    Hash hasher_;
+    Pred pred_;
+    const index_source<PK, V>* source_;
+    thread_changes changes_[MAX_THREADS];
+
+    static C default_cover(const V&) {
+        return C();
+    }
+
+    group* find_group(const SK& sk) {
+        bucket& b = buckets_[hasher_(sk) % nbuckets_];
+        for (group* g = b.head; g; g = g->next)
+            if (pred_(g->key, sk))
+                return g;
+        TransactionTid::lock(b.lock);
+        group* g;
+        for (g = b.head; g; g = g->next)
+            if (pred_(g->key, sk))
+                break;
+        if (!g) {
+            g = new group(sk, b.head);
+            release_fence();
+            b.head = g;
+        }
+        TransactionTid::unlock(b.lock);
+        return g;
+    }
+
+    // lock_held: another of this transaction's writes locked the group
+    enum { lock_failed, lock_acquired, lock_held };
+    int lock_group(group* g, Transaction& txn) {
+        if (g->version.is_locked_here(txn.threadid()))
+            return lock_held;
+        for (unsigned n = 0; !g->version.try_lock(txn.threadid()); ++n) {
+            if (n == lock_spin_limit)
+                return lock_failed;
+            relax_fence();
+        }
+        return lock_acquired;
+    }
+
+    template <typename Vec>
+    version_type snapshot(group* g, Vec& found) {
+        for (unsigned n = 0; ; ++n) {
+            version_type v = g->version;
+            acquire_fence();
+            if (!v.is_locked()) {
+                found.clear();
+                for (entry* e = g->head; e; e = e->next)
+                    found.push_back(std::make_pair(e->pk, e->cover));
+                acquire_fence();
+                if (g->version == v)
+                    return v;
+            }
+            if (n == lock_spin_limit)
+                Sto::abort();
+            relax_fence();
+        }
+    }
+
+    void add_entry(group* g, const PK& pk, const C& cover) {
+        entry* e = new entry(pk, cover, g->head);
+        release_fence();
+        g->head = e;
+    }
+    void remove_entry(group* g, const PK& pk) {
+        for (entry** pp = &g->head; *pp; pp = &(*pp)->next)
+            if ((*pp)->pk == pk) {
+                entry* e = *pp;
+                *pp = e->next;
+                Transaction::rcu_delete(e);
+                return;
+            }
+    }
+};
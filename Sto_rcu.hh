@@ -0,0 +1,125 @@
+#pragma once
+#include "kvthread.hh"
+#include "Transaction.hh"
+
+// Masstree threadinfo for MassTrans that retires memory through STO's own
+// RCU (Transaction::rcu_*). Tree nodes and values then share STO's epochs:
+// anything unlinked during a transaction is freed once every thread has
+// started a transaction in a later epoch, so Masstree needs no separate
+// globalepoch, limbo lists, or rcu_start()/rcu_stop() per transaction.
+
+class sto_threadinfo {
+public:
+  sto_threadinfo()
+    : ts_(0) {
+  }
+
+  class rcu_callback {
+  public:
+    virtual void operator()(sto_threadinfo& ti) = 0;
+  };
+
+private:
+  // Runs from TRcuSet::clean_until. A callback may retire more memory;
+  // those entries carry the thread's current epoch, which is newer than
+  // anything being cleaned, so they wait for a later grace period.
+  static void rcu_callback_function(void* p) {
+    sto_threadinfo ti;
+    static_cast<rcu_callback*>(p)->operator()(ti);
+  }
+
+public:
+  // XXX Correct node timstamps are needed for recovery, but for no other
+  // reason.
+  kvtimestamp_t operation_timestamp() const {
+    return 0;
+  }
+  kvtimestamp_t update_timestamp() const {
+    return ts_;
+  }
+  kvtimestamp_t update_timestamp(kvtimestamp_t x) const {
+    if (circular_int<kvtimestamp_t>::less_equal(ts_, x))
+      // x might be a marker timestamp; ensure result is not
+      ts_ = (x | 1) + 1;
+    return ts_;
+  }
+  kvtimestamp_t update_timestamp(kvtimestamp_t x, kvtimestamp_t y) const {
+    if (circular_int<kvtimestamp_t>::less(x, y))
+      x = y;
+    if (circular_int<kvtimestamp_t>::less_equal(ts_, x))
+      // x might be a marker timestamp; ensure result is not
+      ts_ = (x | 1) + 1;
+    return ts_;
+  }
+  void increment_timestamp() {
+    ts_ += 2;
+  }
+  void advance_timestamp(kvtimestamp_t x) {
+    if (circular_int<kvtimestamp_t>::less(ts_, x))
+      ts_ = x;
+  }
+
+  // event counters
+  void mark(threadcounter) {
+  }
+  void mark(threadcounter, int64_t) {
+  }
+  bool has_counter(threadcounter) const {
+    return false;
+  }
+  uint64_t counter(threadcounter) const {
+    return 0;
+  }
+
+  relax_fence_function accounting_relax_fence(threadcounter) {
+    return relax_fence_function();
+  }
+
+  class accounting_relax_fence_function {
+  public:
+    template <typename V>
+    void operator()(V) {
+      relax_fence();
+    }
+  };
+  accounting_relax_fence_function stable_fence() {
+    return accounting_relax_fence_function();
+  }
+
+  relax_fence_function lock_fence(threadcounter) {
+    return relax_fence_function();
+  }
+
+  // memory
+  void* allocate(size_t sz, memtag) {
+    return malloc(sz);
+  }
+  void deallocate(void* p, size_t, memtag) {
+    free(p);
+  }
+  void deallocate_rcu(void* p, size_t, memtag) {
+    Transaction::rcu_free(p);
+  }
+
+  void* pool_allocate(size_t sz, memtag) {
+    void* p;
+    size_t nl = (sz + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    if (posix_memalign(&p, CACHE_LINE_SIZE, nl * CACHE_LINE_SIZE) != 0)
+      return nullptr;
+    return p;
+  }
+  void pool_deallocate(void* p, size_t, memtag) {
+    free(p);
+  }
+  void pool_deallocate_rcu(void* p, size_t, memtag) {
+    Transaction::rcu_free(p);
+  }
+
+  // RCU
+  void rcu_register(rcu_callback* cb) {
+    Transaction::rcu_call(rcu_callback_function, cb);
+  }
+
+private:
+  mutable kvtimestamp_t ts_;
+};
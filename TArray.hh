@@ -1,6 +1,7 @@
 #pragma once
 #include "TWrapped.hh"
 #include "TArrayProxy.hh"
+#include "TNuma.hh"
 
 template <typename T, unsigned N, template <typename> class W = TOpaqueWrapped>
 class TArray : public TObject {
@@ -78,6 +79,12 @@ public:
         data_[item.key<size_type>()].vers.unlock();
     }
 
+    // Move the element storage to match `policy`. Elements live inline, so
+    // only pages lying entirely within the array are affected.
+    void numa_place(TNumaPolicy policy) {
+        TNuma::place(data_, sizeof(data_), policy);
+    }
+
 private:
     struct elem {
         version_type vers;
@@ -0,0 +1,232 @@
+#include "TNuma.hh"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <vector>
+#if STO_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+namespace {
+// Every allocation is preceded by a cache line recording how it was made.
+struct alignas(64) numa_header {
+    size_t size;        // total bytes, including this header
+    bool numa;          // allocated with libnuma (else posix_memalign)
+};
+static_assert(sizeof(numa_header) == 64, "numa_header is one cache line");
+
+struct numa_topology {
+    int nnodes;
+    int ncpus;
+    std::vector<int> compact;   // CPUs ordered node by node
+    std::vector<int> scatter;   // CPUs ordered round-robin over nodes
+
+    numa_topology();
+};
+
+numa_topology::numa_topology() {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+        ncpus = 1;
+    nnodes = 1;
+    std::vector<std::vector<int>> node_cpus;
+#if STO_NUMA
+    if (numa_available() >= 0) {
+        nnodes = numa_max_node() + 1;
+        node_cpus.resize(nnodes);
+        for (int c = 0; c < ncpus; ++c) {
+            int n = numa_node_of_cpu(c);
+            if (n >= 0 && n < nnodes)
+                node_cpus[n].push_back(c);
+        }
+    }
+#endif
+    if (node_cpus.empty()) {
+        node_cpus.resize(1);
+        for (int c = 0; c < ncpus; ++c)
+            node_cpus[0].push_back(c);
+    }
+    for (auto& v : node_cpus)
+        compact.insert(compact.end(), v.begin(), v.end());
+    for (size_t i = 0; scatter.size() < compact.size(); ++i)
+        for (auto& v : node_cpus)
+            if (i < v.size())
+                scatter.push_back(v[i]);
+}
+
+const numa_topology& topology() {
+    static numa_topology t;
+    return t;
+}
+
+#if STO_NUMA
+void bind_pages(void* ptr, size_t size, int mode, struct bitmask* nodes) {
+    size_t pagesize = numa_pagesize();
+    uintptr_t first = (reinterpret_cast<uintptr_t>(ptr) + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t last = (reinterpret_cast<uintptr_t>(ptr) + size) & ~(pagesize - 1);
+    if (first < last)
+        mbind(reinterpret_cast<void*>(first), last - first, mode,
+              nodes ? nodes->maskp : nullptr, nodes ? nodes->size + 1 : 0,
+              MPOL_MF_MOVE);
+}
+
+void bind_node(void* ptr, size_t size, int mode, int node) {
+    struct bitmask* nodes = numa_allocate_nodemask();
+    numa_bitmask_setbit(nodes, node);
+    bind_pages(ptr, size, mode, nodes);
+    numa_bitmask_free(nodes);
+}
+#endif
+}
+
+bool TNuma::available() {
+#if STO_NUMA
+    static bool avail = numa_available() >= 0;
+    return avail;
+#else
+    return false;
+#endif
+}
+
+int TNuma::nnodes() {
+    return topology().nnodes;
+}
+
+int TNuma::ncpus() {
+    return topology().ncpus;
+}
+
+int TNuma::current_node() {
+#if STO_NUMA
+    if (available()) {
+        int cpu = sched_getcpu();
+        if (cpu >= 0)
+            return std::max(numa_node_of_cpu(cpu), 0);
+    }
+#endif
+    return 0;
+}
+
+int TNuma::node_of_cpu(int cpu) {
+#if STO_NUMA
+    if (available())
+        return std::max(numa_node_of_cpu(cpu), 0);
+#endif
+    (void) cpu;
+    return 0;
+}
+
+bool TNuma::pin_thread(int cpu) {
+#if __linux__
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(cpu, &cs);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+int TNuma::thread_cpu(int i, bool scatter) {
+    const numa_topology& t = topology();
+    const std::vector<int>& order = scatter ? t.scatter : t.compact;
+    return order[i % order.size()];
+}
+
+void* TNuma::allocate(size_t size, TNumaPolicy policy) {
+    size += sizeof(numa_header);
+    numa_header* h = nullptr;
+#if STO_NUMA
+    if (policy != TNumaPolicy::none && available() && nnodes() > 1) {
+        void* p;
+        if (policy == TNumaPolicy::local)
+            p = numa_alloc_local(size);
+        else if (policy == TNumaPolicy::interleave)
+            p = numa_alloc_interleaved(size);
+        else {
+            p = numa_alloc(size);
+            if (p)
+                place(p, size, policy);
+        }
+        if (p) {
+            h = static_cast<numa_header*>(p);
+            h->numa = true;
+        }
+    }
+#endif
+    (void) policy;
+    if (!h) {
+        void* p;
+        if (posix_memalign(&p, sizeof(numa_header), size) != 0)
+            return nullptr;
+        h = static_cast<numa_header*>(p);
+        h->numa = false;
+    }
+    h->size = size;
+    return h + 1;
+}
+
+void TNuma::free(void* ptr) {
+    if (!ptr)
+        return;
+    numa_header* h = static_cast<numa_header*>(ptr) - 1;
+#if STO_NUMA
+    if (h->numa) {
+        numa_free(h, h->size);
+        return;
+    }
+#endif
+    ::free(h);
+}
+
+void TNuma::place(void* ptr, size_t size, TNumaPolicy policy) {
+#if STO_NUMA
+    if (policy == TNumaPolicy::none || !available() || nnodes() <= 1)
+        return;
+    if (policy == TNumaPolicy::local)
+        bind_node(ptr, size, MPOL_PREFERRED, current_node());
+    else if (policy == TNumaPolicy::interleave)
+        bind_pages(ptr, size, MPOL_INTERLEAVE, numa_all_nodes_ptr);
+    else {
+        int n = nnodes();
+        size_t slice = (size + n - 1) / n;
+        char* p = static_cast<char*>(ptr);
+        for (int i = 0; i < n && size_t(i) * slice < size; ++i)
+            bind_node(p + i * slice, std::min(slice, size - i * slice),
+                      MPOL_BIND, i);
+    }
+#else
+    (void) ptr, (void) size, (void) policy;
+#endif
+}
+
+const char* TNuma::policy_name(TNumaPolicy policy) {
+    switch (policy) {
+    case TNumaPolicy::local:
+        return "local";
+    case TNumaPolicy::interleave:
+        return "interleave";
+    case TNumaPolicy::partition:
+        return "partition";
+    default:
+        return "none";
+    }
+}
+
+bool TNuma::parse_policy(const char* name, TNumaPolicy& policy) {
+    static const TNumaPolicy all[] = {
+        TNumaPolicy::none, TNumaPolicy::local,
+        TNumaPolicy::interleave, TNumaPolicy::partition
+    };
+    for (TNumaPolicy p : all)
+        if (strcmp(name, policy_name(p)) == 0) {
+            policy = p;
+            return true;
+        }
+    return false;
+}
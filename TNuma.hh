@@ -0,0 +1,110 @@
+#pragma once
+#include "config.h"
+#include "compiler.hh"
+#include <stddef.h>
+#include <utility>
+
+#ifndef STO_NUMA
+#if HAVE_LIBNUMA && HAVE_NUMA_H
+#define STO_NUMA 1
+#else
+#define STO_NUMA 0
+#endif
+#endif
+
+// Memory placement policies for data structure storage.
+//   none: leave placement to the OS (first touch)
+//   local: the calling thread's node
+//   interleave: pages round-robin over all nodes
+//   partition: the range is split into one contiguous piece per node
+enum class TNumaPolicy {
+    none = 0, local, interleave, partition
+};
+
+// Thin wrapper around libnuma/mbind. Every function falls back to plain
+// malloc/free or a no-op when libnuma is unavailable or the machine has a
+// single node.
+class TNuma {
+public:
+    static bool available();
+    static int nnodes();
+    static int ncpus();
+    static int current_node();
+    static int node_of_cpu(int cpu);
+
+    // Pin the calling thread to `cpu`. Returns false on failure.
+    static bool pin_thread(int cpu);
+    // The CPU worker thread `i` should use: `scatter` spreads
+    // consecutive threads across nodes, otherwise nodes are filled in order.
+    static int thread_cpu(int i, bool scatter);
+
+    // Allocate `size` bytes placed according to `policy`. The result is
+    // cache-line aligned and must be freed with TNuma::free.
+    static void* allocate(size_t size, TNumaPolicy policy);
+    static void free(void* ptr);
+    // Apply `policy` to the whole pages within [ptr, ptr + size), moving
+    // pages that have already been touched.
+    static void place(void* ptr, size_t size, TNumaPolicy policy);
+
+    static const char* policy_name(TNumaPolicy policy);
+    static bool parse_policy(const char* name, TNumaPolicy& policy);
+};
+
+// Allocator for standard containers that places their storage by policy.
+template <typename T>
+class TNumaAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template <typename U> struct rebind {
+        typedef TNumaAllocator<U> other;
+    };
+
+    TNumaAllocator(TNumaPolicy policy = TNumaPolicy::none)
+        : policy_(policy) {
+    }
+    template <typename U>
+    TNumaAllocator(const TNumaAllocator<U>& x)
+        : policy_(x.policy()) {
+    }
+
+    T* allocate(size_t n) {
+        if (policy_ == TNumaPolicy::none)
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        return static_cast<T*>(TNuma::allocate(n * sizeof(T), policy_));
+    }
+    void deallocate(T* p, size_t) {
+        if (policy_ == TNumaPolicy::none)
+            ::operator delete(p);
+        else
+            TNuma::free(p);
+    }
+    template <typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        new((void*) p) U(std::forward<Args>(args)...);
+    }
+    template <typename U>
+    void destroy(U* p) {
+        p->~U();
+    }
+
+    TNumaPolicy policy() const {
+        return policy_;
+    }
+    template <typename U>
+    bool operator==(const TNumaAllocator<U>& x) const {
+        return policy_ == x.policy();
+    }
+    template <typename U>
+    bool operator!=(const TNumaAllocator<U>& x) const {
+        return policy_ != x.policy();
+    }
+
+private:
+    TNumaPolicy policy_;
+};
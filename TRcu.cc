@@ -1,9 +1,10 @@
 #include "TRcu.hh"
 
+static constexpr unsigned initial_capacity = (4080 - sizeof(TRcuGroup)) / sizeof(TRcuGroup::TRcuElement);
+
 TRcuSet::TRcuSet()
     : clean_epoch_(0) {
-    unsigned capacity = (4080 - sizeof(TRcuGroup)) / sizeof(TRcuGroup::TRcuElement);
-    current_ = first_ = TRcuGroup::make(capacity);
+    current_ = first_ = TRcuGroup::make(initial_capacity);
     // ngroups_ = 1;
 }
 
@@ -17,6 +18,13 @@ TRcuSet::~TRcuSet() {
     // ngroups_ = 0;
 }
 
+void TRcuSet::rehome() {
+    if (first_ == current_ && !first_->next_ && first_->head_ == first_->tail_) {
+        TRcuGroup::free(first_);
+        current_ = first_ = TRcuGroup::make(initial_capacity);
+    }
+}
+
 void TRcuSet::check() {
     // check invariants
     TRcuGroup* first = first_;
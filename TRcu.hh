@@ -80,6 +80,9 @@ public:
     epoch_type clean_epoch() const {
         return clean_epoch_;
     }
+    // Reallocate the (empty) initial group from the calling thread, so its
+    // pages are first touched on that thread's NUMA node.
+    void rehome();
 
 private:
     TRcuGroup* current_;
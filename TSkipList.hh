@@ -0,0 +1,550 @@
+#pragma once
+#include <stdlib.h>
+#include <new>
+#include <functional>
+#include "Interface.hh"
+#include "Transaction.hh"
+#include "TWrapped.hh"
+#include "print_value.hh"
+
+// A transactional ordered map, kept as a skip list.
+//
+// Lookups and scans never lock: they walk the levels from the head node to
+// the bottom level, which holds every key in order. Each node has two
+// versions. `version` covers the node's value and whether its key is
+// present; a node whose key is absent (an uncommitted insert, or a
+// committed delete not yet unlinked) has invalid_bit set. `gapversion`
+// covers the gap between the node and its bottom-level successor: an
+// absent-key read or a range scan observes the gap version of the node
+// before each key it did not find, and every link of a node into that gap
+// bumps it, so phantoms fail at commit without any list-wide version.
+//
+// Linking and unlinking nodes use the gap versions as locks on the
+// predecessors, locked right to left, as in Herlihy et al.'s lazy skip
+// list. Like Hashtable, a transactional insert links an invalid node
+// right away; it becomes valid at commit, and is unlinked if the
+// transaction aborts. Deleted nodes are unlinked after commit and freed
+// through RCU.
+template <typename K, typename V, typename Compare = std::less<K>>
+class TSkipList : public TObject {
+public:
+    typedef K key_type;
+    typedef V mapped_type;
+    typedef TVersion version_type;
+    typedef TWrapped<V> wrapped_type;
+
+    static constexpr int max_height = 16;
+    static constexpr TransactionTid::type invalid_bit = TransactionTid::user_bit;
+    static constexpr TransItem::flags_type insert_bit = TransItem::user0_bit;
+    static constexpr TransItem::flags_type delete_bit = TransItem::user0_bit << 1;
+
+    TSkipList(Compare comp = Compare())
+        : comp_(comp) {
+        head_ = node::make(K(), V(), max_height, true);
+    }
+    ~TSkipList() {
+        while (node* n = head_) {
+            head_ = n->next[0];
+            node::destroy(n);
+        }
+    }
+
+    // returns true if found
+    bool transGet(const K& key, V& value) {
+        version_type gapv;
+        node* n;
+        node* pred = find_pred(key, gapv, n);
+        if (n && !comp_(key, n->key) && read_node(n, value))
+            return true;
+        observe_gap(pred, gapv);
+        return false;
+    }
+    // returns true if `key` was already present
+    bool transPut(const K& key, const V& value) {
+        return trans_write</*insert*/true, /*set*/true>(key, value);
+    }
+    // returns true if inserted
+    bool transInsert(const K& key, const V& value) {
+        return !trans_write</*insert*/true, /*set*/false>(key, value);
+    }
+    // returns true if updated
+    bool transUpdate(const K& key, const V& value) {
+        return trans_write</*insert*/false, /*set*/true>(key, value);
+    }
+    // returns true if deleted
+    bool transDelete(const K& key) {
+        version_type gapv;
+        node* n;
+        node* pred = find_pred(key, gapv, n);
+        if (n && !comp_(key, n->key)) {
+            auto item = Sto::item(this, n);
+            if (has_insert(item)) {
+                if (has_delete(item))
+                    return false;
+                // insert-then-delete: cleanup() unlinks the node
+                item.add_flags(delete_bit);
+                return true;
+            }
+            if (has_delete(item))
+                return false;
+            version_type v = n->version;
+            acquire_fence();
+            if (!(v.value() & invalid_bit)) {
+                item.observe(v);
+                item.clear_write().add_write().add_flags(delete_bit);
+                return true;
+            }
+            item.observe(v);
+        }
+        observe_gap(pred, gapv);
+        return false;
+    }
+
+    // Calls f(const K&, const V&) for each key not less than `lo`, in
+    // order, until f returns false. The scan sees this transaction's own
+    // writes, and fails at commit if any key it passed changes, or a key
+    // appears or disappears in the range it covered.
+    template <typename F>
+    void transScan(const K& lo, F f) {
+        version_type gapv;
+        node* n;
+        node* pred = find_pred(lo, gapv, n);
+        observe_gap(pred, gapv);
+        scan_from(n, f);
+    }
+    template <typename F>
+    void transScan(F f) {
+        version_type gapv = stable_gap(head_);
+        acquire_fence();
+        observe_gap(head_, gapv);
+        scan_from(head_->next[0], f);
+    }
+
+    // The first key not less than `lo`. Returns false if there is none.
+    bool transLowerBound(const K& lo, K& key, V& value) {
+        bool found = false;
+        transScan(lo, [&] (const K& k, const V& v) {
+                key = k;
+                value = v;
+                found = true;
+                return false;
+            });
+        return found;
+    }
+
+    // wrapper for concurrent.cc
+    V transGet(const K& key) {
+        V value = V();
+        transGet(key, value);
+        return value;
+    }
+
+    bool nontrans_find(const K& key, V& value) {
+        node* n = find_pred(key)->next[0];
+        if (n && !comp_(key, n->key) && n->valid()) {
+            value = n->value.access();
+            return true;
+        }
+        return false;
+    }
+    // returns true if inserted; otherwise updates the existing value
+    bool nontrans_put(const K& key, const V& value) {
+        link_result r;
+        node* n = link(key, value, true, r);
+        if (n != r.inserted) {
+            n->value.write(value);
+            return false;
+        }
+        return true;
+    }
+    bool nontrans_remove(const K& key) {
+        node* n = find_pred(key)->next[0];
+        if (!n || comp_(key, n->key) || !n->valid())
+            return false;
+        unlink(n);
+        return true;
+    }
+
+    bool check(TransItem& item, Transaction&) override {
+        if (is_gap(item))
+            return gap_key(item)->gapversion.check_version(item.template read_value<version_type>());
+        return item.key<node*>()->version.check_version(item.template read_value<version_type>());
+    }
+    bool lock(TransItem& item, Transaction& txn) override {
+        assert(!is_gap(item));
+        // an insert-then-delete changes nothing visible
+        if (has_insert(item) && has_delete(item))
+            return true;
+        return txn.try_lock(item, item.key<node*>()->version);
+    }
+    void install(TransItem& item, Transaction& txn) override {
+        node* n = item.key<node*>();
+        if (has_insert(item) && has_delete(item))
+            return;
+        if (has_delete(item)) {
+            txn.set_version(n->version, invalid_bit);
+            return;
+        }
+        n->value.write(item.template write_value<V>());
+        // clears invalid_bit for inserts
+        txn.set_version(n->version);
+    }
+    void unlock(TransItem& item) override {
+        if (!(has_insert(item) && has_delete(item)))
+            item.key<node*>()->version.unlock();
+    }
+    void cleanup(TransItem& item, bool committed) override {
+        if (has_insert(item) ? has_delete(item) || !committed
+            : committed && has_delete(item))
+            unlink(item.key<node*>());
+    }
+    void print(std::ostream& w, const TransItem& item) const override {
+        w << "{TSkipList<" << typeid(K).name() << "," << typeid(V).name() << "> " << (void*) this;
+        if (is_gap(item)) {
+            node* n = gap_key(item);
+            w << ".gap[";
+            if (n == head_)
+                w << "head";
+            else
+                w << mass::print_value(n->key);
+            w << "]";
+        } else
+            w << "[" << mass::print_value(item.key<node*>()->key) << "]";
+        if (item.has_read())
+            w << " R" << item.read_value<version_type>();
+        if (item.has_write() && has_delete(item))
+            w << " =X";
+        else if (item.has_write())
+            w << " =" << mass::print_value(item.write_value<V>());
+        w << "}";
+    }
+
+private:
+    struct node {
+        K key;
+        wrapped_type value;
+        version_type version;
+        // also the lock on next[], see above
+        version_type gapversion;
+        // set, under gapversion's lock, once unlinking starts
+        bool unlinked;
+        int height;
+        node* next[1];
+
+        node(const K& k, const V& v, int h, bool valid)
+            : key(k), value(v),
+              version(Sto::initialized_tid() | (valid ? 0 : invalid_bit)),
+              gapversion(Sto::initialized_tid()), unlinked(false), height(h) {
+        }
+        bool valid() const {
+            return !(version.value() & invalid_bit);
+        }
+
+        static node* make(const K& k, const V& v, int h, bool valid) {
+            void* p = malloc(sizeof(node) + (h - 1) * sizeof(node*));
+            if (!p)
+                throw std::bad_alloc();
+            node* n = new (p) node(k, v, h, valid);
+            for (int l = 0; l < h; ++l)
+                n->next[l] = nullptr;
+            return n;
+        }
+        static void destroy(void* p) {
+            static_cast<node*>(p)->~node();
+            free(p);
+        }
+    };
+
+    // what link() did, for a transactional insert to fix up its reads
+    struct link_result {
+        node* inserted;
+        node* pred;
+        version_type old_gap;
+        version_type new_gap;
+        // the inserted node's gap version, before anyone could change it
+        version_type node_gap;
+    };
+
+    node* head_;
+    Compare comp_;
+
+    static bool has_insert(const TransItem& item) {
+        return item.flags() & insert_bit;
+    }
+    static bool has_delete(const TransItem& item) {
+        return item.flags() & delete_bit;
+    }
+    // Gap items are keyed by the node before the gap, with the low bit set.
+    static bool is_gap(const TransItem& item) {
+        return (uintptr_t) item.key<void*>() & 1;
+    }
+    static node* gap_key(const TransItem& item) {
+        return (node*) ((uintptr_t) item.key<void*>() - 1);
+    }
+    static void* pack_gap(node* n) {
+        return (void*) ((uintptr_t) n | 1);
+    }
+
+    static int random_height() {
+        static __thread uint32_t seed;
+        if (!seed)
+            seed = 2463534242U + TThread::id() * 0x9E3779B9U;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        uint32_t x = seed;
+        int h = 1;
+        // each level holds a quarter of the one below
+        while (h < max_height && (x & 3) == 0) {
+            ++h;
+            x >>= 2;
+        }
+        return h;
+    }
+
+    // The last node before `key` on each level (and its successor there).
+    // Lock-free; the result may be stale by the time it returns.
+    void find(const K& key, node** preds, node** succs) {
+        node* x = head_;
+        for (int l = max_height - 1; l >= 0; --l) {
+            node* y = x->next[l];
+            acquire_fence();
+            while (y && comp_(y->key, key)) {
+                x = y;
+                y = x->next[l];
+                acquire_fence();
+            }
+            preds[l] = x;
+            succs[l] = y;
+        }
+    }
+    node* find_pred(const K& key) {
+        node* x = head_;
+        for (int l = max_height - 1; l >= 0; --l) {
+            node* y = x->next[l];
+            acquire_fence();
+            while (y && comp_(y->key, key)) {
+                x = y;
+                y = x->next[l];
+                acquire_fence();
+            }
+        }
+        return x;
+    }
+    // The last bottom-level node before `key`, with a snapshot of its gap
+    // version taken before reading its successor `next`. Retries if the
+    // node is being unlinked.
+    node* find_pred(const K& key, version_type& gapv, node*& next) {
+        while (1) {
+            node* pred = find_pred(key);
+            while (1) {
+                gapv = stable_gap(pred);
+                acquire_fence();
+                if (pred->unlinked)
+                    break;
+                next = pred->next[0];
+                acquire_fence();
+                if (!next || !comp_(next->key, key))
+                    return pred;
+                // linked since find_pred
+                pred = next;
+            }
+            relax_fence();
+        }
+    }
+    static version_type stable_gap(node* n) {
+        while (1) {
+            version_type v = n->gapversion;
+            if (!v.is_locked())
+                return v;
+            relax_fence();
+        }
+    }
+    void observe_gap(node* n, version_type gapv) {
+        Sto::item(this, pack_gap(n)).observe(gapv);
+    }
+
+    // Reads n's value into `value` as this transaction sees it, recording
+    // the read. Returns false if n's key is absent.
+    bool read_node(node* n, V& value) {
+        auto item = Sto::item(this, n);
+        if (item.has_write()) {
+            if (has_delete(item))
+                return false;
+            value = item.template write_value<V>();
+            return true;
+        }
+        value = n->value.read(item, n->version);
+        return !(item.template read_value<version_type>().value() & invalid_bit);
+    }
+
+    template <typename F>
+    void scan_from(node* n, F& f) {
+        V value;
+        while (n) {
+            if (read_node(n, value) && !f(static_cast<const K&>(n->key), static_cast<const V&>(value)))
+                return;
+            version_type gapv = stable_gap(n);
+            acquire_fence();
+            // only committed deletes and aborted inserts are unlinked,
+            // and either changes a version we read
+            if (n->unlinked)
+                Sto::abort();
+            observe_gap(n, gapv);
+            n = n->next[0];
+            acquire_fence();
+        }
+    }
+
+    // returns true if `key` was already present
+    template <bool INSERT, bool SET>
+    bool trans_write(const K& key, const V& value) {
+        while (1) {
+            version_type gapv;
+            node* n;
+            node* pred = find_pred(key, gapv, n);
+            if (!n || comp_(key, n->key)) {
+                if (!INSERT) {
+                    observe_gap(pred, gapv);
+                    return false;
+                }
+                link_result r;
+                n = link(key, value, false, r);
+                if (n != r.inserted)
+                    // linked by someone else since find_pred
+                    continue;
+                // our own link doesn't invalidate our reads; a read of
+                // pred's gap now also covers the new node's gap
+                if (auto gap_item = Sto::check_item(this, pack_gap(r.pred))) {
+                    gap_item->update_read(r.old_gap, r.new_gap);
+                    observe_gap(n, r.node_gap);
+                }
+                Sto::new_item(this, n).add_write(value).add_flags(insert_bit);
+                return false;
+            }
+
+            auto item = Sto::item(this, n);
+            if (has_insert(item)) {
+                if (has_delete(item)) {
+                    // insert-then-delete, then insert: back to an insert
+                    if (INSERT)
+                        item.clear_flags(delete_bit).clear_write().add_write(value);
+                    return false;
+                }
+                if (SET)
+                    item.add_write(value);
+                return true;
+            }
+            if (has_delete(item)) {
+                // delete-then-insert is an update; the delete observed
+                // the version already
+                if (INSERT)
+                    item.clear_flags(delete_bit).clear_write().add_write(value);
+                return false;
+            }
+            version_type v = n->version;
+            acquire_fence();
+            if (v.value() & invalid_bit) {
+                // another transaction's insert, or a delete awaiting
+                // unlink
+                if (INSERT)
+                    Sto::abort();
+                item.observe(v);
+                observe_gap(pred, gapv);
+                return false;
+            }
+            // make sure it isn't deleted before we commit
+            item.observe(v);
+            if (SET)
+                item.add_write(value);
+            return true;
+        }
+    }
+
+    // Locks the distinct nodes preds[0..h) right to left and checks that
+    // each is still linked and followed by succs[l] (or, when unlinking,
+    // by the victim). Returns the number of levels locked; all of them
+    // must be unlocked even on failure.
+    int lock_preds(node** preds, node** succs, int h, bool& ok) {
+        ok = true;
+        int l;
+        for (l = 0; l < h && ok; ++l) {
+            if (l == 0 || preds[l] != preds[l - 1])
+                preds[l]->gapversion.lock();
+            ok = !preds[l]->unlinked && preds[l]->next[l] == succs[l];
+        }
+        return l;
+    }
+    static void unlock_preds(node** preds, int nlocked) {
+        for (int l = nlocked - 1; l >= 0; --l)
+            if (l == 0 || preds[l] != preds[l - 1])
+                preds[l]->gapversion.unlock();
+    }
+
+    // Links a new node for `key`, unless one is already linked; returns
+    // whichever node is linked.
+    node* link(const K& key, const V& value, bool valid, link_result& r) {
+        node* preds[max_height];
+        node* succs[max_height];
+        int h = random_height();
+        r.inserted = nullptr;
+        while (1) {
+            find(key, preds, succs);
+            if (succs[0] && !comp_(key, succs[0]->key)) {
+                if (!succs[0]->unlinked)
+                    return succs[0];
+                // wait for it to go
+                relax_fence();
+                continue;
+            }
+            bool ok;
+            int nlocked = lock_preds(preds, succs, h, ok);
+            if (ok) {
+                node* n = node::make(key, value, h, valid);
+                for (int l = 0; l < h; ++l)
+                    n->next[l] = succs[l];
+                r.node_gap = n->gapversion;
+                release_fence();
+                for (int l = 0; l < h; ++l)
+                    preds[l]->next[l] = n;
+                r.inserted = n;
+                r.pred = preds[0];
+                r.old_gap = version_type(preds[0]->gapversion.unlocked());
+                preds[0]->gapversion.inc_nonopaque_version();
+                r.new_gap = version_type(preds[0]->gapversion.unlocked());
+                unlock_preds(preds, nlocked);
+                return n;
+            }
+            unlock_preds(preds, nlocked);
+            relax_fence();
+        }
+    }
+
+    void unlink(node* victim) {
+        node* preds[max_height];
+        node* succs[max_height];
+        node* found[max_height];
+        int h = victim->height;
+        victim->gapversion.lock();
+        victim->unlinked = true;
+        for (int l = 0; l < h; ++l)
+            succs[l] = victim;
+        while (1) {
+            find(victim->key, preds, found);
+            bool ok;
+            int nlocked = lock_preds(preds, succs, h, ok);
+            if (ok) {
+                for (int l = h - 1; l >= 0; --l)
+                    preds[l]->next[l] = victim->next[l];
+                // readers of the victim's gap now need pred's
+                victim->gapversion.inc_nonopaque_version();
+                unlock_preds(preds, nlocked);
+                break;
+            }
+            unlock_preds(preds, nlocked);
+            relax_fence();
+        }
+        victim->gapversion.unlock();
+        Transaction::rcu_call(node::destroy, victim);
+    }
+};
@@ -2,6 +2,7 @@
 #include "TWrapped.hh"
 #include "TArrayProxy.hh"
 #include "TIntPredicate.hh"
+#include "TNuma.hh"
 
 template <typename T, template <typename> class W = TOpaqueWrapped>
 class TVector : public TObject {
@@ -45,8 +46,13 @@ public:
     typedef const_proxy_type const_reference;
 
     TVector()
-        : size_(0), max_size_(0), capacity_(default_capacity) {
-        data_ = reinterpret_cast<elem*>(new char[sizeof(elem) * capacity_]);
+        : TVector(TNumaPolicy::none) {
+    }
+    // `policy` controls NUMA placement of the element array, including
+    // arrays allocated when the vector grows.
+    explicit TVector(TNumaPolicy policy)
+        : size_(0), max_size_(0), capacity_(default_capacity), policy_(policy) {
+        data_ = allocate_data(capacity_);
         for (size_type i = 0; i != capacity_; ++i)
             data_[i].vers = dead_bit;
     }
@@ -54,7 +60,7 @@ public:
         using WT = W<T>;
         for (size_type i = 0; i != max_size_; ++i)
             data_[i].v.~WT();
-        delete[] reinterpret_cast<char*>(data_);
+        free_data(data_);
     }
 
     size_proxy size() const {
@@ -293,6 +299,14 @@ private:
     size_type size_delta_; // protected by size_vers_ lock
     size_type max_size_; // protected by size_vers_ lock
     size_type capacity_;
+    TNumaPolicy policy_;
+
+    elem* allocate_data(size_type capacity) const {
+        return reinterpret_cast<elem*>(TNuma::allocate(sizeof(elem) * capacity, policy_));
+    }
+    static void free_data(void* data) {
+        TNuma::free(data);
+    }
 
     // size helpers
     TransProxy size_item() const {
@@ -621,11 +635,11 @@ void TVector<T, W>::nontrans_reserve(size_type size) {
     while (size > new_capacity)
         new_capacity <<= 1;
     if (new_capacity > capacity_) {
-        elem* new_data = reinterpret_cast<elem*>(new char[sizeof(elem) * new_capacity]);
+        elem* new_data = allocate_data(new_capacity);
         memcpy(new_data, data_, sizeof(elem) * capacity_);
         for (size_type i = capacity_; i != new_capacity; ++i)
             new_data[i].vers = dead_bit;
-        Transaction::rcu_delete_array(reinterpret_cast<char*>(data_));
+        Transaction::rcu_call(free_data, data_);
         data_ = new_data;
         capacity_ = new_capacity;
     }
@@ -0,0 +1,11 @@
+#include "TransAlloc.hh"
+
+TransAllocPool TransAllocPool::pools_[MAX_THREADS];
+
+TransAllocPool::~TransAllocPool() {
+    for (unsigned i = 0; i != nclasses; ++i)
+        while (free_block* b = free_[i]) {
+            free_[i] = b->next;
+            ::free(reinterpret_cast<header*>(b) - 1);
+        }
+}
@@ -4,35 +4,150 @@
 #include "Interface.hh"
 #include "Transaction.hh"
 
-class TransAlloc : public TObject {
+// Plain malloc/new backend. Everything, including aborted allocations, is
+// freed through RCU, so it is safe even if an aborted allocation was
+// published to other threads.
+struct TransMallocBackend {
+    static constexpr bool reuse_on_abort = false;
+
+    static void* allocate(size_t sz) {
+        return ::malloc(sz);
+    }
+    static void free(void* ptr) {
+        ::free(ptr);
+    }
+    template <typename T, typename... Args>
+    static T* make(Args&&... args) {
+        return new T(std::forward<Args>(args)...);
+    }
+    template <typename T>
+    static void destroy_and_free(void* x) {
+        ObjectDestroyer<T>::destroy_and_free(x);
+    }
+};
+
+// Per-thread size-class free lists. Each block is preceded by a 16-byte
+// header recording its size class, so blocks keep malloc's alignment and
+// can be returned to whichever thread's pool frees them. Blocks larger
+// than the biggest class go straight to malloc.
+//
+// Aborted allocations are returned to the local free list at cleanup time
+// with no RCU round trip, so a transaction must not publish a block it
+// allocated to other threads before it commits. Committed frees are
+// retired through RCU and land on the retiring thread's free list.
+class __attribute__((aligned(128))) TransAllocPool {
+public:
+    static constexpr bool reuse_on_abort = true;
+    static constexpr unsigned nclasses = 8;       // 16, 32, ..., 2048 bytes
+    static constexpr size_t min_class_size = 16;
+    static constexpr size_t max_class_size = min_class_size << (nclasses - 1);
+    static constexpr unsigned max_cached = 4096;  // per class, per thread
+
+    static void* allocate(size_t sz) {
+        return pools_[TThread::id()].pool_allocate(sz);
+    }
+    static void free(void* ptr) {
+        pools_[TThread::id()].pool_free(ptr);
+    }
+    template <typename T, typename... Args>
+    static T* make(Args&&... args) {
+        return new(allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+    template <typename T>
+    static void destroy_and_free(void* x) {
+        reinterpret_cast<T*>(x)->~T();
+        free(x);
+    }
+
+    static unsigned size_class(size_t sz) {
+        if (sz <= min_class_size)
+            return 0;
+        else if (sz > max_class_size)
+            return nclasses;
+        else
+            return (sizeof(long) * 8) - clz((unsigned long) (sz - 1)) - 4;
+    }
+
+    TransAllocPool() {
+        for (unsigned i = 0; i != nclasses; ++i) {
+            free_[i] = nullptr;
+            nfree_[i] = 0;
+        }
+    }
+    ~TransAllocPool();
+
+private:
+    struct header {
+        size_t sclass;
+        size_t pad_;
+    };
+    struct free_block {
+        free_block* next;
+    };
+
+    free_block* free_[nclasses];
+    unsigned nfree_[nclasses];
+
+    static TransAllocPool pools_[MAX_THREADS];
+
+    void* pool_allocate(size_t sz) {
+        unsigned sc = size_class(sz);
+        header* h;
+        if (sc < nclasses && free_[sc]) {
+            free_block* b = free_[sc];
+            free_[sc] = b->next;
+            --nfree_[sc];
+            h = reinterpret_cast<header*>(b) - 1;
+        } else {
+            size_t bsz = sc < nclasses ? min_class_size << sc : sz;
+            h = reinterpret_cast<header*>(::malloc(sizeof(header) + bsz));
+            h->sclass = sc;
+        }
+        return h + 1;
+    }
+    void pool_free(void* ptr) {
+        header* h = reinterpret_cast<header*>(ptr) - 1;
+        unsigned sc = h->sclass;
+        if (sc < nclasses && nfree_[sc] < max_cached) {
+            free_block* b = reinterpret_cast<free_block*>(ptr);
+            b->next = free_[sc];
+            free_[sc] = b;
+            ++nfree_[sc];
+        } else
+            ::free(h);
+    }
+};
+
+template <typename Backend>
+class TransAllocator : public TObject {
 public:
     static constexpr TransItem::flags_type alloc_flag = TransItem::user0_bit;
     typedef void (*free_type)(void*);
 
     // used to free things only if successful commit
     void transFree(void *ptr) {
-        Sto::new_item(this, ptr).template add_write<free_type, free_type>(::free);
+        Sto::new_item(this, ptr).template add_write<free_type, free_type>(&Backend::free);
     }
 
     // malloc() which will be freed on abort
     void* transMalloc(size_t sz) {
-        void *ptr = malloc(sz);
-        Sto::new_item(this, ptr).template add_write<free_type, free_type>(::free).add_flags(alloc_flag);
+        void *ptr = Backend::allocate(sz);
+        Sto::new_item(this, ptr).template add_write<free_type, free_type>(&Backend::free).add_flags(alloc_flag);
         return ptr;
     }
 
     // delete which only applies if transaction commits
     template <typename T>
     void transDelete(T *x) {
-        Sto::new_item(this, x).template add_write<free_type, free_type>(&ObjectDestroyer<T>::destroy_and_free);
+        Sto::new_item(this, x).template add_write<free_type, free_type>(&Backend::template destroy_and_free<T>);
     }
 
     // new which will be delete'd on abort.
     // arguments go to T's constructor
     template <typename T, typename... Args>
     T* transNew(Args&&... args) {
-        T* x = new T(std::forward<Args>(args)...);
-        Sto::new_item(this, x).template add_write<free_type, free_type>(&ObjectDestroyer<T>::destroy_and_free).add_flags(alloc_flag);
+        T* x = Backend::template make<T>(std::forward<Args>(args)...);
+        Sto::new_item(this, x).template add_write<free_type, free_type>(&Backend::template destroy_and_free<T>).add_flags(alloc_flag);
         return x;
     }
 
@@ -41,14 +156,22 @@ public:
     void install(TransItem&, Transaction&) override {}
     void unlock(TransItem&) override {}
     void cleanup(TransItem& item, bool committed) override {
-        if (committed == !item.has_flag(alloc_flag))
-	  Transaction::rcu_call(item.write_value<free_type>(), item.key<void*>());
+        bool alloc = item.has_flag(alloc_flag);
+        if (committed == alloc)
+            return;
+        if (Backend::reuse_on_abort && alloc)
+            item.write_value<free_type>()(item.key<void*>());
+        else
+            Transaction::rcu_call(item.write_value<free_type>(), item.key<void*>());
     }
     void print(std::ostream& w, const TransItem& item) const override {
         w << "{TransAlloc @" << item.key<void*>();
-        if (item.write_value<int>())
+        if (item.has_flag(alloc_flag))
             w << ".alloc}";
         else
             w << ".free}";
     }
 };
+
+typedef TransAllocator<TransMallocBackend> TransAlloc;
+typedef TransAllocator<TransAllocPool> TransPoolAlloc;
@@ -7,6 +7,10 @@
 #include "Packer.hh"
 #include "compiler.hh"
 
+#ifndef STO_TRANSITEM_SPLIT
+#define STO_TRANSITEM_SPLIT 0
+#endif
+
 class TransProxy;
 
 class TransItem {
@@ -33,7 +37,7 @@ class TransItem {
 
 
     TransItem() = default;
-    TransItem(TObject* owner, void* k)
+    TransItem(TObject* owner, TransSlot k)
         : s_(reinterpret_cast<ownerstore_type>(owner)), key_(k) {
     }
 
@@ -101,27 +105,27 @@ class TransItem {
     template <typename T>
     T& write_value() {
         assert(has_write());
-        return Packer<T>::unpack(wdata_);
+        return Packer<T>::unpack(wdata());
     }
     template <typename T>
     const T& write_value() const {
         assert(has_write());
-        return Packer<T>::unpack(wdata_);
+        return Packer<T>::unpack(wdata());
     }
     template <typename T>
     T write_value(T default_value) const {
-        return has_write() ? Packer<T>::unpack(wdata_) : default_value;
+        return has_write() ? Packer<T>::unpack(wdata()) : default_value;
     }
 
     template <typename T>
     T& xwrite_value() {
         static_assert(Packer<T>::is_simple, "xwrite_value only works on simple types");
-        return Packer<T>::unpack(wdata_);
+        return Packer<T>::unpack(wdata());
     }
     template <typename T>
     const T& xwrite_value() const {
         static_assert(Packer<T>::is_simple, "xwrite_value only works on simple types");
-        return Packer<T>::unpack(wdata_);
+        return Packer<T>::unpack(wdata());
     }
 
     template <typename T>
@@ -190,9 +194,23 @@ class TransItem {
 private:
     ownerstore_type s_;
     // this word must be unique (to a particular item) and consistently ordered across transactions
-    void* key_;
-    void* rdata_;
-    void* wdata_;
+    TransSlot key_;
+    TransSlot rdata_;
+#if STO_TRANSITEM_SPLIT
+    // write payloads live in a parallel array at the end of the item's
+    // chunk (see TransItemChunk)
+    inline TransSlot& wdata();
+    inline const TransSlot& wdata() const;
+#else
+    TransSlot wdata_;
+
+    TransSlot& wdata() {
+        return wdata_;
+    }
+    const TransSlot& wdata() const {
+        return wdata_;
+    }
+#endif
 
     void __rm_flags(flags_type flags) {
         s_ = s_ & ~flags;
@@ -205,6 +223,51 @@ private:
 };
 
 
+#if STO_TRANSITEM_SPLIT
+// Hot/cold TransItem layout. A chunk holds `nitems` items (owner/flags, key
+// and read data, which every commit phase scans) followed by a parallel
+// array of their write payloads, which only install and cleanup touch.
+// Chunks are aligned to a power of two at least as large as the chunk, so
+// an item finds its write slot from its own address.
+inline constexpr size_t trans_item_chunk_alignment(size_t x, size_t p = 64) {
+    return p >= x ? p : trans_item_chunk_alignment(x, p * 2);
+}
+
+struct TransItemChunk {
+    static constexpr unsigned nitems = 512;
+    static constexpr size_t hot_size = nitems * sizeof(TransItem);
+    static constexpr size_t size = hot_size + nitems * sizeof(TransSlot);
+    static constexpr size_t alignment = trans_item_chunk_alignment(size);
+
+    static TransItem* make() {
+        void* p;
+        if (posix_memalign(&p, alignment, size) != 0)
+            throw std::bad_alloc();
+        return reinterpret_cast<TransItem*>(p);
+    }
+    static void free(TransItem* chunk) {
+        ::free(chunk);
+    }
+    static TransSlot& wdata(TransItem* item) {
+        uintptr_t x = reinterpret_cast<uintptr_t>(item);
+        uintptr_t base = x & ~uintptr_t(alignment - 1);
+        size_t idx = (x - base) / sizeof(TransItem);
+        return reinterpret_cast<TransSlot*>(base + hot_size)[idx];
+    }
+    static const TransSlot& wdata(const TransItem* item) {
+        return wdata(const_cast<TransItem*>(item));
+    }
+};
+
+inline TransSlot& TransItem::wdata() {
+    return TransItemChunk::wdata(this);
+}
+inline const TransSlot& TransItem::wdata() const {
+    return TransItemChunk::wdata(this);
+}
+#endif
+
+
 class TransProxy {
   public:
     TransProxy(Transaction& t, TransItem& item)
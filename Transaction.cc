@@ -18,9 +18,18 @@ static void __attribute__((used)) check_static_assertions() {
 
 void Transaction::initialize() {
     static_assert(tset_initial_capacity % tset_chunk == 0, "tset_initial_capacity not an even multiple of tset_chunk");
+#if STO_TRANSITEM_SPLIT
+    static_assert(TransItemChunk::nitems == tset_chunk, "TransItemChunk does not match tset_chunk");
+    static_assert(tset_initial_capacity == tset_chunk, "split tset0_ must be a single chunk");
+#endif
     hash_base_ = 32768;
     tset_size_ = 0;
     lrng_state_ = 12897;
+    dup_indexed_ = dup_mask_ = 0;
+    dup_table_ = dup_prev_ = nullptr;
+#if STO_TRANSITEM_SPLIT
+    tset0_ = TransItemChunk::make();
+#endif
     for (unsigned i = 0; i != tset_initial_capacity / tset_chunk; ++i)
         tset_[i] = &tset0_[i * tset_chunk];
     for (unsigned i = tset_initial_capacity / tset_chunk; i != arraysize(tset_); ++i)
@@ -30,17 +39,29 @@ void Transaction::initialize() {
 Transaction::~Transaction() {
     if (in_progress())
         silent_abort();
+    delete[] dup_table_;
+    delete[] dup_prev_;
+#if STO_TRANSITEM_SPLIT
+    for (unsigned i = 0; i != arraysize(tset_); ++i)
+        if (tset_[i])
+            TransItemChunk::free(tset_[i]);
+#else
     TransItem* live = tset0_;
     for (unsigned i = 0; i != arraysize(tset_); ++i, live += tset_chunk)
         if (live != tset_[i])
             delete[] tset_[i];
+#endif
 }
 
 void Transaction::refresh_tset_chunk() {
     assert(tset_size_ % tset_chunk == 0);
     assert(tset_size_ < tset_max_capacity);
     if (!tset_[tset_size_ / tset_chunk])
+#if STO_TRANSITEM_SPLIT
+        tset_[tset_size_ / tset_chunk] = TransItemChunk::make();
+#else
         tset_[tset_size_ / tset_chunk] = new TransItem[tset_chunk];
+#endif
     tset_next_ = tset_[tset_size_ / tset_chunk];
 }
 
@@ -71,15 +92,50 @@ void* Transaction::epoch_advancer(void*) {
     return NULL;
 }
 
-bool Transaction::preceding_duplicate_read(TransItem* needle) const {
-    const TransItem* it = nullptr;
-    for (unsigned tidx = 0; ; ++tidx) {
-        it = (tidx % tset_chunk ? it + 1 : tset_[tidx / tset_chunk]);
-        if (it == needle)
-            return false;
-        if (it->owner() == needle->owner() && it->key_ == needle->key_
-            && it->has_read())
+bool Transaction::preceding_duplicate_read(TransItem* needle, unsigned needle_tidx) const {
+    if (needle_tidx < dup_linear_limit) {
+        const TransItem* it = nullptr;
+        for (unsigned tidx = 0; ; ++tidx) {
+            it = (tidx % tset_chunk ? it + 1 : tset_[tidx / tset_chunk]);
+            if (it == needle)
+                return false;
+            if (it->owner() == needle->owner() && it->key_ == needle->key_
+                && it->has_read())
+                return true;
+        }
+    }
+    if (dup_indexed_ <= needle_tidx)
+        update_dup_index();
+    for (unsigned p = dup_prev_[needle_tidx]; p; p = dup_prev_[p - 1])
+        if (tset_item(p - 1)->has_read())
             return true;
+    return false;
+}
+
+void Transaction::update_dup_index() const {
+    if (!dup_table_ || tset_size_ * 2 > dup_mask_ + 1) {
+        unsigned cap = 1024;
+        while (cap < tset_size_ * 4)
+            cap *= 2;
+        delete[] dup_table_;
+        delete[] dup_prev_;
+        dup_table_ = new unsigned[cap];
+        dup_prev_ = new unsigned[cap / 2];
+        dup_mask_ = cap - 1;
+        dup_indexed_ = 0;
+    }
+    if (dup_indexed_ == 0)
+        memset(dup_table_, 0, sizeof(unsigned) * (dup_mask_ + 1));
+    for (; dup_indexed_ != tset_size_; ++dup_indexed_) {
+        const TransItem* it = tset_item(dup_indexed_);
+        unsigned h = dup_hash(it);
+        while (unsigned x = dup_table_[h]) {
+            if (tset_item(x - 1)->same_item(*it))
+                break;
+            h = (h + 1) & dup_mask_;
+        }
+        dup_prev_[dup_indexed_] = dup_table_[h];
+        dup_table_[h] = dup_indexed_ + 1;
     }
 }
 
@@ -121,7 +177,7 @@ abort:
         if (it->has_read()) {
             TXP_INCREMENT(txp_total_check_read);
             if (!it->owner()->check(*it, *this)
-                && (!may_duplicate_items_ || !preceding_duplicate_read(it))) {
+                && (!may_duplicate_items_ || !preceding_duplicate_read(it, tidx))) {
                 mark_abort_because(item, "opacity check");
                 goto abort;
             }
@@ -204,11 +260,6 @@ void Transaction::stop(bool committed, unsigned* writeset, unsigned nwriteset) {
     }
 
 after_unlock:
-    // TODO: this will probably mess up with nested transactions
-    threadinfo_t& thr = tinfo[TThread::id()];
-    if (thr.trans_end_callback)
-        thr.trans_end_callback();
-    // XXX should reset trans_end_callback after calling it...
     state_ = s_aborted + committed;
 
 #if STO_TSC_PROFILE
@@ -319,7 +370,7 @@ bool Transaction::try_commit() {
         if (it->has_read()) {
             TXP_INCREMENT(txp_total_check_read);
             if (!it->owner()->check(*it, *this)
-                && (!may_duplicate_items_ || !preceding_duplicate_read(it))) {
+                && (!may_duplicate_items_ || !preceding_duplicate_read(it, tidx))) {
                 mark_abort_because(it, "commit check");
                 goto abort;
             }
@@ -472,7 +523,7 @@ bool Transaction::try_commit_piece(
         if (it->has_read()) {
             TXP_INCREMENT(txp_total_check_read);
             if (!it->owner()->check(*it, *this)
-                && (!may_duplicate_items_ || !preceding_duplicate_read(it))) {
+                && (!may_duplicate_items_ || !preceding_duplicate_read(it, tidx))) {
                 mark_abort_because(it, "commit check");
                 goto abort;
             }
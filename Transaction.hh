@@ -4,6 +4,7 @@
 #include "compiler.hh"
 #include "small_vector.hh"
 #include "TRcu.hh"
+#include "TNuma.hh"
 #include <algorithm>
 #include <functional>
 #include <memory>
@@ -143,6 +144,8 @@ enum txp {
     txp_hash_collision,
     txp_hash_collision2,
     txp_total_searched,
+    txp_value_alloc,
+    txp_value_malloc,
 #if !STO_PROFILE_COUNTERS
     txp_count = 0
 #elif STO_PROFILE_COUNTERS == 1
@@ -245,14 +248,18 @@ struct tc_counters {
 void reportPerf();
 #define STO_SHUTDOWN() reportPerf()
 
-struct __attribute__((aligned(128))) threadinfo_t {
+// With NUMA support each thread's info gets its own pages, so
+// Transaction::numa_thread_init() can move it to the thread's node.
+#if STO_NUMA
+#define STO_THREADINFO_ALIGN 4096
+#else
+#define STO_THREADINFO_ALIGN 128
+#endif
+
+struct __attribute__((aligned(STO_THREADINFO_ALIGN))) threadinfo_t {
     using epoch_type = TRcuSet::epoch_type;
     epoch_type epoch;
     TRcuSet rcu_set;
-    // XXX(NH): these should be vectors so multiple data structures can register
-    // callbacks for these
-    std::function<void(void)> trans_start_callback;
-    std::function<void(void)> trans_end_callback;
     txp_counters p_;
     tc_counters tcs_;
     threadinfo_t()
@@ -365,6 +372,13 @@ public:
     static void rcu_quiesce() {
         tinfo[TThread::id()].epoch = 0;
     }
+    // Move this thread's threadinfo and RCU storage to the thread's NUMA
+    // node. Call once the thread is running on (or pinned to) its CPU.
+    static void numa_thread_init() {
+        threadinfo_t& thr = tinfo[TThread::id()];
+        TNuma::place(&thr, sizeof(thr), TNumaPolicy::local);
+        thr.rcu_set.rehome();
+    }
 
 #if STO_PROFILE_COUNTERS
     template <unsigned P> static void txp_account(txp_counter_type n) {
@@ -419,8 +433,6 @@ private:
 #endif
         thr.epoch = global_epochs.global_epoch;
         thr.rcu_set.clean_until(global_epochs.active_epoch);
-        if (thr.trans_start_callback)
-            thr.trans_start_callback();
         hash_base_ += tset_size_ + 1;
         tset_size_ = 0;
         tset_next_ = tset0_;
@@ -431,6 +443,7 @@ private:
         }
 #endif
         any_writes_ = any_nonopaque_ = may_duplicate_items_ = false;
+        dup_indexed_ = 0;
         first_write_ = 0;
         start_tid_ = commit_tid_ = 0;
         buf_.clear();
@@ -444,8 +457,8 @@ private:
     }
 
 #if TRANSACTION_HASHTABLE
-    static int hash(const TObject* obj, void* key) {
-        auto n = reinterpret_cast<uintptr_t>(key) + 0x4000000;
+    static int hash(const TObject* obj, const TransSlot& key) {
+        auto n = trans_slot_hash_word(key) + 0x4000000;
         n += -uintptr_t(n < 0x8000000) & (reinterpret_cast<uintptr_t>(obj) >> 4);
         //2654435761
         return (n + (n >> 16) * 9) % hash_size;
@@ -454,7 +467,7 @@ private:
 
     void refresh_tset_chunk();
 
-    TransItem* allocate_item(const TObject* obj, void* xkey) {
+    TransItem* allocate_item(const TObject* obj, TransSlot xkey) {
         if (tset_size_ && tset_size_ % tset_chunk == 0)
             refresh_tset_chunk();
         ++tset_size_;
@@ -475,11 +488,19 @@ public:
     int threadid() const {
         return threadid_;
     }
+    bool any_writes() const {
+        return any_writes_;
+    }
+    // the TID that opacity checks compare versions against (0 until the
+    // first check)
+    tid_type start_tid() const {
+        return start_tid_;
+    }
 
     // adds item for a key that is known to be new (must NOT exist in the set)
     template <typename T>
     TransProxy new_item(const TObject* obj, T key) {
-        void* xkey = Packer<T>::pack_unique(buf_, std::move(key));
+        TransSlot xkey = Packer<T>::pack_unique(buf_, std::move(key));
         return TransProxy(*this, *allocate_item(obj, xkey));
     }
 
@@ -487,14 +508,14 @@ public:
     template <typename T>
     TransProxy fresh_item(const TObject* obj, T key) {
         may_duplicate_items_ = tset_size_ > 0;
-        void* xkey = Packer<T>::pack_unique(buf_, std::move(key));
+        TransSlot xkey = Packer<T>::pack_unique(buf_, std::move(key));
         return TransProxy(*this, *allocate_item(obj, xkey));
     }
 
     // tries to find an existing item with this key, otherwise adds it
     template <typename T>
     TransProxy item(const TObject* obj, T key) {
-        void* xkey = Packer<T>::pack_unique(buf_, std::move(key));
+        TransSlot xkey = Packer<T>::pack_unique(buf_, std::move(key));
         TransItem* ti = find_item(const_cast<TObject*>(obj), xkey);
         if (!ti)
             ti = allocate_item(obj, xkey);
@@ -505,7 +526,7 @@ public:
     // in the set in some cases
     template <typename T>
     TransProxy read_item(const TObject* obj, T key) {
-        void* xkey = Packer<T>::pack_unique(buf_, std::move(key));
+        TransSlot xkey = Packer<T>::pack_unique(buf_, std::move(key));
         TransItem* ti = nullptr;
         if (any_writes_)
             ti = find_item(const_cast<TObject*>(obj), xkey);
@@ -518,14 +539,26 @@ public:
 
     template <typename T>
     OptionalTransProxy check_item(const TObject* obj, T key) const {
-        void* xkey = Packer<T>::pack_unique(buf_, std::move(key));
+        TransSlot xkey = Packer<T>::pack_unique(buf_, std::move(key));
         TransItem* ti = find_item(const_cast<TObject*>(obj), xkey);
         return OptionalTransProxy(const_cast<Transaction&>(*this), ti);
     }
 
+    // calls f(TransItem&) for each of obj's items, in the order they were
+    // added; this scans the whole transaction set
+    template <typename F>
+    void for_each_item(const TObject* obj, F f) const {
+        TransItem* it = nullptr;
+        for (unsigned tidx = 0; tidx != tset_size_; ++tidx) {
+            it = (tidx % tset_chunk ? it + 1 : tset_[tidx / tset_chunk]);
+            if (it->owner() == obj)
+                f(*it);
+        }
+    }
+
 private:
     // tries to find an existing item with this key, returns NULL if not found
-    TransItem* find_item(TObject* obj, void* xkey) const {
+    TransItem* find_item(TObject* obj, const TransSlot& xkey) const {
 #if STO_TSC_PROFILE
         TimeKeeper<tc_find_item> tk;
 #endif
@@ -568,7 +601,21 @@ private:
         return nullptr;
     }
 
-    bool preceding_duplicate_read(TransItem *it) const;
+    TransItem* tset_item(unsigned tidx) const {
+        return &tset_[tidx / tset_chunk][tidx % tset_chunk];
+    }
+
+    // Is there an item before `it` (at index `tidx`) with the same owner
+    // and key that has a read? Small transactions scan linearly; large ones
+    // use a lazily built index of (owner, key) duplicate chains.
+    bool preceding_duplicate_read(TransItem *it, unsigned tidx) const;
+    static constexpr unsigned dup_linear_limit = 64;
+    unsigned dup_hash(const TransItem* it) const {
+        uintptr_t n = (it->s_ & TransItem::owner_mask) >> 4;
+        n = n * 0x9E3779B97F4A7C15ULL + trans_slot_hash_word(it->key_);
+        return (n ^ (n >> 29)) & dup_mask_;
+    }
+    void update_dup_index() const;
 
 #if STO_DEBUG_ABORTS
     void mark_abort_because(TransItem* item, const char* reason, TVersion::type version = 0) const {
@@ -774,10 +821,21 @@ private:
     mutable tc_counter_type start_tsc_;
 #endif
     TransItem* tset_[tset_max_capacity / tset_chunk];
+    // duplicate index: dup_table_ maps (owner, key) to 1 + the index of the
+    // latest such item; dup_prev_[i] is 1 + the index of the previous item
+    // with item i's owner and key (0 means none)
+    mutable unsigned dup_indexed_;
+    mutable unsigned dup_mask_;
+    mutable unsigned* dup_table_;
+    mutable unsigned* dup_prev_;
 #if TRANSACTION_HASHTABLE
     uint16_t hashtable_[hash_size];
 #endif
+#if STO_TRANSITEM_SPLIT
+    TransItem* tset0_;
+#else
     TransItem tset0_[tset_initial_capacity];
+#endif
 
     void hard_check_opacity(TransItem* item, TransactionTid::type t);
     void stop(bool committed, unsigned* writes, unsigned nwrites);
@@ -1110,14 +1168,14 @@ template <typename T, typename... Args>
 inline TransProxy& TransProxy::add_write(Args&&... args) {
     if (!has_write()) {
         item().__or_flags(TransItem::write_bit);
-        item().wdata_ = Packer<T>::pack(t()->buf_, std::forward<Args>(args)...);
+        item().wdata() = Packer<T>::pack(t()->buf_, std::forward<Args>(args)...);
         t()->any_writes_ = true;
     } else
         // TODO: this assumes that a given writer data always has the same type.
         // this is certainly true now but we probably shouldn't assume this in general
         // (hopefully we'll have a system that can automatically call destructors and such
         // which will make our lives much easier)
-        item().wdata_ = Packer<T>::repack(t()->buf_, item().wdata_, std::forward<Args>(args)...);
+        item().wdata() = Packer<T>::repack(t()->buf_, item().wdata(), std::forward<Args>(args)...);
     return *this;
 }
 
@@ -0,0 +1,136 @@
+#pragma once
+#include <stdlib.h>
+#include <assert.h>
+#include <new>
+#include "Transaction.hh"
+
+// Per-thread, size-classed arena for MassTrans values. Size classes follow
+// stuffed_str::pad(): 16-byte steps up to `small_max`, then powers of two
+// up to `max_size`, so a stuffed_str's capacity is its whole block and it
+// can be updated in place until it outgrows its class. Small blocks are
+// carved from cache-line-aligned chunks, so a 16-byte box really costs 16
+// bytes (malloc spends 32) and boxes allocated together share cache lines;
+// larger blocks come from malloc. A freed block, including one retired
+// through Transaction::rcu_call, goes on the freeing thread's list for
+// its class and is reused from there. Blocks are never returned to malloc.
+class value_slab {
+public:
+    static constexpr size_t quantum = 16;
+    static constexpr size_t small_max = 512;
+    static constexpr size_t max_size = 65536;
+    static constexpr size_t chunk_size = 65536;
+
+    static bool fits(size_t sz) {
+        return sz <= max_size;
+    }
+    // the size of the block allocate(sz) returns
+    static size_t block_size(size_t sz) {
+        return class_size(size_class(sz));
+    }
+
+    static void* allocate(size_t sz) {
+        assert(fits(sz));
+        TXP_INCREMENT(txp_value_alloc);
+        pool& p = mine();
+        unsigned c = size_class(sz);
+        if (cell* x = p.free[c]) {
+            p.free[c] = x->next;
+            return x;
+        }
+        size_t csz = class_size(c);
+        if (csz > small_max)
+            return big_allocate(csz);
+        if (size_t(p.end - p.next) < csz)
+            refill(p);
+        void* x = p.next;
+        p.next += csz;
+        return x;
+    }
+    // `sz` must be the size passed to allocate()
+    static void deallocate(void* ptr, size_t sz) {
+        push(mine(), size_class(sz), ptr);
+    }
+    // free once no transaction can still be reading `ptr`
+    static void deallocate_rcu(void* ptr, size_t sz) {
+        static const release_table table;
+        Transaction::rcu_call(table.fn[size_class(sz)], ptr);
+    }
+
+private:
+    static constexpr unsigned nsmall = small_max / quantum;
+    // one class per power of two in (small_max, max_size]
+    static constexpr unsigned nclasses = nsmall + 7;
+    static_assert(small_max << 7 == max_size, "nclasses must match max_size");
+
+    struct cell {
+        cell* next;
+    };
+    struct pool {
+        cell* free[nclasses];
+        char* next;
+        char* end;
+    };
+
+    static pool& mine() {
+        static __thread pool p;
+        return p;
+    }
+    static unsigned size_class(size_t sz) {
+        if (sz <= small_max)
+            return sz ? (sz - 1) / quantum : 0;
+        unsigned c = nsmall;
+        for (size_t csz = small_max * 2; csz < sz; csz *= 2)
+            ++c;
+        return c;
+    }
+    static size_t class_size(unsigned c) {
+        if (c < nsmall)
+            return (c + 1) * quantum;
+        return small_max << (c - nsmall + 1);
+    }
+    static void push(pool& p, unsigned c, void* ptr) {
+        cell* x = static_cast<cell*>(ptr);
+        x->next = p.free[c];
+        p.free[c] = x;
+    }
+
+    template <unsigned C>
+    static void release(void* ptr) {
+        push(mine(), C, ptr);
+    }
+    template <unsigned C, bool = (C > 0)>
+    struct release_fill {
+        static void fill(void (**fn)(void*)) {
+            fn[C - 1] = release<C - 1>;
+            release_fill<C - 1>::fill(fn);
+        }
+    };
+    template <unsigned C>
+    struct release_fill<C, false> {
+        static void fill(void (**)(void*)) {
+        }
+    };
+    // RCU callbacks get only the pointer, so each class has its own
+    struct release_table {
+        void (*fn[nclasses])(void*);
+        release_table() {
+            release_fill<nclasses>::fill(fn);
+        }
+    };
+
+    static void* big_allocate(size_t csz) {
+        TXP_INCREMENT(txp_value_malloc);
+        void* x;
+        if (posix_memalign(&x, 64, csz) != 0)
+            throw std::bad_alloc();
+        return x;
+    }
+    static void refill(pool& p) {
+        TXP_INCREMENT(txp_value_malloc);
+        void* x;
+        if (posix_memalign(&x, 64, chunk_size) != 0)
+            throw std::bad_alloc();
+        p.next = static_cast<char*>(x);
+        p.end = p.next + chunk_size;
+    }
+};
@@ -3,6 +3,7 @@
 #include <sstream>
 #include <fstream>
 #include <set>
+#include <algorithm>
 #include <assert.h>
 #include <random>
 #include <thread>
@@ -13,6 +14,9 @@
 #include "TArray.hh"
 #include "TGeneric.hh"
 #include "Hashtable.hh"
+#include "BucketHashtable.hh"
+#include "RBTree.hh"
+#include "TSkipList.hh"
 #include "Queue.hh"
 #include "Vector.hh"
 #include "TVector.hh"
@@ -41,6 +45,9 @@
 #define USE_MASSTREE_STR 8
 #define USE_HASHTABLE_STR 9
 #define USE_ARRAY_NONOPAQUE 10
+#define USE_BUCKET_HASHTABLE 11
+#define USE_RBTREE 12
+#define USE_SKIPLIST 13
 
 // set this to USE_DATASTRUCTUREYOUWANT
 #define DATA_STRUCTURE USE_HASHTABLE
@@ -57,6 +64,9 @@
 // use unboxed strings in Masstree (only used if STRING_VALUES is set)
 #define UNBOXED_STRINGS 0
 
+// allocate Masstree int values and unboxed strings from value_slab
+#define SLAB_VALUES 0
+
 // if 1 we just print the runtime, no diagnostic information or strings
 // (makes it easier to collect data using a script)
 #define DATA_COLLECT 0
@@ -140,6 +150,12 @@ volatile mrcu_epoch_type active_epoch = 1;
 
 unsigned initial_seeds[64];
 
+// NUMA placement of data structure storage and worker threads
+// (`--numa-policy`, `--pin`)
+enum class PinMode : int {none, compact, scatter};
+TNumaPolicy numa_policy = TNumaPolicy::none;
+PinMode pin_mode = PinMode::none;
+
 
 template <int DS> struct Container {};
 
@@ -147,6 +163,9 @@ template <> struct Container<USE_ARRAY> {
     typedef TArray<value_type, ARRAY_SZ> type;
     typedef int index_type;
     static constexpr bool has_delete = false;
+    Container() {
+        v_.numa_place(numa_policy);
+    }
     value_type nontrans_get(index_type key) {
         return v_.nontrans_get(key);
     }
@@ -168,6 +187,9 @@ template <> struct Container<USE_ARRAY_NONOPAQUE> {
     typedef TArray<value_type, ARRAY_SZ, TNonopaqueWrapped> type;
     typedef int index_type;
     static constexpr bool has_delete = false;
+    Container() {
+        v_.numa_place(numa_policy);
+    }
     value_type nontrans_get(index_type key) {
         return v_.nontrans_get(key);
     }
@@ -215,7 +237,8 @@ template <> struct Container<USE_TVECTOR> {
     typedef TVector<value_type> type;
     typedef typename type::size_type index_type;
     static constexpr bool has_delete = false;
-    Container() {
+    Container()
+        : v_(numa_policy) {
         v_.nontrans_reserve(ARRAY_SZ);
         while (v_.nontrans_size() < ARRAY_SZ)
             v_.nontrans_push_back(value_type());
@@ -240,6 +263,9 @@ private:
 template <> struct Container<USE_TGENERICARRAY> {
     typedef int index_type;
     static constexpr bool has_delete = false;
+    Container() {
+        TNuma::place(a_, sizeof(a_), numa_policy);
+    }
     value_type nontrans_get(index_type key) {
         return a_[key];
     }
@@ -261,8 +287,12 @@ private:
 };
 
 template <> struct Container<USE_MASSTREE> {
-#if STRING_VALUES && UNBOXED_STRINGS
+#if STRING_VALUES && UNBOXED_STRINGS && SLAB_VALUES
+    typedef MassTrans<value_type, slab_str_struct> type;
+#elif STRING_VALUES && UNBOXED_STRINGS
     typedef MassTrans<value_type, versioned_str_struct> type;
+#elif !STRING_VALUES && SLAB_VALUES
+    typedef MassTrans<value_type, slab_value_struct<value_type>> type;
 #else
     typedef MassTrans<value_type> type;
 #endif
@@ -292,20 +322,32 @@ template <> struct Container<USE_MASSTREE> {
         return v_.transUpdate(IntStr(key).str(), value);
     }
     static void init() {
-        Transaction::epoch_advance_callback = [] (unsigned) {
-            // just advance blindly because of the way Masstree uses epochs
-            globalepoch++;
-        };
+        type::static_init();
     }
     static void thread_init(Container<USE_MASSTREE>&) {
         type::thread_init();
     }
+    void bulk_load(int n, int nthreads) {
+        std::vector<std::pair<std::string, value_type>> kvs;
+        kvs.reserve(n);
+        for (int i = 0; i < n; ++i) {
+            IntStr k(i);
+            kvs.emplace_back(std::string(k.str().s, k.str().len), val(i+1));
+        }
+        std::sort(kvs.begin(), kvs.end(), [] (const std::pair<std::string, value_type>& a,
+                                              const std::pair<std::string, value_type>& b) {
+            return a.first < b.first;
+        });
+        v_.bulk_load(kvs.begin(), kvs.end(), nthreads, /*helper_id*/1);
+    }
 private:
     type v_;
 };
 
 template <> struct Container<USE_MASSTREE_STR> {
-#if UNBOXED_STRINGS
+#if UNBOXED_STRINGS && SLAB_VALUES
+    typedef MassTrans<std::string, slab_str_struct> type;
+#elif UNBOXED_STRINGS
     typedef MassTrans<std::string, versioned_str_struct> type;
 #else
     typedef MassTrans<std::string> type;
@@ -338,10 +380,7 @@ template <> struct Container<USE_MASSTREE_STR> {
         return v_.transUpdate(IntStr(key).str(), valtostr(value));
     }
     static void init() {
-        Transaction::epoch_advance_callback = [] (unsigned) {
-            // just advance blindly because of the way Masstree uses epochs
-            globalepoch++;
-        };
+        type::static_init();
     }
     static void thread_init(Container<USE_MASSTREE_STR>&) {
         type::thread_init();
@@ -354,6 +393,9 @@ template <> struct Container<USE_HASHTABLE> {
     typedef Hashtable<int, value_type, true, static_cast<unsigned>(ARRAY_SZ/HASHTABLE_LOAD_FACTOR)> type;
     typedef int index_type;
     static constexpr bool has_delete = true;
+    Container()
+        : v_(type::initial_size, type::hasher(), type::key_equal(), numa_policy) {
+    }
     value_type nontrans_get(index_type key) {
         return v_.unsafe_get(key);
     }
@@ -378,33 +420,166 @@ template <> struct Container<USE_HASHTABLE> {
     }
     static void thread_init(Container<USE_HASHTABLE>&) {
     }
+    void bulk_load(int n, int nthreads) {
+        std::vector<std::pair<index_type, value_type>> kvs;
+        kvs.reserve(n);
+        for (int i = 0; i < n; ++i)
+            kvs.emplace_back(i, val(i+1));
+        v_.bulk_load(kvs.begin(), kvs.end(), nthreads);
+    }
 private:
     type v_;
 };
 
-template <> struct Container<USE_HASHTABLE_STR> {
-    typedef Hashtable<int, std::string, false, static_cast<unsigned>(ARRAY_SZ/HASHTABLE_LOAD_FACTOR)> type;
+// Eight slots per bucket; sized for buckets about half full.
+template <> struct Container<USE_BUCKET_HASHTABLE> {
+    typedef BucketHashtable<int, value_type, true, static_cast<unsigned>(ARRAY_SZ/4)> type;
     typedef int index_type;
     static constexpr bool has_delete = true;
+    Container()
+        : v_(type::initial_size, type::hasher(), type::key_equal(), numa_policy) {
+    }
     value_type nontrans_get(index_type key) {
-        return strtoval(v_.unsafe_get(key));
+        return v_.unsafe_get(key);
     }
     value_type transGet(index_type key) {
-        std::string v;
+        value_type v = value_type();
         v_.transGet(key, v);
-        return strtoval(v);
+        return v;
+    }
+    void transPut(index_type key, value_type value) {
+        v_.transPut(key, value);
+    }
+    bool transDelete(index_type key) {
+        return v_.transDelete(key);
+    }
+    bool transInsert(index_type key, value_type value) {
+        return v_.transInsert(key, value);
+    }
+    bool transUpdate(index_type key, value_type value) {
+        return v_.transUpdate(key, value);
+    }
+    static void init() {
+    }
+    static void thread_init(Container<USE_BUCKET_HASHTABLE>&) {
+    }
+private:
+    type v_;
+};
+
+// Measures lock-free RBTree reads. Inserts of new keys and erases still
+// serialize on the tree-wide structlock_, so write-heavy runs won't scale.
+template <> struct Container<USE_RBTREE> {
+    typedef RBTree<int, value_type, false> type;
+    typedef int index_type;
+    static constexpr bool has_delete = true;
+    value_type nontrans_get(index_type key) {
+        return v_.nontrans_find(key);
+    }
+    value_type transGet(index_type key) {
+        return v_.stamp_find(key);
+    }
+    void transPut(index_type key, value_type value) {
+        v_[key] = value;
+    }
+    bool transDelete(index_type key) {
+        return v_.erase(key);
+    }
+    bool transInsert(index_type key, value_type value) {
+        return v_.stamp_insert(key, value);
+    }
+    bool transUpdate(index_type key, value_type value) {
+        if (!v_.count(key))
+            return false;
+        v_[key] = value;
+        return true;
+    }
+    static void init() {
+    }
+    static void thread_init(Container<USE_RBTREE>&) {
+    }
+    void bulk_load(int n, int) {
+        for (int i = 0; i < n; ++i)
+            v_.nontrans_insert(i, val(i+1));
+    }
+private:
+    type v_;
+};
+
+template <> struct Container<USE_SKIPLIST> {
+    typedef TSkipList<int, value_type> type;
+    typedef int index_type;
+    static constexpr bool has_delete = true;
+    value_type nontrans_get(index_type key) {
+        value_type v = value_type();
+        v_.nontrans_find(key, v);
+        return v;
+    }
+    value_type transGet(index_type key) {
+        return v_.transGet(key);
     }
     void transPut(index_type key, value_type value) {
-        v_.transPut(key, valtostr(value));
+        v_.transPut(key, value);
     }
     bool transDelete(index_type key) {
         return v_.transDelete(key);
     }
     bool transInsert(index_type key, value_type value) {
-        return v_.transInsert(key, valtostr(value));
+        return v_.transInsert(key, value);
     }
     bool transUpdate(index_type key, value_type value) {
-        return v_.transUpdate(key, valtostr(value));
+        return v_.transUpdate(key, value);
+    }
+    static void init() {
+    }
+    static void thread_init(Container<USE_SKIPLIST>&) {
+    }
+    void bulk_load(int n, int) {
+        for (int i = 0; i < n; ++i)
+            v_.nontrans_put(i, val(i+1));
+    }
+private:
+    type v_;
+};
+
+// decimal string keys for hash-str, formatted without allocating
+struct HashStrKey {
+    char s_[16];
+    StrRef str_;
+    HashStrKey(int i)
+        : str_(s_, snprintf(s_, sizeof(s_), "%d", i)) {
+    }
+    operator StrRef() const {
+        return str_;
+    }
+};
+
+template <> struct Container<USE_HASHTABLE_STR> {
+    typedef Hashtable<std::string, std::string, false, static_cast<unsigned>(ARRAY_SZ/HASHTABLE_LOAD_FACTOR)> type;
+    typedef int index_type;
+    static constexpr bool has_delete = true;
+    Container()
+        : v_(type::initial_size, type::hasher(), type::key_equal(), numa_policy) {
+    }
+    value_type nontrans_get(index_type key) {
+        return strtoval(v_.unsafe_get(HashStrKey(key)));
+    }
+    value_type transGet(index_type key) {
+        value_type v = value_type();
+        v_.transRead(HashStrKey(key), [&v] (const std::string& s) { v = strtoval(s); });
+        return v;
+    }
+    void transPut(index_type key, value_type value) {
+        v_.transPut(HashStrKey(key), valtostr(value));
+    }
+    bool transDelete(index_type key) {
+        return v_.transDelete(HashStrKey(key));
+    }
+    bool transInsert(index_type key, value_type value) {
+        return v_.transInsert(HashStrKey(key), valtostr(value));
+    }
+    bool transUpdate(index_type key, value_type value) {
+        return v_.transUpdate(HashStrKey(key), valtostr(value));
     }
     static void init() {
     }
@@ -433,6 +608,7 @@ bool blindRandomWrite = true;
 double zipf_skew = 1.0;
 bool profile = false;
 bool dump_trace = false;
+bool use_bulk_load = false;
 
 bool stop = false; // global stop signal
 
@@ -444,14 +620,31 @@ bool maintain_true_array_state = true;
 int true_array_state[ARRAY_SZ];
 #endif
 
+// containers with a bulk_load(n, nthreads) member can load in parallel
+template <typename T>
+auto try_bulk_load(T& a, int) -> decltype(a.bulk_load(0, 0), bool()) {
+  a.bulk_load(prepopulate, nthreads);
+  return true;
+}
+template <typename T>
+bool try_bulk_load(T&, long) {
+  return false;
+}
+
 template <typename T>
 void prepopulate_func(T& a) {
-  for (int i = 0; i < prepopulate; ++i) {
-      TRANSACTION {
-          a.transPut(i, val(i+1));
-      } RETRY(false);
+  struct timeval tv1, tv2;
+  gettimeofday(&tv1, NULL);
+  if (!use_bulk_load || !try_bulk_load(a, 0)) {
+    for (int i = 0; i < prepopulate; ++i) {
+        TRANSACTION {
+            a.transPut(i, val(i+1));
+        } RETRY(false);
+    }
   }
-  std::cout << "Done prepopulating " << std::endl;
+  gettimeofday(&tv2, NULL);
+  printf("Done prepopulating in %f sec\n",
+         (tv2.tv_sec-tv1.tv_sec) + (tv2.tv_usec-tv1.tv_usec)/1000000.0);
 }
 
 void prepopulate_func(int *array) {
@@ -1413,12 +1606,14 @@ struct QTester {
 
 void* xorrunfunc(void* x) {
     QTester* qt = (QTester*) x;
+    numa_thread_setup(qt->me);
     Qxordeleterun(qt->me);
     return nullptr;
 } 
 
 void* transferrunfunc(void* x) {
     QTester* qt = (QTester*) x;
+    numa_thread_setup(qt->me);
     Qtransferrun(qt->me);
     return nullptr;
 } 
@@ -1446,8 +1641,18 @@ struct TesterPair {
     int me;
 };
 
+// Pin worker `me` according to `--pin` and move its per-thread STO state
+// to its NUMA node.
+void numa_thread_setup(int me) {
+    TThread::set_id(me);
+    if (pin_mode != PinMode::none)
+        TNuma::pin_thread(TNuma::thread_cpu(me, pin_mode == PinMode::scatter));
+    Transaction::numa_thread_init();
+}
+
 void* runfunc(void* x) {
     TesterPair* tp = (TesterPair*) x;
+    numa_thread_setup(tp->me);
     tp->t->run(tp->me);
     return nullptr;
 }
@@ -1487,7 +1692,10 @@ void print_time(double time) {
     {name, desc, 7, new type<7, ## __VA_ARGS__>},     \
     {name, desc, 8, new type<8, ## __VA_ARGS__>},     \
     {name, desc, 9, new type<9, ## __VA_ARGS__>},     \
-    {name, desc, 10, new type<10, ## __VA_ARGS__>}
+    {name, desc, 10, new type<10, ## __VA_ARGS__>},    \
+    {name, desc, 11, new type<11, ## __VA_ARGS__>},    \
+    {name, desc, 12, new type<12, ## __VA_ARGS__>},    \
+    {name, desc, 13, new type<13, ## __VA_ARGS__>}
 
 struct Test {
     const char* name;
@@ -1518,6 +1726,10 @@ struct {
     {"hashtable", USE_HASHTABLE},
     {"hash", USE_HASHTABLE},
     {"hash-str", USE_HASHTABLE_STR},
+    {"hash-bucket", USE_BUCKET_HASHTABLE},
+    {"rbtree-reads", USE_RBTREE},
+    {"rbtree", USE_RBTREE},
+    {"skiplist", USE_SKIPLIST},
     {"masstree", USE_MASSTREE},
     {"mass", USE_MASSTREE},
     {"masstree-str", USE_MASSTREE_STR},
@@ -1528,7 +1740,7 @@ struct {
 };
 
 enum {
-    opt_test = 1, opt_nrmyw, opt_check, opt_profile, opt_dump, opt_nthreads, opt_ntrans, opt_opspertrans, opt_opspertrans_ro, opt_writepercent, opt_readonlypercent, opt_blindrandwrites, opt_prepopulate, opt_seed, opt_skew
+    opt_test = 1, opt_nrmyw, opt_check, opt_profile, opt_dump, opt_nthreads, opt_ntrans, opt_opspertrans, opt_opspertrans_ro, opt_writepercent, opt_readonlypercent, opt_blindrandwrites, opt_prepopulate, opt_seed, opt_skew, opt_pin, opt_numa_policy, opt_bulk_load
 };
 
 static const Clp_Option options[] = {
@@ -1546,6 +1758,9 @@ static const Clp_Option options[] = {
   { "prepopulate", 0, opt_prepopulate, Clp_ValInt, Clp_Optional },
   { "seed", 's', opt_seed, Clp_ValUnsigned, 0 },
   { "skew", 0, opt_skew, Clp_ValDouble, Clp_Optional},
+  { "pin", 0, opt_pin, Clp_ValString, 0 },
+  { "numa-policy", 0, opt_numa_policy, Clp_ValString, 0 },
+  { "bulk-load", 0, opt_bulk_load, 0, Clp_Negate },
 };
 
 static void help(const char *name) {
@@ -1564,7 +1779,12 @@ Options:\n\
  --blindrandwrites, do blind random writes for random tests. makes checking impossible\n\
  --prepopulate=PREPOPULATE, prepopulate table with given number of items (default %d)\n\
  --seed=SEED\n\
- --skew=SKEW, skew parameter for zipfrw test type (default %f)\n",
+ --skew=SKEW, skew parameter for zipfrw test type (default %f)\n\
+ --pin=none|compact|scatter, pin worker threads to CPUs, filling NUMA nodes\n\
+   in order (compact) or round-robin (scatter) (default none)\n\
+ --numa-policy=none|local|interleave|partition, NUMA placement of data\n\
+   structure storage (default none)\n\
+ --bulk-load, prepopulate hashtable/masstree with parallel bulk_load\n",
          name, nthreads, ntrans, opspertrans, write_percent, readonly_percent, prepopulate, zipf_skew);
   printf("\nTests:\n");
   size_t testidx = 0;
@@ -1655,6 +1875,23 @@ int main(int argc, char *argv[]) {
     case opt_skew:
         zipf_skew = clp->val.d;
         break;
+    case opt_pin:
+        if (strcmp(clp->vstr, "none") == 0)
+            pin_mode = PinMode::none;
+        else if (strcmp(clp->vstr, "compact") == 0)
+            pin_mode = PinMode::compact;
+        else if (strcmp(clp->vstr, "scatter") == 0)
+            pin_mode = PinMode::scatter;
+        else
+            help(argv[0]);
+        break;
+    case opt_numa_policy:
+        if (!TNuma::parse_policy(clp->vstr, numa_policy))
+            help(argv[0]);
+        break;
+    case opt_bulk_load:
+        use_bulk_load = !clp->negated;
+        break;
     default:
       help(argv[0]);
     }
@@ -0,0 +1,83 @@
+// Stress test for duplicate-read detection in large transactions.
+//
+// Each transaction creates `--nitems` items with new_item/fresh_item, reading
+// every key twice. The second read of each key fails check(), so commit has
+// to find the preceding duplicate read for half of the transaction set.
+#include <iostream>
+#include <assert.h>
+#include <sys/time.h>
+#include "Transaction.hh"
+#include "clp.h"
+
+class DupObject : public TObject {
+public:
+    static constexpr TransItem::flags_type stale_bit = TransItem::user0_bit;
+
+    void read_twice(uintptr_t key) {
+        Sto::new_item(this, key).add_read(0);
+        Sto::fresh_item(this, key).add_read(0).add_flags(stale_bit);
+    }
+    void write(uintptr_t key) {
+        Sto::new_item(this, key).add_write(0);
+    }
+
+    bool lock(TransItem&, Transaction&) override {
+        return true;
+    }
+    bool check(TransItem& item, Transaction&) override {
+        return !item.has_flag(stale_bit);
+    }
+    void install(TransItem&, Transaction&) override {
+    }
+    void unlock(TransItem&) override {
+    }
+};
+
+static const Clp_Option options[] = {
+    { "nitems", 'n', 'n', Clp_ValInt, 0 },
+    { "ntrans", 't', 't', Clp_ValInt, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    int nitems = 10000;
+    int ntrans = 100;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'n':
+            nitems = clp->val.i;
+            break;
+        case 't':
+            ntrans = clp->val.i;
+            break;
+        default:
+            abort();
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nitems < 2 || nitems > 32000) {
+        printf("--nitems must be between 2 and 32000\n");
+        exit(1);
+    }
+
+    DupObject obj;
+    struct timeval tv1, tv2;
+    gettimeofday(&tv1, NULL);
+    for (int t = 0; t < ntrans; ++t) {
+        TRANSACTION {
+            // leave room for the write that makes this a read/write txn
+            for (int i = 0; i < (nitems - 1) / 2; ++i)
+                obj.read_twice(uintptr_t(i));
+            obj.write(uintptr_t(nitems));
+        } RETRY(false);
+    }
+    gettimeofday(&tv2, NULL);
+
+    double sec = (tv2.tv_sec - tv1.tv_sec) + (tv2.tv_usec - tv1.tv_usec) / 1000000.0;
+    printf("%d transactions of %d items: %f sec (%f txns/sec)\n",
+           ntrans, nitems, sec, ntrans / sec);
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Growth benchmark for Hashtable's incremental resize.
+//
+// Worker threads insert keys 0..`--nkeys`-1 in transactions of `--batch`
+// puts into a table that starts with `--initial` buckets, reporting insert
+// throughput for each decade of table size (1K, 10K, ..., nkeys keys). Each
+// put also looks up an existing key, so lookups run against a table that
+// is being migrated. `--load-factor=0` disables growth; combine it with a
+// large `--initial` to compare against a presized table.
+#include <iostream>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Transaction.hh"
+#include "Hashtable.hh"
+#include "clp.h"
+
+typedef Hashtable<int, int> table_type;
+
+struct phase {
+    table_type* h;
+    int first;
+    int last;
+    int nthreads;
+    int batch;
+};
+
+struct worker {
+    const phase* p;
+    int me;
+};
+
+static void* run_worker(void* x) {
+    worker* w = (worker*) x;
+    const phase* p = w->p;
+    TThread::set_id(w->me);
+    int step = p->nthreads * p->batch;
+    for (int k = p->first + w->me * p->batch; k < p->last; k += step) {
+        int end = std::min(k + p->batch, p->last);
+        TRANSACTION {
+            for (int i = k; i < end; ++i) {
+                p->h->transPut(i, i);
+                int v;
+                p->h->transGet(i / 2, v);
+            }
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const Clp_Option options[] = {
+    { "nkeys", 'n', 'n', Clp_ValInt, 0 },
+    { "nthreads", 'j', 'j', Clp_ValInt, 0 },
+    { "initial", 'i', 'i', Clp_ValInt, 0 },
+    { "load-factor", 'l', 'l', Clp_ValDouble, 0 },
+    { "batch", 'b', 'b', Clp_ValInt, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    int nkeys = 10000000;
+    int nthreads = 4;
+    int initial = 1024;
+    double load_factor = HASHTABLE_MAX_LOAD_FACTOR;
+    int batch = 10;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'n':
+            nkeys = clp->val.i;
+            break;
+        case 'j':
+            nthreads = clp->val.i;
+            break;
+        case 'i':
+            initial = clp->val.i;
+            break;
+        case 'l':
+            load_factor = clp->val.d;
+            break;
+        case 'b':
+            batch = clp->val.i;
+            break;
+        default:
+            printf("Usage: %s [-n NKEYS] [-j NTHREADS] [-i INITIAL_BUCKETS] [-l LOAD_FACTOR] [-b BATCH]\n", argv[0]);
+            exit(1);
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nthreads < 1 || nthreads > MAX_THREADS - 1 || nkeys < 1 || initial < 1 || batch < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    table_type* h = new table_type(initial);
+    h->max_load_factor(load_factor);
+
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+
+    double start = now();
+    int first = 0;
+    for (long long last = 1000; first < nkeys; last *= 10) {
+        phase p = {h, first, int(std::min(last, (long long) nkeys)), nthreads, batch};
+        pthread_t tids[nthreads];
+        worker workers[nthreads];
+        double t0 = now();
+        for (int i = 0; i < nthreads; ++i) {
+            workers[i] = worker{&p, i};
+            pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+        }
+        for (int i = 0; i < nthreads; ++i)
+            pthread_join(tids[i], NULL);
+        double t1 = now();
+        printf("%10d keys: %10zu buckets%s, %f sec, %.0f inserts/sec\n",
+               p.last, h->nbuckets(), h->resizing() ? " (resizing)" : "",
+               t1 - t0, (p.last - p.first) / (t1 - t0));
+        first = p.last;
+    }
+    double end = now();
+    printf("total: %d keys in %f sec (%.0f inserts/sec)\n",
+           nkeys, end - start, nkeys / (end - start));
+    h->print_stats();
+    return 0;
+}
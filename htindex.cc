@@ -0,0 +1,270 @@
+// Benchmark for SecondaryIndex, on TPC-C's customer-by-last-name pattern.
+//
+// Customers are keyed by id; each belongs to a (warehouse, district) and
+// has one of `--nlast` last names. Worker threads run `--ntrans`
+// transactions. Most are TPC-C payments by name: find the district's
+// customers with a random last name, pick the one with the median first
+// name, and add to their balance. `--renames` percent instead change a
+// random customer's last name. `--mode` picks how the name index is kept:
+//   auto: a SecondaryIndex covering first names, maintained by the table
+//   manual: a second Hashtable from name to customer ids, updated by each
+//     transaction, so lookups must read every matching customer
+// Reports throughput, and with PROFILE_COUNTERS=2 the TransItems per
+// transaction.
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Transaction.hh"
+#include "Hashtable.hh"
+#include "clp.h"
+
+enum { mode_auto, mode_manual };
+
+struct customer {
+    int warehouse;
+    int district;
+    int last;
+    int first;
+    int64_t balance;
+};
+
+static constexpr int ndistricts = 10;
+
+typedef Hashtable<int, customer> customer_table;
+// covers first names
+typedef SecondaryIndex<int, customer, uint64_t, int> name_index;
+// (first name, customer id)
+typedef std::pair<int, int> name_cover;
+typedef Hashtable<uint64_t, std::vector<int>> manual_index;
+
+struct params {
+    int nwarehouses;
+    int ncustomers;   // per district
+    int nlast;
+    int ntrans;
+    int renames;
+    int mode;
+};
+
+struct db {
+    customer_table customers;
+    name_index* index;
+    manual_index* manual;
+    db(size_t n)
+        : customers(n), index(nullptr), manual(nullptr) {
+    }
+};
+
+struct worker {
+    db* d;
+    const params* p;
+    int me;
+};
+
+static uint64_t name_key(int warehouse, int district, int last) {
+    return ((uint64_t) warehouse * ndistricts + district) << 32 | last;
+}
+static uint64_t name_key(const customer& c) {
+    return name_key(c.warehouse, c.district, c.last);
+}
+
+static void payment_auto(db* d, uint64_t sk, int amount) {
+    local_vector<name_cover, 16> found;
+    d->index->transLookup(sk, [&] (const int& id, const int& first) {
+            found.push_back(name_cover(first, id));
+        });
+    if (found.empty())
+        return;
+    std::sort(found.begin(), found.end());
+    d->customers.transApply(found[(found.size() - 1) / 2].second,
+                            [amount] (customer& c) { c.balance += amount; });
+}
+
+static void payment_manual(db* d, uint64_t sk, int amount) {
+    std::vector<int> ids;
+    if (!d->manual->transGet(sk, ids) || ids.empty())
+        return;
+    local_vector<name_cover, 16> found;
+    for (int id : ids) {
+        customer c = customer();
+        if (d->customers.transGet(id, c))
+            found.push_back(name_cover(c.first, id));
+    }
+    std::sort(found.begin(), found.end());
+    d->customers.transApply(found[(found.size() - 1) / 2].second,
+                            [amount] (customer& c) { c.balance += amount; });
+}
+
+static void rename_customer(db* d, int id, int last) {
+    customer c = customer();
+    if (!d->customers.transGet(id, c) || c.last == last)
+        return;
+    uint64_t old_sk = name_key(c);
+    c.last = last;
+    d->customers.transPut(id, c);
+    if (d->manual) {
+        std::vector<int> ids;
+        d->manual->transGet(old_sk, ids);
+        ids.erase(std::find(ids.begin(), ids.end(), id));
+        d->manual->transPut(old_sk, ids);
+        ids.clear();
+        d->manual->transGet(name_key(c), ids);
+        ids.push_back(id);
+        d->manual->transPut(name_key(c), ids);
+    }
+}
+
+static void* run_worker(void* x) {
+    worker* w = (worker*) x;
+    const params* p = w->p;
+    TThread::set_id(w->me);
+    unsigned seed = w->me;
+    int ndistrict_customers = p->nwarehouses * ndistricts * p->ncustomers;
+    for (int i = 0; i < p->ntrans; ++i) {
+        bool rename = int(rand_r(&seed) % 100) < p->renames;
+        int a = rand_r(&seed), b = rand_r(&seed), last = rand_r(&seed) % p->nlast;
+        TRANSACTION {
+            if (rename)
+                rename_customer(w->d, a % ndistrict_customers, last);
+            else {
+                uint64_t sk = name_key(a % p->nwarehouses, b % ndistricts, last);
+                if (p->mode == mode_auto)
+                    payment_auto(w->d, sk, 1 + b % 5000);
+                else
+                    payment_manual(w->d, sk, 1 + b % 5000);
+            }
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const Clp_Option options[] = {
+    { "warehouses", 'w', 'w', Clp_ValInt, 0 },
+    { "customers", 'c', 'c', Clp_ValInt, 0 },
+    { "nlast", 'l', 'l', Clp_ValInt, 0 },
+    { "nthreads", 'j', 'j', Clp_ValInt, 0 },
+    { "ntrans", 't', 't', Clp_ValInt, 0 },
+    { "renames", 'r', 'r', Clp_ValInt, 0 },
+    { "mode", 'm', 'm', Clp_ValString, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    int nwarehouses = 4;
+    int ncustomers = 3000;
+    int nlast = 1000;
+    int nthreads = 4;
+    int ntrans = 1000000;
+    int renames = 10;
+    int mode = mode_auto;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'w':
+            nwarehouses = clp->val.i;
+            break;
+        case 'c':
+            ncustomers = clp->val.i;
+            break;
+        case 'l':
+            nlast = clp->val.i;
+            break;
+        case 'j':
+            nthreads = clp->val.i;
+            break;
+        case 't':
+            ntrans = clp->val.i;
+            break;
+        case 'r':
+            renames = clp->val.i;
+            break;
+        case 'm':
+            if (strcmp(clp->val.s, "auto") == 0)
+                mode = mode_auto;
+            else if (strcmp(clp->val.s, "manual") == 0)
+                mode = mode_manual;
+            else
+                mode = -1;
+            break;
+        default:
+            mode = -1;
+        }
+        if (mode < 0) {
+            printf("Usage: %s [-w WAREHOUSES] [-c CUSTOMERS] [-l NLAST] [-j NTHREADS] [-t NTRANS] [-r RENAME%%] [-m auto|manual]\n", argv[0]);
+            exit(1);
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nthreads < 1 || nthreads > MAX_THREADS - 1 || nwarehouses < 1
+        || ncustomers < 1 || nlast < 1 || ntrans < 1
+        || renames < 0 || renames > 100) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    int n = nwarehouses * ndistricts * ncustomers;
+    db* d = new db(n);
+    unsigned seed = 0;
+    for (int id = 0; id < n; ++id) {
+        int district = id / ncustomers;
+        customer c = {district / ndistricts, district % ndistricts,
+                      int(rand_r(&seed) % nlast), int(rand_r(&seed)), 0};
+        d->customers.nontrans_insert(id, c);
+    }
+    if (mode == mode_auto) {
+        d->index = new name_index([] (const customer& c) { return name_key(c); },
+                                  [] (const customer& c) { return c.first; },
+                                  n);
+        d->customers.add_index(*d->index);
+    } else {
+        d->manual = new manual_index(n);
+        std::unordered_map<uint64_t, std::vector<int>> ids;
+        for (int id = 0; id < n; ++id) {
+            customer c = customer();
+            d->customers.nontrans_find(id, c);
+            ids[name_key(c)].push_back(id);
+        }
+        for (auto& x : ids)
+            d->manual->nontrans_insert(x.first, x.second);
+    }
+
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+
+    params p = {nwarehouses, ncustomers, nlast, ntrans, renames, mode};
+    Transaction::clear_stats();
+    pthread_t tids[nthreads];
+    worker workers[nthreads];
+    double t0 = now();
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i] = worker{d, &p, i};
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL);
+    double t1 = now();
+
+    double ntxns = (double) nthreads * ntrans;
+    printf("%s, %d%% renames: %f sec, %.0f txns/sec\n",
+           mode == mode_auto ? "auto" : "manual", renames,
+           t1 - t0, ntxns / (t1 - t0));
+    if (txp_count > txp_total_n) {
+        txp_counters c = Transaction::txp_counters_combined();
+        printf("  %.3f TransItems/txn\n", c.p(txp_total_n) / (double) c.p(txp_total_starts));
+    }
+    return 0;
+}
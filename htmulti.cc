@@ -0,0 +1,130 @@
+// Benchmark for Hashtable::transMultiGet.
+//
+// Loads `--nkeys` keys into a presized table, then worker threads run
+// transactions that each look up `--batch` random keys, either with
+// transMultiGet or with a loop of transGet calls (`--single`). Use a
+// table much larger than the last-level cache so lookups miss.
+#include <iostream>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Transaction.hh"
+#include "Hashtable.hh"
+#include "clp.h"
+
+typedef Hashtable<int, int> table_type;
+
+struct worker {
+    table_type* h;
+    int me;
+    int nkeys;
+    int batch;
+    int ntrans;
+    bool single;
+    size_t nfound;
+};
+
+static void* run_worker(void* x) {
+    worker* w = (worker*) x;
+    TThread::set_id(w->me);
+    std::vector<int> keys(w->batch), values(w->batch);
+    uint64_t seed = w->me * 0x9E3779B97F4A7C15ULL + 1;
+    for (int t = 0; t < w->ntrans; ++t) {
+        for (auto& k : keys) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            k = (seed >> 33) % w->nkeys;
+        }
+        size_t nfound = 0;
+        TRANSACTION {
+            if (w->single) {
+                nfound = 0;
+                for (int i = 0; i < w->batch; ++i)
+                    nfound += w->h->transGet(keys[i], values[i]);
+            } else
+                nfound = w->h->transMultiGet(keys.data(), w->batch, values.data());
+        } RETRY(true);
+        w->nfound += nfound;
+    }
+    return nullptr;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const Clp_Option options[] = {
+    { "nkeys", 'n', 'n', Clp_ValInt, 0 },
+    { "nthreads", 'j', 'j', Clp_ValInt, 0 },
+    { "batch", 'b', 'b', Clp_ValInt, 0 },
+    { "ntrans", 't', 't', Clp_ValInt, 0 },
+    { "single", 's', 's', 0, Clp_Negate }
+};
+
+int main(int argc, char* argv[]) {
+    int nkeys = 10000000;
+    int nthreads = 1;
+    int batch = 50;
+    int ntrans = 100000;
+    bool single = false;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'n':
+            nkeys = clp->val.i;
+            break;
+        case 'j':
+            nthreads = clp->val.i;
+            break;
+        case 'b':
+            batch = clp->val.i;
+            break;
+        case 't':
+            ntrans = clp->val.i;
+            break;
+        case 's':
+            single = !clp->negated;
+            break;
+        default:
+            printf("Usage: %s [-n NKEYS] [-j NTHREADS] [-b BATCH] [-t NTRANS] [--single]\n", argv[0]);
+            exit(1);
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nthreads < 1 || nthreads > MAX_THREADS - 1 || nkeys < 1 || batch < 1 || ntrans < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    table_type* h = new table_type(nkeys);
+    for (int i = 0; i < nkeys; ++i)
+        h->nontrans_insert(i, i);
+
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+
+    pthread_t tids[nthreads];
+    worker workers[nthreads];
+    double t0 = now();
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i] = worker{h, i, nkeys, batch, ntrans, single, 0};
+        pthread_create(&tids[i], NULL, run_worker, &workers[i]);
+    }
+    size_t nfound = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+        nfound += workers[i].nfound;
+    }
+    double t1 = now();
+    double nlookups = double(nthreads) * ntrans * batch;
+    assert(nfound == size_t(nlookups));
+    printf("%s: %d threads, %d keys, %d lookups/txn: %f sec, %.0f lookups/sec\n",
+           single ? "transGet" : "transMultiGet", nthreads, nkeys, batch,
+           t1 - t0, nlookups / (t1 - t0));
+    return 0;
+}
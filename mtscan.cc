@@ -0,0 +1,193 @@
+// Range scan benchmark for MassTrans.
+//
+// The tree holds `--nkeys` keys. Each worker thread runs `--ntrans`
+// read-only transactions that each read the `--scan` keys following a
+// random key, the paginated "next N after K" pattern. `--mode` picks how:
+//   query: transQuery, whose callback stops once it has enough
+//   cursor: a MassTrans::cursor with a limit
+//   summary: a cursor that summarizes whole leaves into one read each
+// `--writers` extra threads update random keys meanwhile, so scans have
+// something to validate against.
+#include <iostream>
+#include <string>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "Transaction.hh"
+#include "MassTrans.hh"
+#include "clp.h"
+
+typedef MassTrans<int> tree_type;
+
+enum { mode_query, mode_cursor, mode_summary };
+
+struct params {
+    tree_type* t;
+    int nkeys;
+    int ntrans;
+    int scan;
+    int mode;
+};
+
+struct worker {
+    const params* p;
+    int me;
+};
+
+static volatile bool writers_stop;
+
+static void make_key(char* buf, int i) {
+    sprintf(buf, "%010d", i);
+}
+
+static void* run_scanner(void* x) {
+    worker* w = (worker*) x;
+    const params* p = w->p;
+    TThread::set_id(w->me);
+    tree_type::thread_init();
+    unsigned seed = w->me;
+    char key[16];
+    for (int i = 0; i < p->ntrans; ++i) {
+        make_key(key, rand_r(&seed) % p->nkeys);
+        TRANSACTION {
+            int n = 0;
+            if (p->mode == mode_query) {
+                p->t->transQuery(key, tree_type::Str(), [&] (tree_type::Str, int) {
+                        return ++n < p->scan;
+                    });
+            } else {
+                tree_type::cursor c(*p->t, key);
+                c.set_limit(p->scan);
+                c.summarize_leaves(p->mode == mode_summary);
+                while (size_t k = c.next(p->scan))
+                    n += k;
+            }
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+static void* run_writer(void* x) {
+    worker* w = (worker*) x;
+    const params* p = w->p;
+    TThread::set_id(w->me);
+    tree_type::thread_init();
+    unsigned seed = w->me;
+    char key[16];
+    while (!writers_stop) {
+        make_key(key, rand_r(&seed) % p->nkeys);
+        TRANSACTION {
+            p->t->transPut(tree_type::Str(key), w->me);
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static const Clp_Option options[] = {
+    { "nkeys", 'n', 'n', Clp_ValInt, 0 },
+    { "nthreads", 'j', 'j', Clp_ValInt, 0 },
+    { "ntrans", 't', 't', Clp_ValInt, 0 },
+    { "scan", 's', 's', Clp_ValInt, 0 },
+    { "mode", 'm', 'm', Clp_ValString, 0 },
+    { "writers", 'w', 'w', Clp_ValInt, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    int nkeys = 1000000;
+    int nthreads = 4;
+    int ntrans = 100000;
+    int scan = 100;
+    int mode = mode_cursor;
+    int nwriters = 0;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'n':
+            nkeys = clp->val.i;
+            break;
+        case 'j':
+            nthreads = clp->val.i;
+            break;
+        case 't':
+            ntrans = clp->val.i;
+            break;
+        case 's':
+            scan = clp->val.i;
+            break;
+        case 'm':
+            if (strcmp(clp->val.s, "query") == 0)
+                mode = mode_query;
+            else if (strcmp(clp->val.s, "cursor") == 0)
+                mode = mode_cursor;
+            else if (strcmp(clp->val.s, "summary") == 0)
+                mode = mode_summary;
+            else
+                mode = -1;
+            break;
+        case 'w':
+            nwriters = clp->val.i;
+            break;
+        default:
+            mode = -1;
+        }
+        if (mode < 0) {
+            printf("Usage: %s [-n NKEYS] [-j NTHREADS] [-t NTRANS] [-s SCAN] [-m query|cursor|summary] [-w WRITERS]\n", argv[0]);
+            exit(1);
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nthreads < 1 || nwriters < 0 || nthreads + nwriters > MAX_THREADS - 1
+        || nkeys < 1 || scan < 1) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    tree_type::static_init();
+    tree_type* t = new tree_type;
+    tree_type::thread_init();
+    {
+        std::vector<std::pair<std::string, int>> kvs(nkeys);
+        char key[16];
+        for (int i = 0; i < nkeys; ++i) {
+            make_key(key, i);
+            kvs[i] = std::make_pair(std::string(key), i);
+        }
+        t->bulk_load(kvs.begin(), kvs.end(), nthreads, /*helper_id*/1);
+    }
+
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+
+    params p = {t, nkeys, ntrans, scan, mode};
+    pthread_t tids[nthreads + nwriters];
+    worker workers[nthreads + nwriters];
+    for (int i = 0; i < nthreads + nwriters; ++i)
+        workers[i] = worker{&p, i};
+    for (int i = nthreads; i < nthreads + nwriters; ++i)
+        pthread_create(&tids[i], NULL, run_writer, &workers[i]);
+    double t0 = now();
+    for (int i = 0; i < nthreads; ++i)
+        pthread_create(&tids[i], NULL, run_scanner, &workers[i]);
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL);
+    double t1 = now();
+    writers_stop = true;
+    for (int i = nthreads; i < nthreads + nwriters; ++i)
+        pthread_join(tids[i], NULL);
+
+    static const char* const mode_names[] = {"query", "cursor", "summary"};
+    printf("%s, scan-%d: %f sec, %.0f scans/sec\n", mode_names[mode], scan,
+           t1 - t0, (double) nthreads * ntrans / (t1 - t0));
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Variable-length value update benchmark for MassTrans string boxes.
+//
+// The tree holds `--nkeys` keys with string values. Each worker thread
+// runs `--ntrans` transactions that each overwrite one random key with a
+// value of random length in [`--min`, `--max`], like a store of JSON
+// blobs, so values keep outgrowing their buffers. `--mode` picks the box:
+//   malloc: versioned_str_struct
+//   slab: slab_str_struct (value_slab arena)
+// Reports throughput and the 50th/99th percentile commit latency. Built
+// with PROFILE_COUNTERS=2, it also reports value allocations and malloc
+// calls per update.
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include "Transaction.hh"
+#include "MassTrans.hh"
+#include "clp.h"
+
+enum { mode_malloc, mode_slab };
+
+struct params {
+    int nkeys;
+    int ntrans;
+    int minlen;
+    int maxlen;
+};
+
+template <typename Tree>
+struct worker {
+    Tree* t;
+    const params* p;
+    int me;
+    std::vector<uint64_t> latency;
+};
+
+static void make_key(char* buf, int i) {
+    sprintf(buf, "%010d", i);
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+template <typename Tree>
+static void* run_updater(void* x) {
+    worker<Tree>* w = (worker<Tree>*) x;
+    const params* p = w->p;
+    TThread::set_id(w->me);
+    Tree::thread_init();
+    unsigned seed = w->me;
+    char key[16];
+    std::string value(p->maxlen, 'v');
+    w->latency.reserve(p->ntrans);
+    for (int i = 0; i < p->ntrans; ++i) {
+        make_key(key, rand_r(&seed) % p->nkeys);
+        int len = p->minlen + rand_r(&seed) % (p->maxlen - p->minlen + 1);
+        std::string v(value, 0, len);
+        while (1) {
+            Sto::start_transaction();
+            try {
+                w->t->transPut(typename Tree::Str(key), v);
+                uint64_t t0 = now_ns();
+                bool committed = Sto::try_commit();
+                w->latency.push_back(now_ns() - t0);
+                if (committed)
+                    break;
+            } catch (Transaction::Abort e) {
+            }
+        }
+    }
+    return nullptr;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+template <typename Box>
+static void run(const params& p, int nthreads, const char* name) {
+    typedef MassTrans<std::string, Box> tree_type;
+    tree_type::static_init();
+    tree_type* t = new tree_type;
+    tree_type::thread_init();
+    {
+        std::vector<std::pair<std::string, std::string>> kvs(p.nkeys);
+        char key[16];
+        for (int i = 0; i < p.nkeys; ++i) {
+            make_key(key, i);
+            kvs[i] = std::make_pair(std::string(key), std::string(p.minlen, 'v'));
+        }
+        t->bulk_load(kvs.begin(), kvs.end(), nthreads, /*helper_id*/1);
+    }
+
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+
+    Transaction::clear_stats();
+    pthread_t tids[nthreads];
+    std::vector<worker<tree_type>> workers(nthreads);
+    double t0 = now();
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i].t = t;
+        workers[i].p = &p;
+        workers[i].me = i;
+        pthread_create(&tids[i], NULL, run_updater<tree_type>, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL);
+    double t1 = now();
+
+    std::vector<uint64_t> latency;
+    for (auto& w : workers)
+        latency.insert(latency.end(), w.latency.begin(), w.latency.end());
+    std::sort(latency.begin(), latency.end());
+    double nupdates = (double) nthreads * p.ntrans;
+    printf("%s, len %d-%d: %f sec, %.0f updates/sec, commit p50 %llu ns, p99 %llu ns\n",
+           name, p.minlen, p.maxlen, t1 - t0, nupdates / (t1 - t0),
+           (unsigned long long) latency[latency.size() / 2],
+           (unsigned long long) latency[latency.size() * 99 / 100]);
+    if (txp_count > txp_value_malloc) {
+        txp_counters c = Transaction::txp_counters_combined();
+        printf("  %.3f value allocations/update, %.3f malloc calls/update\n",
+               c.p(txp_value_alloc) / nupdates, c.p(txp_value_malloc) / nupdates);
+    }
+}
+
+static const Clp_Option options[] = {
+    { "nkeys", 'n', 'n', Clp_ValInt, 0 },
+    { "nthreads", 'j', 'j', Clp_ValInt, 0 },
+    { "ntrans", 't', 't', Clp_ValInt, 0 },
+    { "min", 0, 'l', Clp_ValInt, 0 },
+    { "max", 0, 'L', Clp_ValInt, 0 },
+    { "mode", 'm', 'm', Clp_ValString, 0 }
+};
+
+int main(int argc, char* argv[]) {
+    int nkeys = 1000000;
+    int nthreads = 4;
+    int ntrans = 1000000;
+    int minlen = 16;
+    int maxlen = 1024;
+    int mode = mode_slab;
+
+    Clp_Parser *clp = Clp_NewParser(argc, argv, arraysize(options), options);
+    int opt;
+    while ((opt = Clp_Next(clp)) != Clp_Done) {
+        switch (opt) {
+        case 'n':
+            nkeys = clp->val.i;
+            break;
+        case 'j':
+            nthreads = clp->val.i;
+            break;
+        case 't':
+            ntrans = clp->val.i;
+            break;
+        case 'l':
+            minlen = clp->val.i;
+            break;
+        case 'L':
+            maxlen = clp->val.i;
+            break;
+        case 'm':
+            if (strcmp(clp->val.s, "malloc") == 0)
+                mode = mode_malloc;
+            else if (strcmp(clp->val.s, "slab") == 0)
+                mode = mode_slab;
+            else
+                mode = -1;
+            break;
+        default:
+            mode = -1;
+        }
+        if (mode < 0) {
+            printf("Usage: %s [-n NKEYS] [-j NTHREADS] [-t NTRANS] [--min LEN] [--max LEN] [-m malloc|slab]\n", argv[0]);
+            exit(1);
+        }
+    }
+    Clp_DeleteParser(clp);
+
+    if (nthreads < 1 || nthreads > MAX_THREADS - 1 || nkeys < 1 || ntrans < 1
+        || minlen < 0 || maxlen < minlen) {
+        printf("bad arguments\n");
+        exit(1);
+    }
+
+    params p = {nkeys, ntrans, minlen, maxlen};
+    if (mode == mode_malloc)
+        run<versioned_str_struct>(p, nthreads, "malloc");
+    else
+        run<slab_str_struct>(p, nthreads, "slab");
+    return 0;
+}
@@ -6,6 +6,8 @@ unsigned long long rbaccount_rotation, rbaccount_flip, rbaccount_insert, rbaccou
 #include <map>
 #include <vector>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "RBTree.hh"
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -19,6 +21,8 @@ void rbaccount_report() {
 #define PAIR(k,v) std::pair<int, int>(k, v)
 typedef RBTree<int, int, true> tree_type;
 TransactionTid::type lock;
+// written by conflict tests that must validate their reads
+tree_type other;
 // initialize the tree: contains (1,1), (2,2), (3,3)
 void reset_tree(tree_type& tree) {
     TransactionGuard init;
@@ -66,6 +70,8 @@ void erase_conflict_tests() {
         assert(tree.erase(1) == 1);
         t2.use();
         assert(tree.count(1) == 1);
+        // read-only transactions commit without validating
+        other[0] = 0;
         assert(t1.try_commit());
         assert(!t2.try_commit());
         // check that the commit did its job
@@ -215,6 +221,7 @@ void mem_tests() {
         t1.use();
         // absent get of key 4
         assert(tree.count(4) == 0);
+        other[0] = 0;
         t2.use();
         tree[5] = 5;
         assert(t2.try_commit());
@@ -240,7 +247,319 @@ void mem_tests() {
     }
 }
 
-int main() {
+void order_statistics_tests() {
+    tree_type tree;
+    for (int i = 0; i < 100; ++i)
+        tree.nontrans_insert(2 * i, 2 * i);
+    int k, v;
+    {
+        TestTransaction t(1);
+        assert(tree.transCountRange(0, 200) == 100);
+        assert(tree.transCountRange(10, 20) == 5);
+        assert(tree.transCountRange(11, 21) == 5);
+        assert(tree.transCountRange(199, 300) == 0);
+        assert(tree.transCountRange(20, 10) == 0);
+        assert(tree.transSelect(0, k, v) && k == 0);
+        assert(tree.transSelect(50, k, v) && k == 100 && v == 100);
+        assert(!tree.transSelect(100, k, v));
+        // own inserts and erases count
+        tree[11] = 11;
+        assert(tree.erase(12) == 1);
+        assert(tree.transCountRange(10, 20) == 5);
+        assert(tree.transCountRange(11, 12) == 1);
+        assert(tree.transSelect(5, k, v) && k == 10);
+        assert(tree.transSelect(6, k, v) && k == 11 && v == 11);
+        assert(tree.transSelect(7, k, v) && k == 14);
+        assert(t.try_commit());
+    }
+    {
+        TestTransaction t(1);
+        assert(tree.transCountRange(0, 200) == 100);
+        assert(tree.transSelect(6, k, v) && k == 11);
+        assert(t.try_commit());
+    }
+    {
+        // an insert into the range conflicts
+        TestTransaction t1(1);
+        assert(tree.transCountRange(20, 40) == 10);
+        other[0] = 0;
+        TestTransaction t2(2);
+        tree[31] = 31;
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // one outside it doesn't
+        TestTransaction t1(1);
+        assert(tree.transCountRange(20, 40) == 11);
+        other[0] = 0;
+        TestTransaction t2(2);
+        tree[51] = 51;
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+    }
+    {
+        // nor does an erase outside it, but an erase inside does
+        TestTransaction t1(1);
+        assert(tree.transCountRange(20, 40) == 11);
+        other[0] = 0;
+        TestTransaction t2(2);
+        assert(tree.erase(150) == 1);
+        assert(t2.try_commit());
+        TestTransaction t3(3);
+        assert(tree.erase(24) == 1);
+        assert(t3.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // select depends on everything before the answer
+        TestTransaction t1(1);
+        assert(tree.transSelect(9, k, v) && k == 18);
+        other[0] = 0;
+        TestTransaction t2(2);
+        assert(tree.erase(196) == 1);
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+        TestTransaction t3(3);
+        assert(tree.transSelect(9, k, v) && k == 18);
+        other[0] = 0;
+        TestTransaction t4(4);
+        tree[3] = 3;
+        assert(t4.try_commit());
+        assert(!t3.try_commit());
+    }
+    {
+        // an uncommitted insert is invisible until it commits
+        TestTransaction t1(1);
+        tree[41] = 41;
+        TestTransaction t2(2);
+        assert(tree.transCountRange(40, 50) == 5);
+        other[0] = 0;
+        t1.use();
+        assert(t1.try_commit());
+        t2.use();
+        assert(!t2.try_commit());
+    }
+    {
+        TestTransaction t(1);
+        assert(tree.transCountRange(0, 1000) == 101);
+        for (int i = 0; i < 101; ++i) {
+            int k2;
+            assert(tree.transSelect(i, k, v));
+            if (i)
+                assert(tree.transSelect(i - 1, k2, v) && k2 < k);
+            assert(tree.transCountRange(0, k) == size_t(i));
+        }
+        assert(t.try_commit());
+    }
+}
+
+// Threads move odd keys around, so the number of keys never changes,
+// while counting and selecting over random ranges.
+struct stats_worker {
+    tree_type* tree;
+    int me;
+    int nkeys;
+    int ntrans;
+};
+
+static void* stats_run(void* x) {
+    stats_worker* w = (stats_worker*) x;
+    TThread::set_id(w->me);
+    unsigned seed = w->me;
+    for (int i = 0; i < w->ntrans; ++i) {
+        int a = 2 * (rand_r(&seed) % w->nkeys) + 1, b = 2 * (rand_r(&seed) % w->nkeys) + 1;
+        int op = rand_r(&seed) % 3;
+        size_t total = 0, below = 0;
+        int k = 0, v;
+        TRANSACTION {
+            if (op == 0)
+                total = w->tree->transCountRange(-1, 2 * w->nkeys);
+            else if (op == 1) {
+                // counts aren't opaque, so a doomed transaction can miss
+                below = -1;
+                if (w->tree->transSelect(a / 2, k, v))
+                    below = w->tree->transCountRange(-1, k);
+            } else if (w->tree->count(a) && !w->tree->count(b)) {
+                w->tree->erase(a);
+                (*w->tree)[b] = b;
+            }
+        } RETRY(true);
+        if (op == 0)
+            assert(total == size_t(w->nkeys + w->nkeys / 2));
+        else if (op == 1)
+            assert(below == size_t(a / 2));
+    }
+    return nullptr;
+}
+
+void concurrent_order_statistics_tests() {
+    const int nthreads = 4, nkeys = 2048;
+    tree_type tree;
+    // every even key, and the odd keys in the lower half
+    for (int i = 0; i < 2 * nkeys; ++i)
+        if (!(i & 1) || i < nkeys)
+            tree.nontrans_insert(i, i);
+    pthread_t tids[nthreads];
+    stats_worker workers[nthreads];
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i] = stats_worker{&tree, i, nkeys, 20000};
+        pthread_create(&tids[i], NULL, stats_run, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL);
+}
+
+static void start_epoch_advancer() {
+    pthread_t advancer;
+    pthread_create(&advancer, NULL, Transaction::epoch_advancer, NULL);
+    pthread_detach(advancer);
+}
+
+// Even keys stay put while each thread inserts and erases its own odd
+// keys, so lookups of even keys race with rotations and successor swaps
+// all over the tree but must always succeed.
+struct stress_worker {
+    tree_type* tree;
+    int me;
+    int nthreads;
+    int nkeys;
+    int ntrans;
+};
+
+static void* stress_run(void* x) {
+    stress_worker* w = (stress_worker*) x;
+    TThread::set_id(w->me);
+    unsigned seed = w->me;
+    std::vector<bool> mine(w->nkeys, false);
+    for (int i = 0; i < w->ntrans; ++i) {
+        int k = 2 * (rand_r(&seed) % w->nkeys);
+        int odd = 2 * (w->me + w->nthreads * (rand_r(&seed) % (w->nkeys / w->nthreads))) + 1;
+        bool present = mine[odd / 2];
+        TRANSACTION {
+            assert(w->tree->count(k) == 1);
+            assert(w->tree->stamp_find(k) == k);
+            if (present)
+                assert(w->tree->erase(odd) == 1);
+            else
+                (*w->tree)[odd] = odd;
+        } RETRY(true);
+        mine[odd / 2] = !present;
+    }
+    for (int j = w->me; j < w->nkeys; j += w->nthreads)
+        assert(w->tree->nontrans_contains(2 * j + 1) == mine[j]);
+    return nullptr;
+}
+
+void concurrent_tests() {
+    const int nthreads = 4, nkeys = 4096;
+    tree_type tree;
+    for (int i = 0; i < nkeys; ++i)
+        tree.nontrans_insert(2 * i, 2 * i);
+    start_epoch_advancer();
+    pthread_t tids[nthreads];
+    stress_worker workers[nthreads];
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i] = stress_worker{&tree, i, nthreads, nkeys, 20000};
+        pthread_create(&tids[i], NULL, stress_run, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], NULL);
+    for (int i = 0; i < nkeys; ++i)
+        assert(tree.nontrans_find(2 * i) == 2 * i);
+}
+
+// `rbtree bench [NKEYS]`: memory per key, then lookup-only and read-mostly
+// throughput (90% lookups, the rest split between updates, inserts, and
+// erases) from 1 to 32 threads. Inserts and erases serialize on the tree's
+// structlock_, so only the lookup-only numbers measure read scaling.
+struct bench_worker {
+    tree_type* tree;
+    int me;
+    int nkeys;
+    int lookup_pct;
+    unsigned long nops;
+};
+
+static volatile bool bench_stop;
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void* bench_run(void* x) {
+    bench_worker* w = (bench_worker*) x;
+    TThread::set_id(w->me);
+    unsigned seed = w->me + 1;
+    unsigned long nops = 0;
+    while (!bench_stop) {
+        TRANSACTION {
+            for (int i = 0; i < 10; ++i) {
+                int k = rand_r(&seed) % (2 * w->nkeys);
+                int op = rand_r(&seed) % 100;
+                if (op < w->lookup_pct)
+                    w->tree->count(k);
+                else if (op < 94 || !(k & 1))
+                    (*w->tree)[k & ~1] = op;
+                else if (op < 97)
+                    (*w->tree)[k] = op;
+                else
+                    w->tree->erase(k);
+            }
+        } RETRY(true);
+        nops += 10;
+    }
+    w->nops = nops;
+    return nullptr;
+}
+
+static long max_rss_kb() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+static double bench_once(tree_type& tree, int nkeys, int nthreads, int lookup_pct) {
+    pthread_t tids[nthreads];
+    bench_worker workers[nthreads];
+    bench_stop = false;
+    for (int i = 0; i < nthreads; ++i) {
+        workers[i] = bench_worker{&tree, i, nkeys, lookup_pct, 0};
+        pthread_create(&tids[i], NULL, bench_run, &workers[i]);
+    }
+    double t0 = now();
+    usleep(1000000);
+    bench_stop = true;
+    unsigned long nops = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(tids[i], NULL);
+        nops += workers[i].nops;
+    }
+    return nops / (now() - t0);
+}
+
+void benchmark(int nkeys) {
+    tree_type tree;
+    long rss0 = max_rss_kb();
+    for (int i = 0; i < nkeys; ++i)
+        tree.nontrans_insert(2 * i, 2 * i);
+    printf("%d keys: %.1f bytes/key\n", nkeys, (max_rss_kb() - rss0) * 1024.0 / nkeys);
+    start_epoch_advancer();
+    for (int nthreads = 1; nthreads <= 32; nthreads *= 2) {
+        double lookups = bench_once(tree, nkeys, nthreads, 100);
+        double mixed = bench_once(tree, nkeys, nthreads, 90);
+        printf("%d threads: %.0f lookups/sec, %.0f ops/sec\n", nthreads, lookups, mixed);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        benchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
     // test single-threaded operations
     {
         tree_type tree;
@@ -296,6 +615,9 @@ int main() {
     update_conflict_tests();
     insert_then_delete_tests();
     mem_tests();
+    order_statistics_tests();
+    concurrent_tests();
+    concurrent_order_statistics_tests();
     // test abort-cleanup
     std::cout << "ALL TESTS PASS!!" << std:: endl;
     return 0;
@@ -15,8 +15,8 @@ volatile mrcu_epoch_type active_epoch = 1;
 
 using namespace std;
 
-template <typename T> class IntMassTrans {
-    MassTrans<T> m_;
+template <typename T, typename Box = versioned_value_struct<T>> class IntMassTrans {
+    MassTrans<T, Box> m_;
 public:
     bool transGet(int k, T& v) {
         return m_.transGet(IntStr(k).str(), v);
@@ -342,6 +342,48 @@ void stringKeyTests() {
 #endif
 }
 
+void slabStringTests() {
+  MassTrans<std::string, slab_str_struct> m;
+  m.thread_init();
+  std::string s, big(100, 'x'), huge(100000, 'y');
+
+  {
+      TransactionGuard t;
+      assert(m.transInsert("foo", std::string("bar")));
+  }
+  {
+      // outgrows its block
+      TransactionGuard t2;
+      assert(m.transGet("foo", s));
+      assert(s == "bar");
+      assert(m.transUpdate("foo", big));
+  }
+  {
+      // fits in the larger block, so updates in place
+      TransactionGuard t3;
+      assert(m.transGet("foo", s));
+      assert(s == big);
+      assert(m.transUpdate("foo", std::string("baz")));
+  }
+  {
+      TransactionGuard t4;
+      assert(m.transGet("foo", s));
+      assert(s == "baz");
+      // too big for value_slab, so malloced
+      assert(m.transUpdate("foo", huge));
+  }
+  {
+      TransactionGuard t5;
+      assert(m.transGet("foo", s));
+      assert(s == huge);
+      assert(m.transDelete("foo"));
+  }
+  {
+      TransactionGuard t6;
+      assert(!m.transGet("foo", s));
+  }
+}
+
 void insertDeleteTest(bool shouldAbort) {
   MassTrans<int> h;
   {
@@ -404,6 +446,39 @@ void insertDeleteSeparateTest() {
   assert(!t3.try_commit());
 }
 
+void bulkLoadTest() {
+  MassTrans<int> h;
+  int n = 5000;
+  std::vector<std::pair<std::string, int>> kvs;
+  char buf[16];
+  for (int i = 0; i < n; ++i) {
+      sprintf(buf, "%08d", i);
+      kvs.push_back(std::make_pair(std::string(buf), i));
+  }
+  h.bulk_load(kvs.begin(), kvs.end(), 4, /*helper_id*/1);
+
+  {
+      TransactionGuard t;
+      int x = 0;
+      h.transQuery("", Masstree::Str(), [&] (Masstree::Str k, int v) {
+              sprintf(buf, "%08d", x);
+              assert(k == buf && v == x);
+              ++x;
+              return true;
+          });
+      assert(x == n);
+  }
+
+  {
+      // usable transactionally right away
+      TransactionGuard t2;
+      int v;
+      assert(h.transGet(kvs[n / 2].first, v) && v == n / 2);
+      assert(h.transUpdate(kvs[n / 2].first, -1));
+      assert(!h.transInsert(kvs[n - 1].first, 0));
+  }
+}
+
 void rangeQueryTest() {
   MassTrans<int> h;
   int n = 99;
@@ -445,6 +520,70 @@ void rangeQueryTest() {
   }
 }
 
+void cursorTest() {
+  typedef MassTrans<int> mt_type;
+  mt_type h;
+  {
+      TransactionGuard t_init;
+      for (int i = 10; i <= 99; ++i)
+          assert(h.transInsert(IntStr(i).str(), i+1));
+  }
+
+  {
+  TransactionGuard t;
+  mt_type::cursor c(h, "10", "50");
+  int x = 0;
+  while (size_t n = c.next(7)) {
+      for (auto& kv : c.batch())
+          assert(kv.second == std::stoi(kv.first) + 1);
+      x += n;
+  }
+  assert(x == 50-10 && c.done());
+
+  // "next 5 after 42"
+  c.seek("43");
+  assert(c.next(5) == 5 && c.batch().front().first == "43" && c.batch().back().first == "47");
+
+  mt_type::cursor r(h, "99", "90", true);
+  r.set_limit(4);
+  assert(r.next(10) == 4 && r.batch().front().first == "99" && r.batch().back().first == "96");
+  assert(r.next(10) == 0);
+
+  mt_type::cursor s(h, "20");
+  assert(s.next(3) == 3);
+  s.stop();
+  assert(s.next(3) == 0);
+  }
+
+  // own writes are visible
+  {
+  TransactionGuard t;
+  h.transPut(IntStr(15).str(), 0);
+  assert(h.transDelete(IntStr(16).str()));
+  mt_type::cursor c(h, "15", "18");
+  assert(c.next(10) == 2);
+  assert(c.batch()[0].first == "15" && c.batch()[0].second == 0);
+  assert(c.batch()[1].first == "17");
+  }
+
+  // a summarized scan still conflicts with updates of the leaves it read
+  for (int summarize = 0; summarize != 2; ++summarize) {
+      TestTransaction t1(1);
+      mt_type::cursor c(h, "10");
+      c.summarize_leaves(summarize);
+      size_t x = 0;
+      while (size_t n = c.next(100))
+          x += n;
+      assert(x == 89);
+      h.transPut(IntStr(1000).str(), 0);
+
+      TestTransaction t2(2);
+      h.transPut(IntStr(60).str(), 1);
+      assert(t2.try_commit());
+      assert(!t1.try_commit());
+  }
+}
+
 template <typename K, typename V>
 void basicQueryTests(MassTrans<K, V>& h) {
   TransactionGuard t19;
@@ -588,6 +727,9 @@ int main() {
   IntMassTrans<int> m;
   m.thread_init();
   basicMapTests(m);
+  IntMassTrans<int, slab_value_struct<int>> ms;
+  ms.thread_init();
+  basicMapTests(ms);
 
   // insert-then-delete node test
   insertDeleteTest(false);
@@ -597,9 +739,12 @@ int main() {
   insertDeleteSeparateTest();
 
   rangeQueryTest();
+  cursorTest();
+  bulkLoadTest();
 
   // string key testing
   stringKeyTests();
+  slabStringTests();
 
   linkedListTests();
   
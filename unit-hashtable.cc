@@ -0,0 +1,853 @@
+#undef NDEBUG
+#include <iostream>
+#include <assert.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include "Transaction.hh"
+#include "Hashtable.hh"
+#include "BucketHashtable.hh"
+#include "TBox.hh"
+
+void testSimple() {
+    Hashtable<int, int> h;
+    {
+        TransactionGuard t;
+        assert(h.transInsert(1, 10));
+        assert(!h.transInsert(1, 11));
+        h.transPut(2, 20);
+    }
+    {
+        TransactionGuard t;
+        int v = 0;
+        assert(h.transGet(1, v) && v == 10);
+        assert(h.transGet(2, v) && v == 20);
+        assert(!h.transGet(3, v));
+        assert(h.transDelete(2));
+        assert(!h.transUpdate(3, 30));
+    }
+    int v;
+    assert(!h.nontrans_find(2, v));
+    assert(h.nontrans_find(1, v) && v == 10);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testGrow() {
+    Hashtable<int, int> h(4);
+    h.max_load_factor(1);
+    for (int i = 0; i < 20000; ++i) {
+        TransactionGuard t;
+        h.transPut(i, i + 1);
+    }
+    assert(h.nbuckets() > 10000);
+    assert(h.size() == 20000);
+    for (int i = 0; i < 20000; ++i) {
+        TransactionGuard t;
+        int v = 0;
+        assert(h.transGet(i, v) && v == i + 1);
+    }
+    int n = 0;
+    for (auto it = h.begin(); it != h.end(); ++it)
+        ++n;
+    assert(n == 20000);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testNoGrow() {
+    Hashtable<int, int> h(4);
+    h.max_load_factor(0);
+    for (int i = 0; i < 1000; ++i)
+        h.nontrans_insert(i, i);
+    assert(h.nbuckets() == 4);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testPhantomAcrossResize() {
+    Hashtable<int, int> h(4);
+    Hashtable<int, int> other;
+    h.max_load_factor(1);
+    {
+        TestTransaction t1(1);
+        int v;
+        assert(!h.transGet(100000, v));
+        other.transPut(0, 0);
+
+        // grow the table, moving the bucket t1 observed, then insert the
+        // key t1 found missing
+        TestTransaction t2(2);
+        for (int i = 0; i < 1000; ++i)
+            h.transPut(i, i);
+        h.transPut(100000, 1);
+        assert(t2.try_commit());
+        assert(h.nbuckets() > 4);
+        assert(!t1.try_commit());
+    }
+    {
+        // a miss observed in the new table is still checked
+        TestTransaction t1(1);
+        int v;
+        assert(!h.transGet(100001, v));
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        h.transPut(100001, 1);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testAbortedInsertsDuringResize() {
+    Hashtable<int, int> h(4);
+    h.max_load_factor(1);
+    for (int i = 0; i < 500; ++i)
+        h.nontrans_insert(i, i);
+    {
+        TestTransaction t1(1);
+        for (int i = 500; i < 1000; ++i)
+            h.transInsert(i, i);
+        // t1's uncommitted inserts move along with their buckets
+        TestTransaction t2(2);
+        for (int i = 1000; i < 5000; ++i)
+            h.transPut(i, i);
+        assert(t2.try_commit());
+        t1.use();
+        Sto::silent_abort();
+    }
+    assert(h.size() == 4500);
+    int v;
+    for (int i = 0; i < 5000; ++i)
+        assert(h.nontrans_find(i, v) == (i < 500 || i >= 1000));
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testWriteConflicts() {
+    Hashtable<int, int> h;
+    Hashtable<int, int> other;
+    h.nontrans_insert(1, 1);
+    {
+        // an update of a missing key observes its bucket
+        TestTransaction t1(1);
+        assert(!h.transUpdate(5, 5));
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        h.transPut(5, 50);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // an update of an existing key checks that it still exists
+        TestTransaction t1(1);
+        assert(h.transUpdate(1, 30));
+
+        TestTransaction t2(2);
+        assert(h.transDelete(1));
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    int v;
+    assert(!h.nontrans_find(1, v));
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testLazyInserts() {
+    Hashtable<int, int> h(1);
+    Hashtable<int, int> other;
+    h.lazy_inserts(true);
+    h.nontrans_insert(0, 0);
+    {
+        // an uncommitted lazy insert is invisible and doesn't disturb
+        // absent-key reads of its bucket
+        TestTransaction t1(1);
+        assert(h.transInsert(1, 10));
+        assert(!h.transInsert(1, 11));
+        h.transPut(1, 12);
+        int v = 0;
+        assert(h.transGet(1, v) && v == 12);
+
+        TestTransaction t2(2);
+        assert(!h.transGet(2, v));
+        assert(!h.transGet(1, v));
+        other.transPut(0, 0);
+
+        // and lets a second insert of the same key proceed until commit
+        TestTransaction t3(3);
+        h.transPut(1, 13);
+
+        assert(t1.try_commit());
+        assert(!t3.try_commit());
+        assert(!t2.try_commit());
+    }
+    int v;
+    assert(h.nontrans_find(1, v) && v == 12);
+    {
+        TestTransaction t1(1);
+        assert(!h.transGet(2, v));
+        h.transPut(3, 30);
+
+        TestTransaction t2(2);
+        assert(!h.transGet(4, v));
+        other.transPut(0, 0);
+
+        // t1's own absent read survives its insert; t2's doesn't
+        assert(t1.try_commit());
+        assert(!t2.try_commit());
+    }
+    {
+        // insert then delete leaves nothing behind
+        TransactionGuard t;
+        h.transInsert(5, 50);
+        h.transInsert(6, 60);
+        assert(h.transDelete(5));
+        assert(!h.transGet(5, v));
+        assert(h.transGet(6, v) && v == 60);
+    }
+    {
+        TestTransaction t1(1);
+        h.transInsert(7, 70);
+        TestTransaction t2(2);
+        other.transPut(0, 0);
+        assert(t2.try_commit());
+        t1.use();
+        Sto::silent_abort();
+    }
+    assert(!h.nontrans_find(5, v));
+    assert(h.nontrans_find(6, v) && v == 60);
+    assert(!h.nontrans_find(7, v));
+    assert(h.size() == 4);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testPhantomStripes() {
+    typedef Hashtable<int, int, true, 1, int, std::hash<int>, std::equal_to<int>, 16> striped_type;
+    striped_type h(1);
+    Hashtable<int, int> other;
+    h.max_load_factor(0);
+    int v;
+    // find a key whose insert doesn't disturb the absent read of key 0
+    int unrelated = 1;
+    for (int ok = 0; !ok; ++unrelated) {
+        TestTransaction t1(1);
+        assert(!h.transGet(-1, v));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        h.transPut(unrelated, unrelated);
+        assert(t2.try_commit());
+        ok = t1.try_commit();
+    }
+    assert(unrelated <= 100);
+    {
+        // an insert of the key itself still conflicts
+        TestTransaction t1(1);
+        assert(!h.transGet(-1, v));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        h.transPut(-1, 1);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // as does a resize
+        h.max_load_factor(1);
+        TestTransaction t1(1);
+        assert(!h.transGet(-2, v));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        for (int i = 1000; i < 1100; ++i)
+            h.transPut(i, i);
+        assert(t2.try_commit());
+        assert(h.nbuckets() > 1);
+        assert(!t1.try_commit());
+    }
+    {
+        // deleting another key of the bucket doesn't disturb an absent read
+        Hashtable<int, int> h1(1);
+        h1.max_load_factor(0);
+        h1.nontrans_insert(1, 1);
+        TestTransaction t1(1);
+        assert(!h1.transGet(130, v));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        assert(h1.transDelete(1));
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testMultiGetPut() {
+    Hashtable<int, int> h(4);
+    h.max_load_factor(1);
+    int keys[40], values[40], out[40];
+    bool found[40];
+    for (int i = 0; i < 40; ++i) {
+        keys[i] = i * 3;
+        values[i] = i;
+    }
+    {
+        TransactionGuard t;
+        h.transMultiPut(keys, values, 20);
+        // sees its own writes
+        assert(h.transMultiGet(keys, 40, out, found) == 20);
+        for (int i = 0; i < 40; ++i)
+            assert(found[i] == (i < 20) && (i >= 20 || out[i] == i));
+    }
+    {
+        // absent keys are observed as by transGet
+        TestTransaction t1(1);
+        assert(h.transMultiGet(keys + 10, 20, out) == 10);
+        h.transPut(-1, 0);
+        TestTransaction t2(2);
+        h.transPut(keys[25], 0);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testIncrement() {
+    Hashtable<int, int> h(4);
+    h.nontrans_insert(1, 10);
+    h.nontrans_insert(2, 20);
+    {
+        // concurrent blind increments of one key both commit
+        TestTransaction t1(1);
+        assert(h.transIncrement(1, 5));
+        assert(!h.transIncrement(3, 1));
+        TestTransaction t2(2);
+        assert(h.transIncrement(1, 7));
+        assert(h.transIncrement(1, 1));
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+    }
+    int v;
+    assert(h.nontrans_find(1, v) && v == 23);
+    {
+        // reading the key afterwards adds the dependency
+        TestTransaction t1(1);
+        assert(h.transIncrement(1, 2));
+        assert(h.transGet(1, v) && v == 25);
+        TestTransaction t2(2);
+        h.transIncrement(1, 1);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    assert(h.nontrans_find(1, v) && v == 24);
+    {
+        // increments and applies compose in order, and fold into puts
+        TransactionGuard t;
+        h.transIncrement(1, 1);
+        h.transApply(1, [] (int& x) { x *= 2; });
+        h.transIncrement(1, 3);
+        h.transApply(2, [] (int& x) { x *= 3; });
+        h.transPut(4, 4);
+        h.transIncrement(4, 1);
+        h.transApply(4, [] (int& x) { x *= 10; });
+        assert(h.transGet(4, v) && v == 50);
+    }
+    assert(h.nontrans_find(1, v) && v == 53);
+    assert(h.nontrans_find(2, v) && v == 60);
+    assert(h.nontrans_find(4, v) && v == 50);
+    {
+        // a concurrent delete aborts the increment
+        TestTransaction t1(1);
+        h.transIncrement(2, 1);
+        TestTransaction t2(2);
+        assert(h.transDelete(2));
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    assert(!h.nontrans_find(2, v));
+    {
+        // a put after an increment overrides it
+        TransactionGuard t;
+        h.transIncrement(1, 100);
+        h.transPut(1, 7);
+    }
+    assert(h.nontrans_find(1, v) && v == 7);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testScan() {
+    typedef Hashtable<int, int> table_type;
+    table_type h(4);
+    for (int i = 0; i < 1000; ++i)
+        h.nontrans_insert(i, i);
+    std::atomic<long> sum(0), count(0);
+    auto add = [&] (int, int v) { sum += v; ++count; };
+    {
+        TransactionGuard t;
+        h.transScan(add);
+    }
+    assert(sum == 999 * 500 && count == 1000);
+    {
+        // a scan sees its own transaction's writes
+        TransactionGuard t;
+        h.transPut(1000, 1000);
+        h.transPut(1, 2);
+        h.transDelete(2);
+        h.transIncrement(3, 10);
+        sum = count = 0;
+        h.transScan(add);
+        assert(sum == 999 * 500 + 1000 + 1 - 2 + 10 && count == 1000);
+    }
+    int v;
+    assert(h.nontrans_find(3, v) && v == 13);
+    for (int mode = 0; mode < 3; ++mode) {
+        // updates, inserts and deletes in scanned buckets fail the scan,
+        // even once deleted nodes are removed
+        TestTransaction t1(1);
+        h.transScan(add, table_type::scan_mode::validate, 4);
+        TestTransaction t2(2);
+        if (mode == 0)
+            h.transPut(5, 0);
+        else if (mode == 1)
+            h.transInsert(-5, 0);
+        else
+            h.transDelete(6);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // nontrans writes push versions past later commit tids, which
+        // must not hide a committed update from the scan
+        table_type h1(1);
+        h1.max_load_factor(0);
+        for (int i = 0; i < 100; ++i)
+            h1.nontrans_insert(i, i);
+        for (int i = 0; i < (1 << 20); ++i)
+            h1.put(0, 0);
+        TBox<int> box;
+        TestTransaction t1(1);
+        sum = 0;
+        h1.transScan(add);
+        box = sum;
+        TestTransaction t2(2);
+        h1.transPut(5, 1000);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // changes outside the scanned buckets don't
+        size_t nb = h.nbuckets();
+        TestTransaction t1(1);
+        h.transScan(0, nb / 2, add);
+        TestTransaction t2(2);
+        int k = 0;
+        while (std::hash<int>()(k) % nb < nb / 2)
+            ++k;
+        h.transPut(k, 0);
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+    }
+    try {
+        // snapshot scans abort as soon as they see something newer than
+        // an earlier read
+        TestTransaction t1(1);
+        h.transGet(7, v);
+        TestTransaction t2(2);
+        h.transPut(7, 0);
+        assert(t2.try_commit());
+        t1.use();
+        h.transScan(add, table_type::scan_mode::snapshot, 4);
+        assert(false && "should not get here b/c opacity");
+    } catch (Transaction::Abort e) {
+    }
+    {
+        TestTransaction t1(1);
+        h.transScan(add, table_type::scan_mode::snapshot);
+        TestTransaction t2(2);
+        h.transPut(8, 0);
+        assert(t2.try_commit());
+        // read-only snapshot scans don't need validation
+        assert(t1.try_commit());
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testStringKeys() {
+    typedef Hashtable<std::string, std::string> table_type;
+    table_type h(4);
+    h.max_load_factor(1);
+    std::string long_key(40, 'x');
+    {
+        TransactionGuard t;
+        assert(h.transInsert("short", "a"));
+        assert(h.transInsert(long_key, "b"));
+        assert(h.transInsert(std::string("nul\0key", 7), "c"));
+        assert(!h.transInsert(std::string("short"), "d"));
+    }
+    for (int i = 0; i < 1000; ++i)
+        h.nontrans_insert(std::to_string(i), std::to_string(i));
+    assert(h.nbuckets() >= 1000);
+    {
+        TransactionGuard t;
+        std::string v;
+        assert(h.transGet("short", v) && v == "a");
+        assert(h.transGet(long_key, v) && v == "b");
+        assert(h.transGet(StrRef("nul\0key", 7), v) && v == "c");
+        assert(!h.transGet("nul", v));
+        // a lookup by (pointer, length) into a longer buffer
+        const char* buf = "short and more";
+        assert(h.transGet(StrRef(buf, 5), v) && v == "a");
+        assert(!h.transGet(StrRef(buf, 4), v));
+        for (int i = 0; i < 1000; i += 7)
+            assert(h.transGet(std::to_string(i), v) && v == std::to_string(i));
+        char out[8];
+        assert(h.transRead("123", [&] (const std::string& s) {
+                    memcpy(out, s.data(), s.length());
+                    out[s.length()] = 0;
+                }));
+        assert(strcmp(out, "123") == 0);
+        assert(h.transDelete(long_key));
+        h.transPut("short", "e");
+        assert(h.transGet("short", v) && v == "e");
+    }
+    std::string v;
+    assert(!h.nontrans_find(long_key, v));
+    assert(h.nontrans_find("short", v) && v == "e");
+    int n = 0;
+    for (auto it = h.begin(); it != h.end(); ++it)
+        n += (*it).first == "short";
+    assert(n == 1);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testBulkLoad() {
+    Hashtable<int, int> h(4);
+    h.nontrans_insert(7, -7);
+    std::vector<std::pair<int, int>> kvs;
+    for (int i = 0; i < 100000; ++i)
+        kvs.push_back(std::make_pair(i, i + 1));
+    kvs.push_back(std::make_pair(5, -5));
+    h.bulk_load(kvs.begin(), kvs.end(), 4);
+    assert(h.size() == 100000);
+    assert(h.nbuckets() >= 100000);
+    int v;
+    assert(h.nontrans_find(7, v) && v == -7);
+    assert(h.nontrans_find(5, v) && v == 6);
+    for (int i = 0; i < 100000; i += 7)
+        assert(h.nontrans_find(i, v) && v == (i == 7 ? -7 : i + 1));
+    for (int i = 0; i < 1000; ++i) {
+        TransactionGuard t;
+        assert(h.transDelete(i));
+        h.transPut(i + 200000, i);
+    }
+    assert(h.size() == 100000);
+    // loading into a non-empty table
+    kvs.clear();
+    for (int i = 0; i < 1000; ++i)
+        kvs.push_back(std::make_pair(i, i));
+    h.bulk_load(kvs.begin(), kvs.end(), 3);
+    assert(h.size() == 101000);
+    assert(h.nontrans_find(999, v) && v == 999);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+struct grow_args {
+    Hashtable<int, int>* h;
+    int me;
+    int nthreads;
+    int nkeys;
+};
+
+void* grow_thread(void* x) {
+    grow_args* a = (grow_args*) x;
+    TThread::set_id(a->me);
+    for (int i = a->me; i < a->nkeys; i += a->nthreads) {
+        TRANSACTION {
+            a->h->transPut(i, i);
+            int v = 0;
+            bool found = a->h->transGet(i / 2, v);
+            assert(!found || v == i / 2);
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+void testConcurrentGrow(bool lazy) {
+    Hashtable<int, int> h(1);
+    h.max_load_factor(1);
+    h.lazy_inserts(lazy);
+    const int nthreads = 4, nkeys = 200000;
+    pthread_t tids[nthreads];
+    grow_args args[nthreads];
+    for (int i = 0; i < nthreads; ++i) {
+        args[i] = grow_args{&h, i, nthreads, nkeys};
+        pthread_create(&tids[i], nullptr, grow_thread, &args[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], nullptr);
+    assert(h.size() == nkeys);
+    int v;
+    for (int i = 0; i < nkeys; ++i)
+        assert(h.nontrans_find(i, v) && v == i);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testBucketSimple() {
+    BucketHashtable<int, int> h;
+    {
+        TransactionGuard t;
+        assert(h.transInsert(1, 10));
+        assert(!h.transInsert(1, 11));
+        h.transPut(2, 20);
+        int v = 0;
+        assert(h.transGet(2, v) && v == 20);
+    }
+    {
+        TransactionGuard t;
+        int v = 0;
+        assert(h.transGet(1, v) && v == 10);
+        assert(h.transGet(2, v) && v == 20);
+        assert(!h.transGet(3, v));
+        assert(h.transUpdate(1, 12));
+        assert(h.transDelete(2));
+        assert(!h.transUpdate(3, 30));
+    }
+    int v;
+    assert(!h.nontrans_find(2, v));
+    assert(h.nontrans_find(1, v) && v == 12);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testBucketOverflow() {
+    // 4 buckets of 8 slots force overflow chains
+    BucketHashtable<int, int> h(4);
+    for (int i = 0; i < 1000; ++i) {
+        TransactionGuard t;
+        h.transPut(i, i * 2);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+        TransactionGuard t;
+        assert(h.transDelete(i));
+    }
+    for (int i = 0; i < 1000; ++i) {
+        TransactionGuard t;
+        int v = -1;
+        assert(h.transGet(i, v) == (i % 2 == 1));
+        assert(i % 2 == 0 || v == i * 2);
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testBucketInsertDelete() {
+    BucketHashtable<int, int> h(1);
+    BucketHashtable<int, int> other;
+    {
+        // a reader of a key that is deleted and whose slot is then reused
+        // must not commit
+        TestTransaction t1(1);
+        int v = 0;
+        assert(h.transGet(5, v) == false);
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        h.transPut(5, 50);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        TestTransaction t1(1);
+        int v = 0;
+        assert(h.transGet(5, v) && v == 50);
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        assert(h.transDelete(5));
+        assert(t2.try_commit());
+        TestTransaction t3(3);
+        h.transPut(6, 60);
+        assert(t3.try_commit());
+        assert(!t1.try_commit());
+    }
+    try {
+        // a slot we wrote isn't reused for another key while we run
+        TestTransaction t1(1);
+        h.transPut(6, 61);
+        TestTransaction t2(2);
+        assert(h.transDelete(6));
+        assert(t2.try_commit());
+        TestTransaction t3(3);
+        h.transPut(9, 90);
+        assert(t3.try_commit());
+        t1.use();
+        int v = 0;
+        assert(h.transGet(9, v) && v == 90);
+        assert(!t1.try_commit());
+    } catch (Transaction::Abort e) {
+    }
+    {
+        // insert then delete in one transaction
+        TransactionGuard t;
+        h.transInsert(7, 70);
+        assert(h.transDelete(7));
+        int v;
+        assert(!h.transGet(7, v));
+        h.transInsert(8, 80);
+    }
+    int v;
+    assert(!h.nontrans_find(7, v));
+    assert(h.nontrans_find(8, v) && v == 80);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testSecondaryIndex() {
+    Hashtable<int, int> h;
+    Hashtable<int, int> other;
+    h.nontrans_insert(1, 10);
+    h.nontrans_insert(2, 11);
+    // rows by tens digit, covering the whole value
+    SecondaryIndex<int, int, int, int> idx([] (const int& v) { return v / 10; },
+                                           [] (const int& v) { return v; });
+    h.add_index(idx);
+    auto sum = [&] (int sk) {
+        int s = 0;
+        idx.transLookup(sk, [&] (const int&, const int& v) { s += v; });
+        return s;
+    };
+    {
+        TransactionGuard t;
+        assert(idx.transCount(1) == 2 && sum(1) == 21);
+        assert(idx.transCount(2) == 0);
+    }
+    {
+        // insert, secondary key change, covering change
+        TransactionGuard t;
+        h.transPut(3, 20);
+        h.transPut(1, 25);
+        h.transPut(2, 12);
+    }
+    {
+        TransactionGuard t;
+        assert(idx.transCount(1) == 1 && sum(1) == 12);
+        assert(idx.transCount(2) == 2 && sum(2) == 45);
+    }
+    {
+        // delete, blind update
+        TransactionGuard t;
+        assert(h.transDelete(3));
+        assert(h.transIncrement(2, 10));
+    }
+    {
+        TransactionGuard t;
+        assert(idx.transCount(1) == 0);
+        assert(idx.transCount(2) == 2 && sum(2) == 47);
+    }
+    {
+        // a lookup fails if its key gains a row before commit
+        TestTransaction t1(1);
+        assert(idx.transCount(3) == 0);
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        h.transPut(4, 30);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // but not if only other keys change, and an aborted write
+        // leaves the index alone
+        TestTransaction t1(1);
+        assert(idx.transCount(3) == 1);
+        other.transPut(0, 0);
+
+        TestTransaction t2(2);
+        assert(h.transUpdate(1, 26));
+        TestTransaction t3(3);
+        assert(h.transUpdate(1, 39));
+
+        assert(t2.try_commit());
+        assert(!t3.try_commit());
+        assert(t1.try_commit());
+    }
+    {
+        // one transaction can read a key and add several rows to it
+        TransactionGuard t;
+        assert(idx.transCount(3) == 1);
+        h.transPut(5, 31);
+        h.transPut(6, 32);
+        h.transPut(4, 33);
+    }
+    {
+        TransactionGuard t;
+        assert(idx.transCount(2) == 2 && sum(2) == 48);
+        assert(idx.transCount(3) == 3 && sum(3) == 96);
+    }
+    // so do nontransactional writes
+    h.nontrans_insert(7, 34);
+    h.put(6, 41);
+    assert(h.nontrans_remove(5));
+    std::pair<int, int> rows[] = {{8, 35}, {9, 42}};
+    h.bulk_load(rows, rows + 2, 2);
+    {
+        TransactionGuard t;
+        assert(idx.transCount(3) == 3 && sum(3) == 102);
+        assert(idx.transCount(4) == 2 && sum(4) == 83);
+    }
+    {
+        // lookups see the transaction's own writes
+        TransactionGuard t;
+        h.transPut(1, 45);
+        assert(h.transDelete(9));
+        h.transPut(10, 27);
+        assert(h.transIncrement(2, 20));
+        assert(idx.transCount(2) == 1 && sum(2) == 27);
+        assert(idx.transCount(4) == 3 && sum(4) == 128);
+    }
+    {
+        TransactionGuard t;
+        assert(idx.transCount(2) == 1 && sum(2) == 27);
+        assert(idx.transCount(4) == 3 && sum(4) == 128);
+    }
+
+    // lazy inserts reach the index only if they commit
+    Hashtable<int, int> lazy;
+    lazy.lazy_inserts(true);
+    SecondaryIndex<int, int, int> lidx([] (const int& v) { return v % 2; });
+    lazy.add_index(lidx);
+    {
+        TestTransaction t1(1);
+        lazy.transPut(1, 1);
+        lazy.transPut(2, 3);
+        assert(lidx.transCount(1) == 2);
+        TestTransaction t2(2);
+        lazy.transPut(1, 4);
+        assert(t1.try_commit());
+        assert(!t2.try_commit());
+    }
+    {
+        TransactionGuard t;
+        std::vector<int> pks;
+        lidx.transLookup(1, [&] (const int& pk, index_no_covering) { pks.push_back(pk); });
+        std::sort(pks.begin(), pks.end());
+        assert(pks == std::vector<int>({1, 2}));
+        assert(lidx.transCount(0) == 0);
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+int main() {
+    testSimple();
+    testGrow();
+    testNoGrow();
+    testPhantomAcrossResize();
+    testAbortedInsertsDuringResize();
+    testWriteConflicts();
+    testLazyInserts();
+    testPhantomStripes();
+    testMultiGetPut();
+    testIncrement();
+    testScan();
+    testStringKeys();
+    testBulkLoad();
+    testSecondaryIndex();
+    testConcurrentGrow(false);
+    testConcurrentGrow(true);
+    testBucketSimple();
+    testBucketOverflow();
+    testBucketInsertDelete();
+    return 0;
+}
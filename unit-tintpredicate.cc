@@ -244,6 +244,8 @@ int main() {
     assert((mass::is_trivially_copyable<TIntPredicate<int>::pred_type>::value));
     assert((mass::is_trivially_copyable<TVersion>::value));
     assert((mass::is_trivially_copyable<TNonopaqueVersion>::value));
+    // 16-byte predicates are stored inline only in wide TransItems
+    assert(Packer<TIntRange<int64_t> >::is_simple == bool(STO_TRANSITEM_WIDE));
 
     // some assertions about TransactionBuffer
     {
@@ -0,0 +1,90 @@
+#undef NDEBUG
+#include <iostream>
+#include <assert.h>
+#include <string>
+#include "Transaction.hh"
+#include "TransAlloc.hh"
+
+struct Tracked {
+    static int live;
+    int x;
+    Tracked(int x) : x(x) {
+        ++live;
+    }
+    ~Tracked() {
+        --live;
+    }
+};
+int Tracked::live = 0;
+
+void testSizeClasses() {
+    assert(TransAllocPool::size_class(1) == 0);
+    assert(TransAllocPool::size_class(16) == 0);
+    assert(TransAllocPool::size_class(17) == 1);
+    assert(TransAllocPool::size_class(32) == 1);
+    assert(TransAllocPool::size_class(33) == 2);
+    assert(TransAllocPool::size_class(TransAllocPool::max_class_size) == TransAllocPool::nclasses - 1);
+    assert(TransAllocPool::size_class(TransAllocPool::max_class_size + 1) == TransAllocPool::nclasses);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testAbortReuse() {
+    TransPoolAlloc a;
+    Sto::start_transaction();
+    void* p1 = a.transMalloc(24);
+    Sto::silent_abort();
+    // an aborted block goes straight back to this thread's free list
+    void* p2;
+    {
+        TransactionGuard t;
+        p2 = a.transMalloc(30);
+    }
+    assert(p1 == p2);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testNewDelete() {
+    TransPoolAlloc a;
+    Sto::start_transaction();
+    Tracked* x = a.transNew<Tracked>(1);
+    assert(Tracked::live == 1);
+    Sto::silent_abort();
+    assert(Tracked::live == 0);
+    {
+        TransactionGuard t;
+        x = a.transNew<Tracked>(2);
+    }
+    assert(Tracked::live == 1 && x->x == 2);
+    {
+        TransactionGuard t;
+        a.transDelete(x);
+    }
+    // committed deletes wait for RCU
+    assert(Tracked::live == 1);
+    Transaction::tinfo[TThread::id()].rcu_set.clean_until(Transaction::global_epochs.global_epoch + 2);
+    assert(Tracked::live == 0);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testMallocBackend() {
+    TransAlloc a;
+    std::string* s;
+    {
+        TransactionGuard t;
+        s = a.transNew<std::string>("hello");
+    }
+    assert(*s == "hello");
+    {
+        TransactionGuard t;
+        a.transDelete(s);
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+int main() {
+    testSizeClasses();
+    testAbortReuse();
+    testNewDelete();
+    testMallocBackend();
+    return 0;
+}
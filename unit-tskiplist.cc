@@ -0,0 +1,296 @@
+#undef NDEBUG
+#include <iostream>
+#include <assert.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include "Transaction.hh"
+#include "TSkipList.hh"
+
+typedef TSkipList<int, int> list_type;
+
+static std::vector<int> keys_from(list_type& s, int lo) {
+    std::vector<int> keys;
+    s.transScan(lo, [&] (const int& k, const int&) {
+            keys.push_back(k);
+            return true;
+        });
+    return keys;
+}
+
+void testSimple() {
+    list_type s;
+    {
+        TransactionGuard t;
+        assert(s.transInsert(1, 10));
+        assert(!s.transInsert(1, 11));
+        assert(!s.transPut(2, 20));
+        int v = 0;
+        assert(s.transGet(1, v) && v == 10);
+        assert(!s.transGet(3, v));
+    }
+    {
+        TransactionGuard t;
+        int v = 0;
+        assert(s.transGet(1, v) && v == 10);
+        assert(s.transGet(2, v) && v == 20);
+        assert(s.transUpdate(1, 12));
+        assert(!s.transUpdate(3, 30));
+        assert(s.transDelete(2));
+        assert(!s.transDelete(2));
+        assert(!s.transGet(2, v));
+    }
+    int v;
+    assert(s.nontrans_find(1, v) && v == 12);
+    assert(!s.nontrans_find(2, v));
+    {
+        // insert-then-delete, and delete-then-insert
+        TransactionGuard t;
+        s.transPut(5, 50);
+        assert(s.transDelete(5));
+        assert(!s.transGet(5, v));
+        assert(s.transDelete(1));
+        assert(s.transInsert(1, 13));
+    }
+    assert(!s.nontrans_find(5, v));
+    assert(s.nontrans_find(1, v) && v == 13);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testOrder() {
+    list_type s;
+    std::vector<int> keys;
+    for (int i = 0; i < 1000; ++i)
+        keys.push_back(i * 2);
+    std::random_shuffle(keys.begin(), keys.end());
+    for (int k : keys)
+        s.nontrans_put(k, k + 1);
+    {
+        TransactionGuard t;
+        std::vector<int> scanned = keys_from(s, 0);
+        assert(scanned.size() == 1000);
+        for (int i = 0; i < 1000; ++i)
+            assert(scanned[i] == i * 2);
+        int k, v;
+        assert(s.transLowerBound(501, k, v) && k == 502 && v == 503);
+        assert(s.transLowerBound(502, k, v) && k == 502);
+        assert(!s.transLowerBound(1999, k, v));
+        // own writes show up in scans
+        s.transPut(501, 0);
+        assert(s.transDelete(502));
+        assert(s.transLowerBound(501, k, v) && k == 501 && v == 0);
+        assert(s.transLowerBound(502, k, v) && k == 504);
+    }
+    {
+        TransactionGuard t;
+        std::vector<int> scanned = keys_from(s, 499);
+        assert(scanned[0] == 500 && scanned[1] == 501 && scanned[2] == 504);
+    }
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testPhantoms() {
+    list_type s, other;
+    for (int i = 0; i < 100; i += 10)
+        s.nontrans_put(i, i);
+    int k, v;
+    {
+        // absent-key read, then an insert of that key
+        TestTransaction t1(1);
+        assert(!s.transGet(15, v));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        s.transPut(15, 15);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // range scan, then an insert into the range
+        TestTransaction t1(1);
+        assert(s.transLowerBound(21, k, v) && k == 30);
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        s.transPut(25, 25);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // an insert outside the scanned range doesn't conflict
+        TestTransaction t1(1);
+        assert(s.transLowerBound(21, k, v) && k == 25);
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        s.transPut(75, 75);
+        assert(t2.try_commit());
+        assert(t1.try_commit());
+    }
+    {
+        // a delete in the range conflicts
+        TestTransaction t1(1);
+        std::vector<int> scanned;
+        s.transScan(40, [&] (const int& k, const int&) {
+                scanned.push_back(k);
+                return k < 60;
+            });
+        assert(scanned == std::vector<int>({40, 50, 60}));
+        other.transPut(0, 0);
+        TestTransaction t2(2);
+        assert(s.transDelete(50));
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // another transaction's uncommitted insert is invisible, and
+        // committing it invalidates the absent read
+        TestTransaction t1(1);
+        s.transPut(55, 55);
+        TestTransaction t2(2);
+        assert(!s.transGet(55, v));
+        other.transPut(0, 0);
+        t1.use();
+        assert(t1.try_commit());
+        t2.use();
+        assert(!t2.try_commit());
+    }
+    {
+        // an aborted insert leaves nothing behind
+        TestTransaction t1(1);
+        assert(!s.transGet(57, v));
+        s.transPut(56, 56);
+        TestTransaction t2(2);
+        s.transPut(57, 57);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    assert(!s.nontrans_find(56, v));
+    assert(s.nontrans_find(57, v));
+    {
+        // our own inserts don't invalidate our own scans
+        TransactionGuard t;
+        assert(s.transLowerBound(61, k, v) && k == 70);
+        s.transPut(65, 65);
+        assert(s.transLowerBound(61, k, v) && k == 65);
+        s.transPut(68, 68);
+    }
+    assert(s.nontrans_find(65, v) && s.nontrans_find(68, v));
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+void testWriteConflicts() {
+    list_type s;
+    s.nontrans_put(1, 1);
+    {
+        TestTransaction t1(1);
+        int v;
+        assert(s.transGet(1, v));
+        s.transPut(1, v + 1);
+        TestTransaction t2(2);
+        assert(s.transGet(1, v));
+        s.transPut(1, v + 1);
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        TestTransaction t1(1);
+        s.transPut(1, 5);
+        TestTransaction t2(2);
+        assert(s.transDelete(1));
+        assert(t2.try_commit());
+        assert(!t1.try_commit());
+    }
+    {
+        // racing inserts of the same key
+        TestTransaction t1(1);
+        assert(s.transInsert(2, 2));
+        TestTransaction t2(2);
+        try {
+            s.transInsert(2, 3);
+            assert(false);
+        } catch (Transaction::Abort e) {
+        }
+        t1.use();
+        assert(t1.try_commit());
+    }
+    int v;
+    assert(!s.nontrans_find(1, v));
+    assert(s.nontrans_find(2, v) && v == 2);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+struct stress_args {
+    list_type* s;
+    int me;
+    int nkeys;
+    int ntrans;
+};
+
+// Even keys always exist and hold values that sum to zero; threads move
+// amounts between them, scan, and insert and erase odd keys.
+void* stress_thread(void* x) {
+    stress_args* a = (stress_args*) x;
+    TThread::set_id(a->me);
+    unsigned seed = a->me;
+    for (int i = 0; i < a->ntrans; ++i) {
+        int k1 = 2 * (rand_r(&seed) % a->nkeys), k2 = 2 * (rand_r(&seed) % a->nkeys);
+        int odd = 2 * (rand_r(&seed) % a->nkeys) + 1;
+        int op = rand_r(&seed) % 4;
+        TRANSACTION {
+            if (op == 0) {
+                int sum = 0, n = 0;
+                a->s->transScan(k1, [&] (const int& k, const int& v) {
+                        if (k % 2 == 0)
+                            sum += v;
+                        return ++n < 20;
+                    });
+            } else if (op == 1) {
+                if (rand_r(&seed) % 2)
+                    a->s->transPut(odd, a->me);
+                else
+                    a->s->transDelete(odd);
+            } else {
+                int v1, v2;
+                assert(a->s->transGet(k1, v1) && a->s->transGet(k2, v2));
+                a->s->transPut(k1, v1 - 1);
+                a->s->transPut(k2, k1 == k2 ? v1 : v2 + 1);
+            }
+        } RETRY(true);
+    }
+    return nullptr;
+}
+
+void testConcurrent() {
+    list_type s;
+    const int nthreads = 4, nkeys = 2048;
+    for (int i = 0; i < nkeys; ++i)
+        s.nontrans_put(2 * i, 0);
+    pthread_t tids[nthreads];
+    stress_args args[nthreads];
+    for (int i = 0; i < nthreads; ++i) {
+        args[i] = stress_args{&s, i, nkeys, 20000};
+        pthread_create(&tids[i], nullptr, stress_thread, &args[i]);
+    }
+    for (int i = 0; i < nthreads; ++i)
+        pthread_join(tids[i], nullptr);
+    TransactionGuard t;
+    int sum = 0, last = -1, neven = 0;
+    s.transScan([&] (const int& k, const int& v) {
+            assert(k > last);
+            last = k;
+            if (k % 2 == 0) {
+                sum += v;
+                ++neven;
+            }
+            return true;
+        });
+    assert(sum == 0 && neven == nkeys);
+    printf("PASS: %s\n", __FUNCTION__);
+}
+
+int main() {
+    testSimple();
+    testOrder();
+    testPhantoms();
+    testWriteConflicts();
+    testConcurrent();
+    return 0;
+}
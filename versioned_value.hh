@@ -1,12 +1,13 @@
 #pragma once
 #include <iostream>
 #include "Interface.hh"
+#include "Transaction.hh"
+#include "ValueSlab.hh"
 #include "masstree_print.hh"
 
 // TODO(nate): ugh. really we should have a MassTrans subclass of this with the
-// deallocate_rcu functions so we 1) don't have to include Masstree headers in
-// nearly everything STO-related and 2) don't accidentally call a Masstree
-// function (deallocate_rcu) in some other context.
+// debug printers so we don't have to include Masstree headers in nearly
+// everything STO-related.
 #include "kvthread.hh"
 
 template <typename T, typename=void>
@@ -49,8 +50,9 @@ struct versioned_value_struct /*: public threadinfo::rcu_callback*/ {
     return version_;
   }
 
-  inline void deallocate_rcu(threadinfo& ti) {
-    ti.deallocate_rcu(this, sizeof(versioned_value_struct), memtag_value);
+  // free once no transaction can still be reading us
+  inline void deallocate_rcu() {
+    Transaction::rcu_delete(this);
   }
 
   // Masstree debug printer
@@ -97,10 +99,16 @@ public:
     return this;
   }
 
+  ~versioned_value_struct() {
+    delete valueptr_;
+  }
+
   void set_value(const value_type& v) {
-    //auto *old = valueptr_;
+    auto *old = valueptr_;
     valueptr_ = new value_type(std::move(v));
-    // rcu free old (HOW without threadinfo access??)
+    // concurrent readers may still hold the old value
+    if (old)
+      Transaction::rcu_delete(old);
   }
 
   const value_type& read_value() const {
@@ -114,9 +122,9 @@ public:
     return version_;
   }
 
-  inline void deallocate_rcu(threadinfo& ti) {
-    // XXX: really this one needs to be a rcu_callback so we can call destructor
-    ti.deallocate_rcu(this, sizeof(versioned_value_struct), memtag_value);
+  // runs our destructor, and so frees the value, after the grace period
+  inline void deallocate_rcu() {
+    Transaction::rcu_delete(this);
   }
   
   // Masstree debug printer
@@ -134,3 +142,32 @@ private:
   version_type version_;
   value_type* valueptr_;
 };
+
+// versioned_value_struct for small trivially copyable types, allocated
+// from the calling thread's value_slab instead of with new. An 8-byte
+// value's box takes one 16-byte cell, and boxes made by the same thread
+// (e.g. during a load) are packed together.
+template <typename T>
+struct slab_value_struct : public versioned_value_struct<T> {
+  typedef versioned_value_struct<T> base_type;
+  typedef typename base_type::value_type value_type;
+  typedef typename base_type::version_type version_type;
+  static_assert(__has_trivial_copy(T), "slab_value_struct needs a trivially copyable type");
+  static_assert(sizeof(base_type) <= value_slab::max_size, "slab_value_struct needs a small type");
+
+  slab_value_struct(const value_type& val, version_type version)
+    : base_type(val, version) {
+  }
+
+  static slab_value_struct* make(const value_type& val, version_type version) {
+    return new (value_slab::allocate(sizeof(slab_value_struct))) slab_value_struct(val, version);
+  }
+
+  slab_value_struct* resizeIfNeeded(const value_type&) {
+    return NULL;
+  }
+
+  inline void deallocate_rcu() {
+    value_slab::deallocate_rcu(this, sizeof(slab_value_struct));
+  }
+};